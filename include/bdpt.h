@@ -0,0 +1,453 @@
+#ifndef BDPT_H
+#define BDPT_H
+
+#include "hittable_list.h"
+#include "sphere.h"
+#include "material.h"
+#include "camera.h"
+#include "options.h"
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <omp.h>
+
+// bidirectional path tracing, after Veach's thesis and pbrt's BDPT. every camera sample also
+// traces a path from a random point on a DiffuseLight sphere, and every pair of vertices of
+// the two paths is connected with a shadow ray. each connection (s light vertices, t camera
+// vertices) is one strategy for building the full path; the balance heuristic weighs the
+// strategies so that small lights are mostly found from the light side, glass and the sky
+// from the camera side.
+//
+// all densities are per unit area of the surface a vertex lies on. the sky cannot be sampled
+// from the light side, so paths that escape into it only come from the camera path and keep
+// their full weight. connections that end on the camera (t = 1, light tracing) land on some
+// other pixel and are splatted into a separate buffer with atomic adds.
+
+struct PathVertex {
+	enum Kind { CameraVertex, LightVertex, SurfaceVertex };
+	Kind kind = SurfaceVertex;
+	Vec3 point;
+	// record.normal for surfaces (it faces the side the path arrived from), the outward
+	// normal for light origins, the view direction for the camera
+	Vec3 normal;
+	bool front_face = true;
+	const Material* material = nullptr;
+	// path throughput up to and including this vertex
+	Color beta;
+	// area densities of reaching this vertex from the previous one (fwd) and from the next
+	// one (rev); 0 across specular vertices
+	double pdf_fwd = 0;
+	double pdf_rev = 0;
+	bool delta = false;
+
+	bool on_surface() const { return kind != CameraVertex; }
+	bool connectible() const {
+		return kind != SurfaceVertex || (material && !material->is_specular());
+	}
+	// light this vertex sends towards `to` if it lies on an emitter
+	Color emitted(const Vec3& to) const {
+		if (!material)
+			return Color(0, 0, 0);
+		Vec3 outward = (kind == LightVertex || front_face) ? normal : -normal;
+		return (to - point).dot(outward) > 0 ? material->emitted() : Color(0, 0, 0);
+	}
+};
+
+// counts over all threads for one render
+struct BidirectionalStats {
+	long long light_paths = 0;
+	long long connections = 0;
+	long long splats = 0;
+};
+
+class BidirectionalIntegrator {
+public:
+	// max_depth bounds the bounces of a full path, as in ray_color
+	BidirectionalIntegrator(const HittableList& world, const Camera& camera, int image_width, int image_height, int max_depth)
+		: camera(camera), image_width(image_width), image_height(image_height), max_depth(max_depth),
+		  splats(static_cast<size_t>(image_width) * image_height, Color(0, 0, 0)),
+		  threads(std::max(1, omp_get_max_threads())) {
+		for (const auto& object : world.objects) {
+			auto sphere = std::dynamic_pointer_cast<Sphere>(object);
+			if (!sphere || !sphere->material || sphere->material->emitted().length_squared() <= 0)
+				continue;
+			lights.push_back(sphere.get());
+			light_area += 4.0 * M_PI * sphere->radius * sphere->radius;
+			cumulative_area.push_back(light_area);
+		}
+		// get_ray(s, t) spans s in [0, width / (width - 1)), same for t: that is the film
+		film_area = camera.viewport_area() * image_width * image_height / ((image_width - 1.0) * (image_height - 1.0));
+
+		for (auto& thread : threads) {
+			thread.camera_path.resize(max_depth + 2);
+			thread.light_path.resize(max_depth + 1);
+		}
+	}
+
+	// the light tracing buffer, and the preallocated paths of all threads
+	size_t splat_bytes() const { return splats.capacity() * sizeof(Color); }
+	size_t scratch_bytes() const {
+		size_t bytes = threads.capacity() * sizeof(ThreadState);
+		for (const auto& thread : threads)
+			bytes += (thread.camera_path.capacity() + thread.light_path.capacity()) * sizeof(PathVertex);
+		return bytes;
+	}
+
+	bool has_lights() const { return !lights.empty(); }
+
+	// one sample through viewport position (s, t): everything the strategies with t >= 2
+	// bring to this pixel. the t = 1 strategies go to splats()
+	Color sample(const Hittable& world, double s, double t, long long& rays_traced) {
+		ThreadState& thread = threads[omp_get_thread_num()];
+		Color result(0, 0, 0);
+
+		PathVertex* camera_path = thread.camera_path.data();
+		camera_path[0] = PathVertex();
+		camera_path[0].kind = PathVertex::CameraVertex;
+		camera_path[0].point = camera.position();
+		camera_path[0].normal = camera.forward();
+		camera_path[0].beta = Color(1, 1, 1);
+		Ray ray = camera.get_ray(s, t);
+		Color sky(0, 0, 0);
+		int camera_count = 1 + walk(world, ray, Color(1, 1, 1), camera_pdf(ray.direction), camera_path, max_depth + 2, rays_traced, &sky);
+		result += sky;
+
+		int light_count = 0;
+		PathVertex* light_path = thread.light_path.data();
+		if (!lights.empty()) {
+			light_count = start_light_path(world, light_path, rays_traced);
+			++thread.stats.light_paths;
+		}
+
+		for (int tc = 1; tc <= camera_count; ++tc) {
+			for (int sc = 0; sc <= light_count; ++sc) {
+				int depth = sc + tc - 2;
+				if ((sc == 1 && tc == 1) || depth < 0 || depth > max_depth)
+					continue;
+				if (tc == 1) {
+					splat(world, light_path, sc, camera_path, rays_traced, thread.stats);
+					continue;
+				}
+				result += connect(world, light_path, sc, camera_path, tc, rays_traced, thread.stats);
+			}
+		}
+		return result;
+	}
+
+	// adds the light tracing splats inside the crop to a framebuffer that holds sums over
+	// samples. a crop traces light paths for its pixels only, so each counts for more
+	void resolve_splats(std::vector<Color>& framebuffer, const Crop& crop) const {
+		double fraction = double(crop.x1 - crop.x0) * (crop.y1 - crop.y0) / (double(image_width) * image_height);
+		for (int y = crop.y0; y < crop.y1; ++y)
+			for (int x = crop.x0; x < crop.x1; ++x)
+				framebuffer[y * image_width + x] += splats[y * image_width + x] / fraction;
+	}
+
+	BidirectionalStats stats() const {
+		BidirectionalStats total;
+		for (const auto& thread : threads) {
+			total.light_paths += thread.stats.light_paths;
+			total.connections += thread.stats.connections;
+			total.splats += thread.stats.splats;
+		}
+		return total;
+	}
+
+private:
+	// preallocated per thread, so tracing a path never allocates
+	struct alignas(64) ThreadState {
+		std::vector<PathVertex> camera_path;
+		std::vector<PathVertex> light_path;
+		BidirectionalStats stats;
+	};
+
+	Camera camera;
+	int image_width;
+	int image_height;
+	int max_depth;
+	double film_area = 1;
+	std::vector<const Sphere*> lights;
+	std::vector<double> cumulative_area;
+	double light_area = 0;
+	std::vector<Color> splats;
+	std::vector<ThreadState> threads;
+
+	// density of the camera picking `direction`, per solid angle. 0 off the film
+	double camera_pdf(const Vec3& direction) const {
+		double s, t;
+		if (!camera.project(camera.position() + direction, s, t) || !on_film(s, t))
+			return 0;
+		double cosine = direction.unit_vector().dot(camera.forward());
+		return 1.0 / (film_area * cosine * cosine * cosine);
+	}
+
+	bool on_film(double s, double t) const {
+		return s >= 0 && t >= 0 && s * (image_width - 1) < image_width && t * (image_height - 1) < image_height;
+	}
+
+	// solid angle density at `from` -> area density at `to`
+	static double to_area(double pdf, const PathVertex& from, const PathVertex& to) {
+		Vec3 d = to.point - from.point;
+		double distance_squared = d.length_squared();
+		if (distance_squared <= 0)
+			return 0;
+		if (to.on_surface())
+			pdf *= std::abs(to.normal.dot(d)) / std::sqrt(distance_squared);
+		return pdf / distance_squared;
+	}
+
+	// area density with which an emitter at v sends light to `to` (cosine weighted emission)
+	static double light_pdf(const PathVertex& v, const PathVertex& to) {
+		Vec3 outward = (v.kind == PathVertex::LightVertex || v.front_face) ? v.normal : -v.normal;
+		double cosine = (to.point - v.point).unit_vector().dot(outward);
+		return cosine > 0 ? to_area(cosine / M_PI, v, to) : 0;
+	}
+
+	// area density of v being picked as a light path's origin: lights by area, points uniform
+	double light_origin_pdf(const PathVertex& v) const {
+		return (v.material && v.material->emitted().length_squared() > 0 && light_area > 0) ? 1.0 / light_area : 0;
+	}
+
+	// area density at `next` of the path continuing from v, having come from prev
+	double pdf(const PathVertex& v, const PathVertex* prev, const PathVertex& next) const {
+		if (v.kind == PathVertex::LightVertex)
+			return light_pdf(v, next);
+		Vec3 to_next = (next.point - v.point).unit_vector();
+		double pdf_solid_angle = 0;
+		if (v.kind == PathVertex::CameraVertex)
+			pdf_solid_angle = camera_pdf(to_next);
+		else if (prev && v.material)
+			pdf_solid_angle = v.material->pdf((prev->point - v.point).unit_vector(), to_next, v.normal);
+		return to_area(pdf_solid_angle, v, next);
+	}
+
+	Color brdf(const PathVertex& v, const PathVertex& prev, const PathVertex& next) const {
+		return v.material->eval((prev.point - v.point).unit_vector(), (next.point - v.point).unit_vector(), v.normal);
+	}
+
+	// geometry term and visibility between two vertices
+	double geometry(const Hittable& world, const PathVertex& a, const PathVertex& b, long long& rays_traced) const {
+		Vec3 d = b.point - a.point;
+		double distance = d.length();
+		Vec3 direction = d / distance;
+		++rays_traced;
+		Occluder occluder;
+		if (world.occluded(Ray(a.point, direction), 0.001, distance * (1.0 - 1e-6), occluder))
+			return 0;
+		double g = 1.0 / (distance * distance);
+		if (a.on_surface())
+			g *= std::abs(a.normal.dot(direction));
+		if (b.on_surface())
+			g *= std::abs(b.normal.dot(direction));
+		return g;
+	}
+
+	// follows `ray` from path[0] by scattering at every hit, filling path[1 ..]. returns the
+	// vertices added. for camera paths, `sky` receives the light of a ray that escapes
+	int walk(const Hittable& world, Ray ray, Color beta, double pdf_fwd, PathVertex* path, int max_vertices, long long& rays_traced, Color* sky) const {
+		int count = 0;
+		while (count + 1 < max_vertices) {
+			HitRecord record;
+			++rays_traced;
+			if (!world.hit(ray, 0.001, INFINITY, record)) {
+				if (sky)
+					*sky = beta * sky_color(ray);
+				break;
+			}
+			PathVertex& prev = path[count];
+			PathVertex& v = path[++count];
+			v = PathVertex();
+			v.point = record.point;
+			v.normal = record.normal;
+			v.front_face = record.front_face;
+			v.material = record.material.get();
+			v.beta = beta;
+			v.pdf_fwd = to_area(pdf_fwd, prev, v);
+			if (count + 1 >= max_vertices)
+				break;
+
+			Color attenuation;
+			Ray scattered;
+			if (!record.material->scatter(ray, record, attenuation, scattered))
+				break;
+			v.delta = record.material->is_specular();
+			Vec3 to_previous = -ray.direction.unit_vector();
+			Vec3 to_next = scattered.direction.unit_vector();
+			double pdf_rev = 0;
+			pdf_fwd = 0;
+			if (!v.delta) {
+				pdf_fwd = record.material->pdf(to_previous, to_next, v.normal);
+				pdf_rev = record.material->pdf(to_next, to_previous, v.normal);
+			}
+			prev.pdf_rev = to_area(pdf_rev, v, prev);
+			beta = beta * attenuation;
+			ray = scattered;
+		}
+		return count;
+	}
+
+	// picks a light by area and a point on it, sends a cosine weighted ray out and walks it
+	int start_light_path(const Hittable& world, PathVertex* path, long long& rays_traced) const {
+		double pick = random_double() * light_area;
+		size_t index = std::min(static_cast<size_t>(std::upper_bound(cumulative_area.begin(), cumulative_area.end(), pick) - cumulative_area.begin()), lights.size() - 1);
+		const Sphere& light = *lights[index];
+		Vec3 outward = random_unit_vector();
+
+		PathVertex& origin = path[0];
+		origin = PathVertex();
+		origin.kind = PathVertex::LightVertex;
+		origin.point = light.center + light.radius * outward;
+		origin.normal = outward;
+		origin.material = light.material.get();
+		origin.pdf_fwd = 1.0 / light_area;
+		origin.beta = origin.material->emitted() * light_area;
+
+		Vec3 direction = outward + random_unit_vector();
+		if (direction.near_zero())
+			direction = outward;
+		// le * cos / (pdf_position * cos / pi)
+		Color beta = origin.beta * M_PI;
+		return 1 + walk(world, Ray(origin.point, direction), beta, direction.unit_vector().dot(outward) / M_PI, path, max_depth + 1, rays_traced, nullptr);
+	}
+
+	// the strategy with sc light and tc >= 2 camera vertices, mis weighted
+	Color connect(const Hittable& world, PathVertex* light_path, int sc, PathVertex* camera_path, int tc, long long& rays_traced, BidirectionalStats& stats) const {
+		PathVertex& pt = camera_path[tc - 1];
+		Color contribution(0, 0, 0);
+		PathVertex sampled;
+
+		if (sc == 0) {
+			// the camera path ran into a light by itself
+			contribution = pt.beta * pt.emitted(camera_path[tc - 2].point);
+		} else if (sc == 1) {
+			// next event estimation: a fresh point on a light
+			if (!pt.connectible() || lights.empty())
+				return Color(0, 0, 0);
+			double pick = random_double() * light_area;
+			size_t index = std::min(static_cast<size_t>(std::upper_bound(cumulative_area.begin(), cumulative_area.end(), pick) - cumulative_area.begin()), lights.size() - 1);
+			const Sphere& light = *lights[index];
+			Vec3 outward = random_unit_vector();
+			sampled.kind = PathVertex::LightVertex;
+			sampled.point = light.center + light.radius * outward;
+			sampled.normal = outward;
+			sampled.material = light.material.get();
+			sampled.pdf_fwd = 1.0 / light_area;
+			sampled.beta = sampled.material->emitted() * light_area;
+			Color le = sampled.emitted(pt.point);
+			if (le.length_squared() <= 0)
+				return Color(0, 0, 0);
+			contribution = pt.beta * brdf(pt, camera_path[tc - 2], sampled) * sampled.beta;
+			if (contribution.length_squared() > 0) {
+				++stats.connections;
+				contribution = contribution * geometry(world, pt, sampled, rays_traced);
+			}
+		} else {
+			const PathVertex& qs = light_path[sc - 1];
+			if (!qs.connectible() || !pt.connectible())
+				return Color(0, 0, 0);
+			contribution = qs.beta * brdf(qs, light_path[sc - 2], pt) * brdf(pt, camera_path[tc - 2], qs) * pt.beta;
+			if (contribution.length_squared() > 0) {
+				++stats.connections;
+				contribution = contribution * geometry(world, qs, pt, rays_traced);
+			}
+		}
+		if (contribution.length_squared() <= 0)
+			return Color(0, 0, 0);
+		return contribution * mis_weight(light_path, sc, camera_path, tc, sc == 1 ? &sampled : nullptr);
+	}
+
+	// the strategy with sc >= 2 light vertices and only the camera: splats where qs is seen
+	void splat(const Hittable& world, PathVertex* light_path, int sc, PathVertex* camera_path, long long& rays_traced, BidirectionalStats& stats) {
+		const PathVertex& qs = light_path[sc - 1];
+		if (!qs.connectible())
+			return;
+		double s, t;
+		if (!camera.project(qs.point, s, t) || !on_film(s, t))
+			return;
+
+		PathVertex sampled = camera_path[0];
+		Vec3 to_camera = sampled.point - qs.point;
+		double cosine = (-to_camera).unit_vector().dot(camera.forward());
+		// importance of a pinhole camera whose film gets it all: 1 / (film_area cos^4)
+		double importance = 1.0 / (film_area * cosine * cosine * cosine * cosine);
+		Color contribution = qs.beta * brdf(qs, light_path[sc - 2], sampled) * importance;
+		if (contribution.length_squared() <= 0)
+			return;
+		++stats.connections;
+		contribution = contribution * (geometry(world, qs, sampled, rays_traced) * cosine);
+		if (contribution.length_squared() <= 0)
+			return;
+		contribution = contribution * mis_weight(light_path, sc, camera_path, 1, &sampled);
+
+		int i = std::min(image_width - 1, static_cast<int>(s * (image_width - 1)));
+		int j = std::min(image_height - 1, static_cast<int>(t * (image_height - 1)));
+		Color& pixel = splats[(image_height - 1 - j) * image_width + i];
+		#pragma omp atomic
+		pixel.x += contribution.x;
+		#pragma omp atomic
+		pixel.y += contribution.y;
+		#pragma omp atomic
+		pixel.z += contribution.z;
+		++stats.splats;
+	}
+
+	// balance heuristic over every strategy that could have built the same path. sampled
+	// stands in for light_path[0] (sc == 1) or camera_path[0] (tc == 1) when that vertex was
+	// picked for this connection only
+	double mis_weight(PathVertex* light_path, int sc, PathVertex* camera_path, int tc, PathVertex* sampled) const {
+		if (sc + tc == 2)
+			return 1;
+
+		PathVertex* qs = sc > 0 ? (sc == 1 && sampled ? sampled : &light_path[sc - 1]) : nullptr;
+		PathVertex* pt = (tc == 1 && sampled) ? sampled : &camera_path[tc - 1];
+		PathVertex* qs_minus = sc > 1 ? &light_path[sc - 2] : nullptr;
+		PathVertex* pt_minus = tc > 1 ? &camera_path[tc - 2] : nullptr;
+
+		// the densities at the connection depend on the connection itself; patch them in
+		// and put the old values back before returning
+		struct Saved { PathVertex* v; double pdf_rev; bool delta; };
+		Saved saved[4];
+		int saved_count = 0;
+		for (PathVertex* v : { qs, pt, qs_minus, pt_minus }) {
+			if (v)
+				saved[saved_count++] = { v, v->pdf_rev, v->delta };
+		}
+
+		pt->delta = false;
+		if (qs)
+			qs->delta = false;
+		pt->pdf_rev = sc > 0 ? pdf(*qs, qs_minus, *pt) : light_origin_pdf(*pt);
+		if (pt_minus)
+			pt_minus->pdf_rev = sc > 0 ? pdf(*pt, qs, *pt_minus) : light_pdf(*pt, *pt_minus);
+		if (qs)
+			qs->pdf_rev = pdf(*pt, pt_minus, *qs);
+		if (qs_minus)
+			qs_minus->pdf_rev = pdf(*qs, pt, *qs_minus);
+
+		auto remap = [](double f) { return f != 0 ? f : 1.0; };
+		double sum = 0;
+		double ratio = 1;
+		for (int i = tc - 1; i > 0; --i) {
+			const PathVertex& v = (i == tc - 1) ? *pt : camera_path[i];
+			ratio *= remap(v.pdf_rev) / remap(v.pdf_fwd);
+			if (!v.delta && !camera_path[i - 1].delta)
+				sum += ratio;
+		}
+		ratio = 1;
+		for (int i = sc - 1; i >= 0; --i) {
+			const PathVertex& v = (i == sc - 1) ? *qs : light_path[i];
+			ratio *= remap(v.pdf_rev) / remap(v.pdf_fwd);
+			bool delta_before = i > 0 && light_path[i - 1].delta;
+			if (!v.delta && !delta_before)
+				sum += ratio;
+		}
+
+		for (int k = 0; k < saved_count; ++k) {
+			saved[k].v->pdf_rev = saved[k].pdf_rev;
+			saved[k].v->delta = saved[k].delta;
+		}
+		return 1.0 / (1.0 + sum);
+	}
+};
+
+#endif
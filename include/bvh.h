@@ -4,20 +4,37 @@
 #include "hittable.h"
 #include "aabb.h"
 #include "hittable_list.h"
+#include "sphere_pack.h"
+#include "kernels.h"
 #include <memory>
 #include <algorithm>
 #include <stdexcept>
+#include <atomic>
+#include <thread>
+
+class LazySubtree;
 
 class BVHNode : public Hittable {
 public:
+    // ranges of at most this many spheres become a single SpherePack leaf
+    static constexpr size_t kLeafSize = 4;
+
     std::shared_ptr<Hittable> left;
     std::shared_ptr<Hittable> right;
     AABB box;
+    // the boxes of left and right side by side (SoA rows of 2: min x/y/z, max x/y/z)
+    // so a single hit_boxes kernel call tests both children
+    alignas(16) double child_bounds[12];
+    bool left_is_node = false;
+    bool right_is_node = false;
 
     BVHNode() {}
 
-    BVHNode(HittableList& list) : BVHNode(list.objects, 0, list.objects.size()) {}
-    BVHNode(std::vector<std::shared_ptr<Hittable>>& objects, size_t start, size_t end) {
+    // eager_levels < 0 builds the whole tree. otherwise only that many levels below this node
+    // are built now and every range under them becomes a LazySubtree, built the first time a
+    // ray reaches it.
+    BVHNode(HittableList& list, int eager_levels = -1) : BVHNode(list.objects, 0, list.objects.size(), eager_levels) {}
+    BVHNode(std::vector<std::shared_ptr<Hittable>>& objects, size_t start, size_t end, int eager_levels = -1) {
 
         int axis = random_int(0, 2);
         auto comparator = (axis == 0) ? box_x_compare
@@ -25,7 +42,10 @@ public:
                                       : box_z_compare;
         size_t object_span = end - start;
 
-        if (object_span == 1) {
+        std::shared_ptr<SpherePack> pack;
+        if (object_span <= kLeafSize && (pack = SpherePack::try_pack(objects, start, end))) {
+            left = right = pack;
+        } else if (object_span == 1) {
             left = right = objects[start];
         } else if (object_span == 2) {
             if (comparator(objects[start], objects[start + 1])) {
@@ -36,35 +56,123 @@ public:
                 right = objects[start];
             }
         } else {
-            std::sort(objects.begin() + start, objects.begin() + end, comparator);
-
+            // a median split only needs the two halves separated, not each of them sorted,
+            // which keeps every level O(n) (the children order their own halves again anyway)
             size_t mid = start + object_span / 2;
-            left = std::make_shared<BVHNode>(objects, start, mid);
-            right = std::make_shared<BVHNode>(objects, mid, end);
+            std::nth_element(objects.begin() + start, objects.begin() + mid, objects.begin() + end, comparator);
+
+            left = make_subtree(objects, start, mid, eager_levels);
+            right = make_subtree(objects, mid, end, eager_levels);
         }
 
         AABB box_left, box_right;
         if (!left->bounding_box(box_left) || !right->bounding_box(box_right))
             throw std::runtime_error("No bounding box in BVHNode constructor.");
         box = AABB::surrounding_box(box_left, box_right);
+
+        for (int a = 0; a < 3; ++a) {
+            child_bounds[2 * a] = axis_value(box_left.minimum, a);
+            child_bounds[2 * a + 1] = axis_value(box_right.minimum, a);
+            child_bounds[2 * (a + 3)] = axis_value(box_left.maximum, a);
+            child_bounds[2 * (a + 3) + 1] = axis_value(box_right.maximum, a);
+        }
+        left_is_node = std::dynamic_pointer_cast<BVHNode>(left) != nullptr;
+        right_is_node = std::dynamic_pointer_cast<BVHNode>(right) != nullptr;
     }
 
     bool hit(const Ray& ray, double t_min, double t_max, HitRecord& record) const override {
         if (!box.hit(ray, t_min, t_max))
             return false;
 
-        bool hit_left = left->hit(ray, t_min, t_max, record);
-        bool hit_right = right->hit(ray, t_min, hit_left ? record.t : t_max, record);
+        const double origin[3] = { ray.origin.x, ray.origin.y, ray.origin.z };
+        const double inv_dir[3] = { 1.0 / ray.direction.x, 1.0 / ray.direction.y, 1.0 / ray.direction.z };
+        return hit_children(ray, origin, inv_dir, t_min, t_max, record);
+    }
+
+    // our own box has already been passed; test both child boxes at once and descend.
+    // child nodes are entered directly, which skips both their vtable call and the
+    // re-test of the box we just checked here.
+    bool hit_children(const Ray& ray, const double* origin, const double* inv_dir,
+                      double t_min, double t_max, HitRecord& record) const {
+        double t_near[2];
+        int children = (left == right) ? 1 : 2;
+        unsigned mask = kernels().hit_boxes(child_bounds, 2, children, origin, inv_dir, t_min, t_max, t_near);
+
+        bool hit_left = (mask & 1u)
+            && hit_child(*left, left_is_node, ray, origin, inv_dir, t_min, t_max, record);
+        double closest = hit_left ? record.t : t_max;
+        bool hit_right = (mask & 2u) && t_near[1] < closest
+            && hit_child(*right, right_is_node, ray, origin, inv_dir, t_min, closest, record);
 
         return hit_left || hit_right;
     }
 
+    bool occluded(const Ray& ray, double t_min, double t_max, Occluder& occluder) const override {
+        if (!box.hit(ray, t_min, t_max))
+            return false;
+
+        const double origin[3] = { ray.origin.x, ray.origin.y, ray.origin.z };
+        const double inv_dir[3] = { 1.0 / ray.direction.x, 1.0 / ray.direction.y, 1.0 / ray.direction.z };
+        return occluded_children(ray, origin, inv_dir, t_min, t_max, occluder);
+    }
+
+    // hit_children for shadow rays: any blocker ends the walk, so there is no closest
+    // distance to carry over from the left child to the right one
+    bool occluded_children(const Ray& ray, const double* origin, const double* inv_dir,
+                           double t_min, double t_max, Occluder& occluder) const {
+        ++occlusion_visits();
+        double t_near[2];
+        int children = (left == right) ? 1 : 2;
+        unsigned mask = kernels().hit_boxes(child_bounds, 2, children, origin, inv_dir, t_min, t_max, t_near);
+
+        return ((mask & 1u) && occluded_child(*left, left_is_node, ray, origin, inv_dir, t_min, t_max, occluder))
+            || ((mask & 2u) && occluded_child(*right, right_is_node, ray, origin, inv_dir, t_min, t_max, occluder));
+    }
+
     bool bounding_box(AABB& output_box) const override {
         output_box = box;
         return true;
     }
 
+    // how many lazy subtrees hang off this tree and how many of them have been built so far
+    void count_lazy(size_t& built, size_t& total) const;
+
+    // inner nodes, leaves (packs, single primitives and lazy subtrees, built or not) and the
+    // deepest level, counting this node as level 1
+    void count_nodes(size_t& nodes, size_t& leaves, int& depth, int level = 1) const;
+
+    // make_shared keeps the node and its reference counts in one block
+    size_t memory_bytes() const override {
+        return sizeof(BVHNode) + kSharedControlBytes + left->memory_bytes() + (right != left ? right->memory_bytes() : 0);
+    }
+
+    void refresh_materials(const std::vector<std::shared_ptr<Material>>& by_id) override {
+        left->refresh_materials(by_id);
+        if (right != left)
+            right->refresh_materials(by_id);
+    }
+
 private:
+    static std::shared_ptr<Hittable> make_subtree(std::vector<std::shared_ptr<Hittable>>& objects, size_t start, size_t end, int eager_levels);
+
+    static bool hit_child(const Hittable& child, bool is_node, const Ray& ray, const double* origin,
+                          const double* inv_dir, double t_min, double t_max, HitRecord& record) {
+        if (is_node)
+            return static_cast<const BVHNode&>(child).hit_children(ray, origin, inv_dir, t_min, t_max, record);
+        return child.hit(ray, t_min, t_max, record);
+    }
+
+    static bool occluded_child(const Hittable& child, bool is_node, const Ray& ray, const double* origin,
+                               const double* inv_dir, double t_min, double t_max, Occluder& occluder) {
+        if (is_node)
+            return static_cast<const BVHNode&>(child).occluded_children(ray, origin, inv_dir, t_min, t_max, occluder);
+        return child.occluded(ray, t_min, t_max, occluder);
+    }
+
+    static double axis_value(const Vec3& v, int axis) {
+        return (axis == 0) ? v.x : (axis == 1) ? v.y : v.z;
+    }
+
     static int random_int(int min, int max) {
         return static_cast<int>(random_double(min, max + 1));
     }
@@ -89,4 +197,148 @@ private:
         return box_compare(a, b, 2);
     }
 };
+
+// a BVH range that has not been built yet. it only knows its objects and their bounding
+// box; the real BVHNode is built by whichever thread's ray gets here first.
+//
+// state goes Unbuilt -> Building -> Built. the thread that wins the compare-exchange builds
+// the subtree (from its own copy of the objects) and publishes it with a release store.
+// rays from other threads arriving at a small subtree while it is Building do not wait: they
+// test the (never modified) object list directly, which gives the same answer, just without
+// the tree. a large one would cost them O(n) per ray for as long as the build takes, so they
+// wait for the builder instead. once Built, everyone goes through the tree.
+class LazySubtree : public Hittable {
+public:
+    LazySubtree(const std::vector<std::shared_ptr<Hittable>>& objects, size_t start, size_t end)
+        : objects(objects.begin() + start, objects.begin() + end) {
+        for (size_t i = 0; i < this->objects.size(); ++i) {
+            AABB object_box;
+            if (!this->objects[i]->bounding_box(object_box))
+                throw std::runtime_error("No bounding box in LazySubtree constructor.");
+            box = (i == 0) ? object_box : AABB::surrounding_box(box, object_box);
+        }
+    }
+
+    bool hit(const Ray& ray, double t_min, double t_max, HitRecord& record) const override {
+        if (const BVHNode* built = build(objects.size() > kScanLimit))
+            return built->hit(ray, t_min, t_max, record);
+
+        // someone else is building it right now
+        if (!box.hit(ray, t_min, t_max))
+            return false;
+        HitRecord temp_record;
+        bool hit_anything = false;
+        double closest_so_far = t_max;
+        for (const auto& object : objects) {
+            if (object->hit(ray, t_min, closest_so_far, temp_record)) {
+                hit_anything = true;
+                closest_so_far = temp_record.t;
+                record = temp_record;
+            }
+        }
+        return hit_anything;
+    }
+
+    bool occluded(const Ray& ray, double t_min, double t_max, Occluder& occluder) const override {
+        // shadow rays take a small subtree if it is there and never build it. a large one they
+        // build (or wait for) like any other ray
+        const BVHNode* built = (objects.size() > kScanLimit) ? build(true) : (is_built() ? tree.get() : nullptr);
+        if (built)
+            return built->occluded(ray, t_min, t_max, occluder);
+        if (!box.hit(ray, t_min, t_max))
+            return false;
+        for (const auto& object : objects) {
+            if (object->occluded(ray, t_min, t_max, occluder))
+                return true;
+        }
+        return false;
+    }
+
+    bool bounding_box(AABB& output_box) const override {
+        output_box = box;
+        return true;
+    }
+
+    bool is_built() const { return state.load(std::memory_order_acquire) == Built; }
+
+    // an unbuilt subtree copies the materials from its spheres when it gets built
+    void refresh_materials(const std::vector<std::shared_ptr<Material>>& by_id) override {
+        for (const auto& object : objects)
+            object->refresh_materials(by_id);
+        if (is_built())
+            tree->refresh_materials(by_id);
+    }
+
+    // grows once the subtree is built
+    size_t memory_bytes() const override {
+        return sizeof(LazySubtree) + kSharedControlBytes + objects.capacity() * sizeof(std::shared_ptr<Hittable>) + (is_built() ? tree->memory_bytes() : 0);
+    }
+
+private:
+    enum { Unbuilt, Building, Built };
+
+    // subtrees of more objects than this are waited for while another thread builds them
+    static constexpr size_t kScanLimit = 32;
+    // how often a waiting thread checks the state before it starts yielding its core
+    static constexpr int kSpins = 256;
+
+    // the tree, built by this thread if nobody has started it yet. while another thread is
+    // building it, waits for that build if wait is set and returns null otherwise
+    const BVHNode* build(bool wait) const {
+        int current = state.load(std::memory_order_acquire);
+        if (current == Unbuilt && state.compare_exchange_strong(current, Building, std::memory_order_acq_rel)) {
+            std::vector<std::shared_ptr<Hittable>> work = objects;
+            tree = std::make_shared<BVHNode>(work, 0, work.size());
+            state.store(Built, std::memory_order_release);
+            return tree.get();
+        }
+        for (int spins = 0; wait && current == Building; ++spins) {
+            if (spins >= kSpins)
+                std::this_thread::yield();
+            current = state.load(std::memory_order_acquire);
+        }
+        return (current == Built) ? tree.get() : nullptr;
+    }
+
+    std::vector<std::shared_ptr<Hittable>> objects;
+    AABB box;
+    // built on first use from const hit(), hence mutable
+    mutable std::atomic<int> state{Unbuilt};
+    mutable std::shared_ptr<BVHNode> tree;
+};
+
+inline std::shared_ptr<Hittable> BVHNode::make_subtree(std::vector<std::shared_ptr<Hittable>>& objects, size_t start, size_t end, int eager_levels) {
+    if (end - start <= kLeafSize) {
+        if (auto pack = SpherePack::try_pack(objects, start, end))
+            return pack;
+    }
+    if (eager_levels == 0)
+        return std::make_shared<LazySubtree>(objects, start, end);
+    return std::make_shared<BVHNode>(objects, start, end, eager_levels < 0 ? -1 : eager_levels - 1);
+}
+
+inline void BVHNode::count_lazy(size_t& built, size_t& total) const {
+    const Hittable* children[2] = { left.get(), right.get() };
+    for (int c = 0; c < ((left == right) ? 1 : 2); ++c) {
+        if (auto node = dynamic_cast<const BVHNode*>(children[c])) {
+            node->count_lazy(built, total);
+        } else if (auto lazy = dynamic_cast<const LazySubtree*>(children[c])) {
+            ++total;
+            if (lazy->is_built())
+                ++built;
+        }
+    }
+}
+
+inline void BVHNode::count_nodes(size_t& nodes, size_t& leaves, int& depth, int level) const {
+    ++nodes;
+    depth = std::max(depth, level);
+    const Hittable* children[2] = { left.get(), right.get() };
+    for (int c = 0; c < ((left == right) ? 1 : 2); ++c) {
+        if (auto node = dynamic_cast<const BVHNode*>(children[c]))
+            node->count_nodes(nodes, leaves, depth, level + 1);
+        else
+            ++leaves;
+    }
+}
 #endif
\ No newline at end of file
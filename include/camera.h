@@ -5,6 +5,8 @@
 #include "vec3.h"
 #include "hittable.h"
 #include "material.h"
+#include "lights.h"
+#include "footprint.h"
 #include <iostream>
 
 class Camera {
@@ -30,6 +32,25 @@ public:
 		return Ray(origin, lower_left_corner + s*horizontal + t*vertical - origin);
 	}
 
+	// the other way round, for integrators that connect light paths to the camera (bdpt.h):
+	// the s, t get_ray would need to look at `point`. false if it lies behind the camera
+	bool project(const Vec3& point, double& s, double& t) const {
+		Vec3 direction = point - origin;
+		double ahead = -direction.dot(w);
+		if (ahead <= 0)
+			return false;
+		// where the direction crosses the viewport, one unit in front of the camera
+		Vec3 on_viewport = direction / ahead - (lower_left_corner - origin);
+		s = on_viewport.dot(horizontal) / horizontal.length_squared();
+		t = on_viewport.dot(vertical) / vertical.length_squared();
+		return true;
+	}
+
+	const Vec3& position() const { return origin; }
+	Vec3 forward() const { return -w; }
+	// the viewport lies one unit in front of the camera
+	double viewport_area() const { return horizontal.length() * vertical.length(); }
+
 private:
 	Vec3 origin;
 	Vec3 lower_left_corner;
@@ -69,26 +90,45 @@ public:
 */
 
 
+// the background gradient a ray sees when it escapes the scene
+inline Color sky_color(const Ray& ray) {
+	Vec3 unit_direction = ray.direction.unit_vector();
+	double t = 0.5 * (unit_direction.y + 1.0);
+	return (1 - t) * Color(1, 1, 1) + t*Color(0.5, 0.7, 1.0);
+}
+
 // ITERATIVE APPROACH
-inline Color ray_color(const Ray& ray, const Hittable& world, int depth) {
+// rays_traced is bumped once per world.hit() (and per shadow ray) so the run summary can
+// report rays per second. with lights, every diffuse hit also samples one emitter directly.
+inline Color ray_color(const Ray& ray, const Hittable& world, int depth, long long& rays_traced, const LightSet* lights = nullptr) {
 	Ray cur_ray = ray;
 	Color accumulated_attenuation(1.0, 1.0, 1.0);
 	Color emitted_light(0.0, 0.0, 0.0);
+	// set after a diffuse hit that sampled the lights: if the scattered ray lands on an
+	// emitter, its light was already counted by the shadow ray and must not be added twice
+	bool skip_emission = false;
 
 	for(int i = 0; i < depth; ++i) {
 		HitRecord record;
 
+		++rays_traced;
 		if (world.hit(cur_ray, 0.001, INFINITY, record)) {
 			Ray scattered;
 			Color attenuation;
+			if (FootprintRecorder* recorder = footprint_recorder())
+				recorder->touch(record.primitive);
 
 
 			// We pick up any light emitted by the surface we just hit
 			// We multiply it by accumulated_attenuation because if this is a bounce,
 			// the light is dimmed by the previous surfaces.
-			emitted_light += accumulated_attenuation * record.material->emitted();
+			if (!skip_emission)
+				emitted_light += accumulated_attenuation * record.material->emitted();
 
 			if (record.material->scatter(cur_ray, record, attenuation, scattered)) {
+				skip_emission = lights && record.material->is_diffuse();
+				if (skip_emission)
+					emitted_light += accumulated_attenuation * attenuation * lights->sample(world, record, rays_traced);
 				accumulated_attenuation = accumulated_attenuation * attenuation;
 				cur_ray = scattered;
 			}
@@ -98,10 +138,7 @@ inline Color ray_color(const Ray& ray, const Hittable& world, int depth) {
 			}
 		}
 		else {
-			Vec3 unit_direction = cur_ray.direction.unit_vector();
-			double t = 0.5 * (unit_direction.y + 1.0);
-			Color sky_color = (1 - t) * Color(1, 1, 1) + t*Color(0.5, 0.7, 1.0);
-			return emitted_light + (accumulated_attenuation * sky_color);
+			return emitted_light + (accumulated_attenuation * sky_color(cur_ray));
 		}
 	}
 	return Color(0, 0, 0);
@@ -0,0 +1,49 @@
+#ifndef CPU_FEATURES_H
+#define CPU_FEATURES_H
+
+#include <string>
+#include <stdexcept>
+
+// the instruction set levels we ship kernels for, ordered from oldest to newest
+// so that "is this level usable" is a simple comparison against what the cpu reports
+enum class IsaLevel {
+	Scalar = 0,
+	SSE42,
+	AVX2,
+	AVX512
+};
+
+inline const char* isa_name(IsaLevel level) {
+	switch (level) {
+		case IsaLevel::SSE42: return "sse4.2";
+		case IsaLevel::AVX2: return "avx2";
+		case IsaLevel::AVX512: return "avx512";
+		default: return "scalar";
+	}
+}
+
+// asks the cpu (cpuid, through the gcc/clang builtins) which of our levels it can run.
+// this is done once at startup; the answer never changes while the process is alive.
+inline IsaLevel detect_isa() {
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq")
+		&& __builtin_cpu_supports("avx512vl"))
+		return IsaLevel::AVX512;
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+		return IsaLevel::AVX2;
+	if (__builtin_cpu_supports("sse4.2"))
+		return IsaLevel::SSE42;
+#endif
+	return IsaLevel::Scalar;
+}
+
+inline IsaLevel parse_isa(const std::string& name) {
+	if (name == "scalar") return IsaLevel::Scalar;
+	if (name == "sse4.2" || name == "sse42") return IsaLevel::SSE42;
+	if (name == "avx2") return IsaLevel::AVX2;
+	if (name == "avx512") return IsaLevel::AVX512;
+	throw std::runtime_error("Unknown ISA level: " + name);
+}
+
+#endif
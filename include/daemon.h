@@ -0,0 +1,402 @@
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include "options.h"
+#include "spool.h"
+#include "scheduler.h"
+#include "render_cache.h"
+#include "metrics.h"
+#include "hittable_list.h"
+#include "lights.h"
+#include "camera.h"
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <optional>
+#include <functional>
+#include <filesystem>
+#include <sstream>
+#include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <omp.h>
+
+// the life of a --daemon job: queued from its file in the spool, set up (scene, camera,
+// framebuffer) by one worker, rendered a row at a time by all of them in priority order, and
+// written out, with a name.status file next to it the whole way. how a scene is built and a
+// row traced is up to the renderer (DaemonRenderer).
+
+// a scene (and its acceleration structure and lights) built for one job, kept for the next
+// jobs that ask for the same one
+struct LoadedScene {
+	HittableList world;
+	std::shared_ptr<Hittable> accel;
+	std::unique_ptr<LightSet> lights;
+	std::string accel_name;
+	long long last_used = 0;
+};
+
+// one job file, from the moment it is queued until its image is written
+struct DaemonJob {
+	JobDescription description;
+	Options options;
+	// the scheduler's number for it
+	int number = -1;
+	std::chrono::steady_clock::time_point queued;
+
+	// set up by the worker that got its setup task
+	bool scene_reused = false;
+	std::shared_ptr<LoadedScene> scene;
+	std::optional<Camera> camera;
+	const LightSet* lights = nullptr;
+	int image_width = 0;
+	int image_height = 0;
+	Crop crop;
+	std::vector<Color> framebuffer;
+	int tiles_total = 0;
+	// the scheduler gets the tiles' rows: the tile of every row, and the rows each tile has left
+	std::vector<int> row_tile;
+	std::unique_ptr<std::atomic<int>[]> rows_left;
+	std::chrono::steady_clock::time_point started;
+
+	// counted by the workers as they finish its tiles
+	std::atomic<int> tiles_done{0};
+	std::atomic<long long> rays{0};
+	std::atomic<long long> last_status_ms{0};
+	// set with the final status, after which a late progress update must not overwrite it
+	std::mutex status_mutex;
+	bool ended = false;
+
+	std::string output() const {
+		return options.output == Options().output ? (std::filesystem::path(description.path).parent_path() / (description.name + ".ppm")).string() : options.output;
+	}
+
+	double seconds_since(std::chrono::steady_clock::time_point from) const {
+		return std::chrono::duration<double>(std::chrono::steady_clock::now() - from).count();
+	}
+};
+
+// what run_daemon needs from the renderer
+struct DaemonRenderer {
+	// the world, acceleration structure and lights the options ask for
+	std::function<std::shared_ptr<LoadedScene>(const Options&)> build_scene;
+	std::function<Camera(double aspect_ratio, const Options&)> build_camera;
+	// traces one tile of a set up job on the calling worker, returning the rays it took
+	std::function<long long(DaemonJob&, const Crop&)> render_tile;
+	// writes the finished job's image to job.output()
+	std::function<void(DaemonJob&)> write_image;
+};
+
+// name.status next to the job file, as key=value lines
+inline void write_job_status(const DaemonJob& job, const std::string& state, int preemptions = 0, const std::string& error = "") {
+	const bool set_up = job.tiles_total > 0;
+	std::ostringstream status;
+	status << "state=" << state << "\n"
+		   << "priority=" << job.description.priority << "\n"
+		   << "tiles_done=" << job.tiles_done.load() << "\n"
+		   << "tiles_total=" << job.tiles_total << "\n"
+		   << "preemptions=" << preemptions << "\n"
+		   << "wait_seconds=" << (set_up ? std::chrono::duration<double>(job.started - job.queued).count() : job.seconds_since(job.queued)) << "\n"
+		   << "render_seconds=" << (set_up ? job.seconds_since(job.started) : 0.0) << "\n"
+		   << "rays=" << job.rays.load() << "\n"
+		   << "output=" << job.output() << "\n";
+	if (!error.empty())
+		status << "error=" << error << "\n";
+	const std::filesystem::path path = std::filesystem::path(job.description.path).replace_extension(".status");
+	write_file_atomic(path.string(), status.str());
+}
+
+// --daemon=spool: renders the jobs dropped into the spool directory (spool.h) until it has
+// been idle for options.idle_exit seconds (0: forever). every worker takes its next row of a
+// 32x32 tile from the most important job (TileScheduler), so a job of higher priority gets the
+// workers as they finish the row in hand, and jobs of equal priority run one after the other.
+// the worker that finishes a row polls the spool, which is what lets a new job in at the next
+// row boundary. scenes are built once and reused by the jobs that share them. renderer does
+// the building, tracing and writing.
+inline int run_daemon(const Options& daemon_options, const DaemonRenderer& renderer) {
+	constexpr size_t kMaxLoadedScenes = 4;
+	// the status files of running jobs are rewritten at most this often
+	constexpr long long kStatusIntervalMs = 500;
+	SpoolWatcher watcher(daemon_options.daemon);
+	TileScheduler scheduler;
+	// jobs by number, and when the last one ended
+	std::map<int, std::shared_ptr<DaemonJob>> jobs;
+	auto idle_since = std::chrono::steady_clock::now();
+	std::mutex jobs_mutex;
+	std::map<std::string, std::shared_ptr<LoadedScene>> scenes;
+	long long scene_clock = 0;
+	std::mutex scenes_mutex;
+	// one worker at a time reads the spool. workers without a task wait for the generation to
+	// change, which it does whenever there may be something new to do
+	std::mutex watch_mutex;
+	std::mutex idle_mutex;
+	std::condition_variable work_arrived;
+	long long generation = 0;
+	std::mutex output_mutex;
+	std::atomic<bool> stop{false};
+	const auto daemon_start = std::chrono::steady_clock::now();
+
+	std::cout << "Watching " << daemon_options.daemon << " for jobs (" << (watcher.notified() ? "inotify" : "polling") << ", "
+			  << omp_get_max_threads() << " workers)" << std::endl;
+
+	auto wake = [&]() {
+		{
+			std::lock_guard<std::mutex> lock(idle_mutex);
+			++generation;
+		}
+		work_arrived.notify_all();
+	};
+
+	auto say = [&output_mutex](const std::string& line, bool error = false) {
+		std::lock_guard<std::mutex> lock(output_mutex);
+		(error ? std::cerr : std::cout) << line << std::endl;
+	};
+
+	// a job file that could not be queued. its status is only worth a warning, as in report()
+	auto fail = [&](const std::string& path, const std::string& error) {
+		say("rayfloat: " + path + ": " + error, true);
+		std::filesystem::path status = path;
+		try {
+			write_file_atomic(status.replace_extension(".status").string(), "state=failed\nerror=" + error + "\n");
+		} catch (const std::exception& e) {
+			say("rayfloat: " + std::string(e.what()), true);
+		}
+		std::error_code ignored;
+		std::filesystem::rename(path, path + ".failed", ignored);
+	};
+
+	// the job's status file, unless it already has its final one. a status that cannot be
+	// written is only worth a warning
+	auto report = [&](DaemonJob& job, const std::string& state, int preemptions = 0, const std::string& error = "") {
+		std::lock_guard<std::mutex> lock(job.status_mutex);
+		if (job.ended)
+			return;
+		job.ended = state == "done" || state == "failed";
+		try {
+			write_job_status(job, state, preemptions, error);
+		} catch (const std::exception& e) {
+			say("rayfloat: " + std::string(e.what()), true);
+		}
+	};
+
+	auto abandon = [&](DaemonJob& job, int preemptions, const std::string& error) {
+		report(job, "failed", preemptions, error);
+		say("rayfloat: " + job.description.path + ": " + error, true);
+		std::error_code ignored;
+		std::filesystem::rename(job.description.path, job.description.path + ".failed", ignored);
+	};
+
+	// a job that ended, one way or the other
+	auto forget = [&](int number) {
+		{
+			std::lock_guard<std::mutex> lock(jobs_mutex);
+			jobs.erase(number);
+			idle_since = std::chrono::steady_clock::now();
+			if (LiveMetrics* metrics = live_metrics())
+				metrics->set_jobs(static_cast<long long>(jobs.size()));
+		}
+		// the last one leaves the daemon idle: someone has to watch the spool
+		wake();
+	};
+
+	// reads the new job files and queues them (the caller holds watch_mutex)
+	auto collect = [&]() {
+		bool added = false;
+		for (const auto& path : watcher.scan()) {
+			try {
+				auto job = std::make_shared<DaemonJob>();
+				job->description = read_job(path);
+				std::vector<std::string> arguments = job->description.arguments;
+				arguments.insert(arguments.begin(), "rayfloat");
+				std::vector<char*> argv;
+				for (std::string& argument : arguments)
+					argv.push_back(argument.data());
+				job->options = parse_options(static_cast<int>(argv.size()), argv.data());
+				require_plain_render(job->options, "Jobs");
+				job->queued = std::chrono::steady_clock::now();
+				write_job_status(*job, "queued");
+				say("Job " + job->description.name + " queued (priority " + std::to_string(job->description.priority) + ")");
+				std::lock_guard<std::mutex> lock(jobs_mutex);
+				job->number = scheduler.add(job->description.priority);
+				jobs.emplace(job->number, std::move(job));
+				if (LiveMetrics* metrics = live_metrics())
+					metrics->set_jobs(static_cast<long long>(jobs.size()));
+				added = true;
+			} catch (const std::exception& e) {
+				fail(path.string(), e.what());
+			}
+		}
+		if (added)
+			wake();
+	};
+
+	// gives the job its scene, camera, framebuffer and tiles
+	auto set_up = [&](DaemonJob& job) {
+		const Options& o = job.options;
+		{
+			// other workers keep rendering while a scene builds, but a second scene waits for the first
+			std::lock_guard<std::mutex> lock(scenes_mutex);
+			const std::string identity = scene_identity(o);
+			auto known = scenes.find(identity);
+			job.scene_reused = known != scenes.end();
+			if (!job.scene_reused) {
+				std::shared_ptr<LoadedScene> scene = renderer.build_scene(o);
+				if (scenes.size() >= kMaxLoadedScenes) {
+					auto oldest = std::min_element(scenes.begin(), scenes.end(), [](const auto& a, const auto& b) { return a.second->last_used < b.second->last_used; });
+					scenes.erase(oldest);
+				}
+				known = scenes.emplace(identity, scene).first;
+			}
+			// jobs hold on to their scene, so an evicted one lives until they are done
+			job.scene = known->second;
+			job.scene->last_used = ++scene_clock;
+		}
+		if (o.interleave > 0 && !dynamic_cast<const WideBVH*>(job.scene->accel.get()))
+			throw std::runtime_error("Interleaved traversal needs --accel=wide.");
+		job.lights = (o.direct_lighting && !job.scene->lights->empty()) ? job.scene->lights.get() : nullptr;
+
+		const double aspect_ratio = 16.0 / 9.0;
+		job.image_width = o.image_width;
+		job.image_height = static_cast<int>(o.image_width / aspect_ratio);
+		job.camera.emplace(renderer.build_camera(aspect_ratio, o));
+		job.crop = render_window(o.crop, job.image_width, job.image_height);
+		job.framebuffer.assign(static_cast<size_t>(job.image_width) * job.image_height, Color(0, 0, 0));
+		// a tile's rows one after the other: the workers share the tile's part of the scene,
+		// and a more important job gets them after one row
+		const std::vector<Crop> tiles = RenderCache::tiles(job.crop, job.image_width, job.image_height);
+		std::vector<Crop> rows;
+		job.rows_left = std::make_unique<std::atomic<int>[]>(tiles.size());
+		for (size_t t = 0; t < tiles.size(); ++t) {
+			job.rows_left[t] = tiles[t].y1 - tiles[t].y0;
+			for (int y = tiles[t].y0; y < tiles[t].y1; ++y) {
+				rows.push_back({ tiles[t].x0, y, tiles[t].x1, y + 1 });
+				job.row_tile.push_back(static_cast<int>(t));
+			}
+		}
+		job.tiles_total = static_cast<int>(tiles.size());
+		job.started = std::chrono::steady_clock::now();
+		report(job, "rendering");
+		if (LiveMetrics* metrics = live_metrics())
+			metrics->rows_planned(static_cast<long long>(rows.size()));
+		scheduler.ready(job.number, std::move(rows));
+		wake();
+	};
+
+	auto finish = [&](DaemonJob& job, int preemptions) {
+		renderer.write_image(job);
+		report(job, "done", preemptions);
+		std::error_code ignored;
+		std::filesystem::rename(job.description.path, job.description.path + ".done", ignored);
+		const double render_seconds = job.seconds_since(job.started);
+		std::ostringstream line;
+		line << "Job " << job.description.name << " done: " << job.tiles_total << " tiles in " << render_seconds << " s after waiting "
+			 << std::chrono::duration<double>(job.started - job.queued).count() << " s, " << job.rays / std::max(1e-9, render_seconds) / 1e6
+			 << " Mrays/s, scene " << (job.scene_reused ? "reused" : "built") << ", " << preemptions << " preemptions";
+		say(line.str());
+	};
+
+	{
+		std::lock_guard<std::mutex> lock(watch_mutex);
+		collect();
+	}
+
+	LiveMetrics* metrics = live_metrics();
+	#pragma omp parallel
+	{
+	TileScheduler::Task task;
+	while (!stop.load(std::memory_order_relaxed)) {
+		long long seen = 0;
+		{
+			std::lock_guard<std::mutex> lock(idle_mutex);
+			seen = generation;
+		}
+		if (!scheduler.next(task)) {
+			// nothing to do. with no jobs at all, one worker blocks on the spool. while jobs
+			// are being set up or finish their last tiles, the spool is only looked at, so
+			// that the watching worker is not stuck in the wait when their tiles come
+			std::unique_lock<std::mutex> watching(watch_mutex, std::try_to_lock);
+			if (watching.owns_lock()) {
+				bool idle = false;
+				double idle_left = 0.2;
+				{
+					std::lock_guard<std::mutex> lock(jobs_mutex);
+					idle = jobs.empty();
+					if (idle && daemon_options.idle_exit > 0)
+						idle_left = std::min(idle_left, daemon_options.idle_exit - std::chrono::duration<double>(std::chrono::steady_clock::now() - idle_since).count());
+				}
+				if (idle_left <= 0) {
+					stop = true;
+					wake();
+					break;
+				}
+				if (idle) {
+					watcher.wait(idle_left);
+					collect();
+					continue;
+				}
+				if (watcher.wait(0))
+					collect();
+				watching.unlock();
+			}
+			std::unique_lock<std::mutex> lock(idle_mutex);
+			work_arrived.wait_for(lock, std::chrono::milliseconds(200), [&]() { return generation != seen || stop; });
+			continue;
+		}
+
+		std::shared_ptr<DaemonJob> job;
+		{
+			std::lock_guard<std::mutex> lock(jobs_mutex);
+			job = jobs.at(task.job);
+		}
+		if (task.setup) {
+			try {
+				set_up(*job);
+			} catch (const std::exception& e) {
+				scheduler.drop(task.job);
+				abandon(*job, 0, e.what());
+				forget(task.job);
+			}
+			continue;
+		}
+
+		const auto row_start = metrics ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+		const long long rays = renderer.render_tile(*job, task.tile);
+		job->rays += rays;
+		const bool tile_done = --job->rows_left[job->row_tile[task.index]] == 0;
+		if (tile_done)
+			++job->tiles_done;
+		if (metrics) {
+			metrics->row_done(rays, std::chrono::duration<double>(std::chrono::steady_clock::now() - row_start).count());
+			if (tile_done)
+				metrics->tile_done();
+		}
+		int preemptions = 0;
+		if (scheduler.finish(task, preemptions)) {
+			try {
+				finish(*job, preemptions);
+			} catch (const std::exception& e) {
+				abandon(*job, preemptions, e.what());
+			}
+			forget(task.job);
+		} else {
+			long long now_ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - daemon_start).count();
+			long long last = job->last_status_ms.load();
+			if (now_ms - last >= kStatusIntervalMs && job->last_status_ms.compare_exchange_strong(last, now_ms))
+				report(*job, "rendering", preemptions);
+		}
+
+		// a row boundary: let new jobs in
+		std::unique_lock<std::mutex> watching(watch_mutex, std::try_to_lock);
+		if (watching.owns_lock() && watcher.wait(0))
+			collect();
+	}
+	}
+	std::cout << "Idle for " << daemon_options.idle_exit << " s, exiting" << std::endl;
+	return 0;
+}
+
+#endif
@@ -0,0 +1,83 @@
+#ifndef FOOTPRINT_H
+#define FOOTPRINT_H
+
+#include <vector>
+#include <cstdint>
+
+// what the paths of one tile touched: a bloom filter over the value hashes (render_cache.h) of
+// every primitive they hit and every light whose shadow ray got through. after an edit that
+// leaves the geometry alone, a tile whose filter holds none of the edited primitives traced
+// exactly the same paths through exactly the same materials, so its pixels still hold. a false
+// positive only costs re-rendering a tile that did not need it.
+//
+// 4096 bits and 4 probes keep false positives near 2% for the few hundred primitives a 32x32
+// tile touches in the grid scenes; a tile that sees thousands (mirrors into a dense grid) fills
+// up and simply matches every edit.
+class TileFootprint {
+public:
+	static constexpr int kBits = 4096;
+	static constexpr int kProbes = 4;
+	static constexpr int kWords = kBits / 64;
+
+	void insert(uint64_t key) {
+		uint64_t probe = spread(key), step = spread(probe) | 1;
+		for (int p = 0; p < kProbes; ++p, probe += step)
+			words[(probe >> 6) % kWords] |= 1ull << (probe & 63);
+	}
+
+	bool may_contain(uint64_t key) const {
+		uint64_t probe = spread(key), step = spread(probe) | 1;
+		for (int p = 0; p < kProbes; ++p, probe += step)
+			if (!(words[(probe >> 6) % kWords] & (1ull << (probe & 63))))
+				return false;
+		return true;
+	}
+
+	void merge(const TileFootprint& other) {
+		for (int w = 0; w < kWords; ++w)
+			words[w] |= other.words[w];
+	}
+
+	void clear() {
+		for (uint64_t& word : words)
+			word = 0;
+	}
+
+	uint64_t words[kWords] = {};
+
+private:
+	// the splitmix64 finalizer: the first probe, and from that the step between probes
+	static uint64_t spread(uint64_t z) {
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+		return z ^ (z >> 31);
+	}
+};
+
+// set on a render thread while it traces a tile whose footprint is wanted; ray_color and
+// LightSet::sample report every primitive they touch to it
+struct FootprintRecorder {
+	// value hash of every primitive, by Sphere::id
+	const std::vector<uint64_t>* primitive_keys = nullptr;
+	TileFootprint* tile = nullptr;
+
+	void touch(int primitive) {
+		if (tile && primitive >= 0)
+			tile->insert((*primitive_keys)[primitive]);
+	}
+};
+
+// what render_image records into: one footprint per tile it renders
+struct FootprintSet {
+	// value hash of every primitive, by Sphere::id
+	std::vector<uint64_t> primitive_keys;
+	std::vector<TileFootprint> tiles;
+};
+
+// the recorder of this thread, null while nothing is recorded
+inline FootprintRecorder*& footprint_recorder() {
+	static thread_local FootprintRecorder* recorder = nullptr;
+	return recorder;
+}
+
+#endif
@@ -0,0 +1,210 @@
+#ifndef GOVERNOR_H
+#define GOVERNOR_H
+
+#include "sensors.h"
+#include <string>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <stdexcept>
+#include <algorithm>
+#include <cmath>
+#include <omp.h>
+
+// holds a render under a temperature and / or package power cap. a background thread reads
+// the sensors (sensors.h) every interval; while over a cap it parks one worker per interval
+// (the highest numbered threads wait between rows), and once down to one worker it makes the
+// remaining one sleep a growing pause after every row. back under the cap with some margin it
+// undoes the same steps in reverse order. every reading is logged with the throughput, so the
+// log shows what the cap costs in rays/s and what each watt buys.
+
+struct GovernorSettings {
+	std::string thermal_root = "/sys/class/thermal";
+	std::string powercap_root = "/sys/class/powercap";
+	// degrees celsius for the hottest thermal zone and watts over all RAPL packages, 0: no cap
+	double max_temperature = 0;
+	double max_power = 0;
+	// seconds between readings
+	double interval = 1.0;
+	// file the readings are written to, empty for stderr
+	std::string log;
+};
+
+// what the governor saw over one render
+struct GovernorSummary {
+	int readings = 0;
+	double peak_temperature = NAN;
+	double mean_power = NAN;
+	int fewest_workers = 0;
+	int longest_pause_ms = 0;
+};
+
+class RenderGovernor {
+public:
+	RenderGovernor(const GovernorSettings& settings, int max_workers)
+		: settings(settings), zones(settings.thermal_root), rapl(settings.powercap_root),
+		  max_workers(std::max(1, max_workers)), allowed(std::max(1, max_workers)) {
+		if (settings.max_temperature > 0 && zones.size() == 0)
+			throw std::runtime_error("No thermal zones under " + settings.thermal_root + " for the temperature cap.");
+		if (settings.max_power > 0 && rapl.empty())
+			throw std::runtime_error("No RAPL domains under " + settings.powercap_root + " for the power cap.");
+		if (!settings.log.empty()) {
+			log_file.open(settings.log);
+			if (!log_file)
+				throw std::runtime_error("Could not open governor log " + settings.log + ".");
+		}
+		summary_.fewest_workers = this->max_workers;
+	}
+
+	~RenderGovernor() { stop(); }
+
+	RenderGovernor(const RenderGovernor&) = delete;
+	RenderGovernor& operator=(const RenderGovernor&) = delete;
+
+	void start() {
+		running = true;
+		finished.store(false, std::memory_order_relaxed);
+		started = std::chrono::steady_clock::now();
+		sampler = std::thread([this] { run(); });
+	}
+
+	void stop() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			running = false;
+		}
+		wake.notify_all();
+		if (sampler.joinable())
+			sampler.join();
+		// nobody is left waiting on a render that is over
+		allowed.store(max_workers, std::memory_order_relaxed);
+		pause_ms.store(0, std::memory_order_relaxed);
+	}
+
+	// called by the render workers after every row with the rays the row took. returns once
+	// this thread may go on
+	void pace(long long rays) {
+		rays_done.fetch_add(rays, std::memory_order_relaxed);
+		int pause = pause_ms.load(std::memory_order_relaxed);
+		if (pause > 0)
+			std::this_thread::sleep_for(std::chrono::milliseconds(pause));
+		const int thread = omp_get_thread_num();
+		while (thread >= allowed.load(std::memory_order_relaxed) && !finished.load(std::memory_order_relaxed))
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+
+	// called by a worker that found no rows left: the parked ones are let go
+	void finish() { finished.store(true, std::memory_order_relaxed); }
+
+	// only meaningful after stop()
+	const GovernorSummary& summary() const { return summary_; }
+
+private:
+	GovernorSettings settings;
+	ThermalZones zones;
+	RaplDomains rapl;
+	const int max_workers;
+	std::atomic<int> allowed;
+	std::atomic<int> pause_ms{0};
+	std::atomic<long long> rays_done{0};
+	std::atomic<bool> finished{false};
+
+	std::thread sampler;
+	std::mutex mutex;
+	std::condition_variable wake;
+	bool running = false;
+	std::chrono::steady_clock::time_point started;
+	std::ofstream log_file;
+	GovernorSummary summary_;
+	double power_sum = 0;
+	int power_readings = 0;
+
+	static constexpr int kMaxPauseMs = 200;
+	// how far under the caps the readings have to be before the governor gives back a step
+	static constexpr double kTemperatureMargin = 3.0;
+	static constexpr double kPowerMargin = 0.9;
+
+	std::ostream& log() { return log_file.is_open() ? static_cast<std::ostream&>(log_file) : std::cerr; }
+
+	void run() {
+		auto last = std::chrono::steady_clock::now();
+		double last_joules = rapl.package_joules();
+		long long last_rays = 0;
+		std::unique_lock<std::mutex> lock(mutex);
+		while (running) {
+			wake.wait_for(lock, std::chrono::duration<double>(settings.interval), [this] { return !running; });
+			if (!running)
+				break;
+
+			auto now = std::chrono::steady_clock::now();
+			double seconds = std::chrono::duration<double>(now - last).count();
+			last = now;
+			rapl.update();
+			double joules = rapl.package_joules();
+			double watts = rapl.empty() ? NAN : (joules - last_joules) / seconds;
+			last_joules = joules;
+			long long rays = rays_done.load(std::memory_order_relaxed);
+			double rays_per_second = (rays - last_rays) / seconds;
+			last_rays = rays;
+			double temperature = zones.hottest();
+
+			adjust(temperature, watts);
+			record(now, temperature, watts, rays_per_second);
+		}
+	}
+
+	void adjust(double temperature, double watts) {
+		const bool hot = settings.max_temperature > 0 && temperature > settings.max_temperature;
+		const bool hungry = settings.max_power > 0 && watts > settings.max_power;
+		const bool cool = !(settings.max_temperature > 0 && !(temperature < settings.max_temperature - kTemperatureMargin));
+		const bool frugal = !(settings.max_power > 0 && !(watts < settings.max_power * kPowerMargin));
+
+		int workers = allowed.load(std::memory_order_relaxed);
+		int pause = pause_ms.load(std::memory_order_relaxed);
+		if (hot || hungry) {
+			if (workers > 1)
+				--workers;
+			else
+				pause = std::min(kMaxPauseMs, std::max(5, pause * 2));
+		} else if (cool && frugal) {
+			if (pause > 0)
+				pause = pause / 2 < 5 ? 0 : pause / 2;
+			else if (workers < max_workers)
+				++workers;
+		}
+		allowed.store(workers, std::memory_order_relaxed);
+		pause_ms.store(pause, std::memory_order_relaxed);
+	}
+
+	void record(std::chrono::steady_clock::time_point now, double temperature, double watts, double rays_per_second) {
+		int workers = allowed.load(std::memory_order_relaxed);
+		int pause = pause_ms.load(std::memory_order_relaxed);
+		++summary_.readings;
+		if (!std::isnan(temperature) && !(summary_.peak_temperature >= temperature))
+			summary_.peak_temperature = temperature;
+		if (!std::isnan(watts)) {
+			power_sum += watts;
+			summary_.mean_power = power_sum / ++power_readings;
+		}
+		summary_.fewest_workers = std::min(summary_.fewest_workers, workers);
+		summary_.longest_pause_ms = std::max(summary_.longest_pause_ms, pause);
+
+		std::ostream& out = log();
+		out << std::fixed << std::setprecision(1)
+			<< "governor " << std::chrono::duration<double>(now - started).count() << " s: ";
+		if (std::isnan(temperature)) out << "- C, "; else out << temperature << " C, ";
+		if (std::isnan(watts)) out << "- W, "; else out << watts << " W, ";
+		out << "workers " << workers << "/" << max_workers << ", pause " << pause << " ms, "
+			<< std::setprecision(2) << rays_per_second / 1e6 << " Mrays/s";
+		if (!std::isnan(watts) && watts > 0)
+			out << ", " << std::setprecision(3) << rays_per_second / watts / 1e6 << " Mrays/J";
+		out << std::defaultfloat << std::setprecision(6) << std::endl;
+	}
+};
+
+#endif
@@ -5,6 +5,7 @@
 #include "vec3.h"
 #include "aabb.h"
 #include <memory>
+#include <vector>
 
 class Material;
 // "trust me bro it will exist" -> forward declaration
@@ -22,6 +23,9 @@ struct HitRecord {
 	// if the ray and the outward normal point in opposite directions (dot product < 0)
 	// we are hitting the front 
 	// this logic ensures the normal always points against the ray
+	// which primitive was hit (Sphere::id), -1 if the scene never numbered them. fits in the
+	// padding after front_face
+	int primitive = -1;
 
 
 	// "smart"(?) pointer that manages memory for us
@@ -38,6 +42,24 @@ struct HitRecord {
 	}
 };
 
+// the sphere that blocked a shadow ray, handed back by occluded() so the caller can try the
+// same sphere first on the next, similar, shadow ray. radius 0 means "nothing recorded".
+// (every primitive in this renderer is a sphere, so center and radius identify it fully)
+struct Occluder {
+	Vec3 center;
+	double radius = 0;
+};
+
+// make_shared puts the object and its reference counts in one block, about this much bigger.
+// memory_bytes() adds it once for every such block
+constexpr size_t kSharedControlBytes = 16;
+
+// BVH nodes and leaves opened by occluded() walks on this thread, for the direct lighting stats
+inline long long& occlusion_visits() {
+	static thread_local long long visits = 0;
+	return visits;
+}
+
 class Hittable {
 public:
 	// virtual destructor, when we ue inheritance, we must have a virtual destructor
@@ -55,6 +77,25 @@ public:
 	virtual bool hit(const Ray& ray, double t_min, double t_max, HitRecord& record) const = 0;
 
 	virtual bool bounding_box(AABB& output_box) const = 0;
+
+	// does anything lie on the ray within [t_min, t_max]? unlike hit() any blocker will do,
+	// so acceleration structures can stop at the first one. fills in occluder when true.
+	// the default just asks hit(), which cannot say what it hit.
+	virtual bool occluded(const Ray& ray, double t_min, double t_max, Occluder& /*occluder*/) const {
+		HitRecord record;
+		return hit(ray, t_min, t_max, record);
+	}
+
+	// bytes of acceleration data this object holds, itself included (memory_budget.h). the
+	// primitives belong to the scene and count as 0 here, wherever they are referenced from
+	virtual size_t memory_bytes() const {
+		return 0;
+	}
+
+	// gives every primitive under this object the material by_id[Sphere::id], in every copy
+	// kept of it, so an edit that only swaps materials needs no rebuild. no ray may be in
+	// flight while it runs
+	virtual void refresh_materials(const std::vector<std::shared_ptr<Material>>& /*by_id*/) {}
 };
 
 #endif
\ No newline at end of file
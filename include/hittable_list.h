@@ -3,6 +3,7 @@
 
 #include "hittable.h"
 #include "aabb.h"
+#include "sphere_pack.h"
 #include <vector>
 #include <memory>
 
@@ -18,17 +19,44 @@ public:
 	// pointers are always the same size
 	std::vector<std::shared_ptr<Hittable>> objects;
 
+	// up to this many spheres, a brute force SIMD scan over all of them beats building and
+	// walking a BVH (measured, see docs/benchmarks.md)
+	static constexpr size_t kBruteForceThreshold = 20;
+
 	HittableList() {}
 
 	void add(std::shared_ptr<Hittable> object) {
 		objects.push_back(object);
+		pack(object);
+	}
+
+	// the packed copies made again from the objects, after their spheres changed in place
+	// (build_world numbers them once the list is final)
+	void repack() {
+		sphere_packs.clear();
+		all_spheres = true;
+		packed_count = 0;
+		for (const auto& object : objects)
+			pack(object);
 	}
 
 	void clear() {
 		objects.clear();
+		sphere_packs.clear();
+		all_spheres = true;
+		packed_count = 0;
+	}
+
+	// true when the scene is small enough (and all spheres) that hit() takes the SIMD scan,
+	// in which case there is no point putting a BVH on top of this list
+	bool prefers_brute_force() const {
+		return has_packs() && objects.size() <= kBruteForceThreshold;
 	}
 
 	bool hit(const Ray& ray, double t_min, double t_max, HitRecord& record) const override {
+		if (has_packs())
+			return hit_packs(ray, t_min, t_max, record);
+
 		HitRecord temp_record;
 		bool hit_anything = false;
 		double closest_so_far = t_max;
@@ -52,6 +80,36 @@ public:
 		return hit_anything;
 	}
 	
+	bool occluded(const Ray& ray, double t_min, double t_max, Occluder& occluder) const override {
+		if (has_packs()) {
+			for (const auto& pack : sphere_packs) {
+				if (pack.occluded(ray, t_min, t_max, occluder))
+					return true;
+			}
+			return false;
+		}
+		for (const auto& object : objects) {
+			if (object->occluded(ray, t_min, t_max, occluder))
+				return true;
+		}
+		return false;
+	}
+
+	// the list and its packed copies; the objects are the scene's
+	size_t memory_bytes() const override {
+		size_t bytes = sizeof(HittableList) + objects.capacity() * sizeof(std::shared_ptr<Hittable>) + sphere_packs.capacity() * sizeof(SpherePack);
+		for (const auto& pack : sphere_packs)
+			bytes += pack.heap_bytes();
+		return bytes;
+	}
+
+	void refresh_materials(const std::vector<std::shared_ptr<Material>>& by_id) override {
+		for (const auto& object : objects)
+			object->refresh_materials(by_id);
+		for (auto& pack : sphere_packs)
+			pack.refresh_materials(by_id);
+	}
+
 	bool bounding_box(AABB& output_box) const override {
 		if (objects.empty()) return false;
 
@@ -66,6 +124,45 @@ public:
 		}
 		return true;
 	}
+
+private:
+	std::vector<SpherePack> sphere_packs;
+	bool all_spheres = true;
+	// objects.size() when sphere_packs was last in sync; code that pushes into objects
+	// directly (bypassing add) just falls back to the virtual call loop
+	size_t packed_count = 0;
+
+	// keeps an SoA copy of the spheres on the side, 16 per pack, for the brute force scan
+	void pack(const std::shared_ptr<Hittable>& object) {
+		auto sphere = std::dynamic_pointer_cast<Sphere>(object);
+		if (!sphere) {
+			all_spheres = false;
+			sphere_packs.clear();
+		} else if (all_spheres) {
+			if (sphere_packs.empty() || !sphere_packs.back().add(*sphere)) {
+				sphere_packs.emplace_back();
+				sphere_packs.back().add(*sphere);
+			}
+		}
+		packed_count = all_spheres ? objects.size() : 0;
+	}
+
+	bool has_packs() const {
+		return !objects.empty() && packed_count == objects.size();
+	}
+
+	// no pointer chasing and no vtable: one hit_spheres kernel call per 16 spheres
+	bool hit_packs(const Ray& ray, double t_min, double t_max, HitRecord& record) const {
+		bool hit_anything = false;
+		double closest_so_far = t_max;
+		for (const auto& pack : sphere_packs) {
+			if (pack.hit(ray, t_min, closest_so_far, record)) {
+				hit_anything = true;
+				closest_so_far = record.t;
+			}
+		}
+		return hit_anything;
+	}
 };
 
 #endif
\ No newline at end of file
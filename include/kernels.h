@@ -0,0 +1,199 @@
+#ifndef KERNELS_H
+#define KERNELS_H
+
+#include "cpu_features.h"
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+
+// the hot inner loops of the renderer (box tests, sphere leaf tests, RNG, tone mapping)
+// live here as plain loops over SoA arrays. each loop is written once and then stamped
+// out several times below, every copy compiled for a different instruction set via
+// __attribute__((target)). the binary itself is built for the x86-64 baseline, so it
+// runs everywhere, and at startup we point a small table of function pointers at the
+// best copy the cpu supports (cpuid) instead of baking -march=native into the build.
+
+// the widest batch any kernel is asked to handle in one call
+constexpr int kMaxKernelLanes = 16;
+// number of independent xorshift streams advanced side by side by fill_random
+constexpr int kRandomLanes = 16;
+
+#define RAYFLOAT_ALWAYS_INLINE inline __attribute__((always_inline))
+
+namespace kernel_impl {
+
+// slab test of one ray against `count` boxes.
+// bounds holds six rows (min x, min y, min z, max x, max y, max z), each `stride` long.
+// bit i of the result is set if box i is hit; t_near[i] receives its entry distance.
+RAYFLOAT_ALWAYS_INLINE unsigned hit_boxes(const double* bounds, int stride, int count,
+		const double* origin, const double* inv_dir, double t_min, double t_max, double* t_near) {
+	unsigned mask = 0;
+	#pragma omp simd reduction(|:mask)
+	for (int i = 0; i < count; ++i) {
+		double lo = t_min;
+		double hi = t_max;
+		for (int a = 0; a < 3; ++a) {
+			double t0 = (bounds[a * stride + i] - origin[a]) * inv_dir[a];
+			double t1 = (bounds[(a + 3) * stride + i] - origin[a]) * inv_dir[a];
+			lo = std::max(lo, std::min(t0, t1));
+			hi = std::min(hi, std::max(t0, t1));
+		}
+		t_near[i] = lo;
+		mask |= (hi > lo ? 1u : 0u) << i;
+	}
+	return mask;
+}
+
+// closest intersection of one ray with `count` spheres.
+// spheres holds four rows (center x, center y, center z, radius), each `stride` long.
+// returns the index of the closest sphere within [t_min, t_max] (or -1) and its distance in t_hit.
+// the root selection is exactly the one in Sphere::hit.
+RAYFLOAT_ALWAYS_INLINE int hit_spheres(const double* spheres, int stride, int count,
+		const double* origin, const double* direction, double t_min, double t_max, double* t_hit) {
+	double t[kMaxKernelLanes];
+	const double a = direction[0] * direction[0] + direction[1] * direction[1] + direction[2] * direction[2];
+
+	#pragma omp simd
+	for (int i = 0; i < count; ++i) {
+		double ocx = origin[0] - spheres[i];
+		double ocy = origin[1] - spheres[stride + i];
+		double ocz = origin[2] - spheres[2 * stride + i];
+		double radius = spheres[3 * stride + i];
+
+		double half_b = ocx * direction[0] + ocy * direction[1] + ocz * direction[2];
+		double c = ocx * ocx + ocy * ocy + ocz * ocz - radius * radius;
+		double discriminant = half_b * half_b - a * c;
+		double sqrtd = std::sqrt(std::max(discriminant, 0.0));
+
+		double root = (-half_b - sqrtd) / a;
+		if (root < t_min || root > t_max)
+			root = (-half_b + sqrtd) / a;
+		bool valid = discriminant >= 0 && root >= t_min && root <= t_max;
+		t[i] = valid ? root : INFINITY;
+	}
+
+	int closest = -1;
+	double closest_t = INFINITY;
+	for (int i = 0; i < count; ++i) {
+		if (t[i] < closest_t) {
+			closest_t = t[i];
+			closest = i;
+		}
+	}
+	*t_hit = closest_t;
+	return closest;
+}
+
+// the same XorShift32 as random_double(), but kRandomLanes independent states advanced
+// in lockstep so the shifts and xors map onto vector registers. count is arbitrary;
+// the tail just advances the first few lanes.
+RAYFLOAT_ALWAYS_INLINE void fill_random(uint32_t* lanes, double* out, int count) {
+	int i = 0;
+	for (; i + kRandomLanes <= count; i += kRandomLanes) {
+		#pragma omp simd
+		for (int l = 0; l < kRandomLanes; ++l) {
+			uint32_t state = lanes[l];
+			state ^= state << 13;
+			state ^= state >> 17;
+			state ^= state << 5;
+			lanes[l] = state;
+			out[i + l] = state / 4294967296.0;
+		}
+	}
+	for (int l = 0; i < count; ++i, ++l) {
+		uint32_t state = lanes[l];
+		state ^= state << 13;
+		state ^= state >> 17;
+		state ^= state << 5;
+		lanes[l] = state;
+		out[i] = state / 4294967296.0;
+	}
+}
+
+// averages, gamma corrects (gamma 2 -> sqrt) and quantizes `count` colour components
+RAYFLOAT_ALWAYS_INLINE void tone_map(const double* rgb, int count, double scale, unsigned char* out) {
+	#pragma omp simd
+	for (int i = 0; i < count; ++i) {
+		double v = std::sqrt(std::max(rgb[i] * scale, 0.0));
+		v = std::min(v, 0.999);
+		out[i] = static_cast<unsigned char>(static_cast<int>(256 * v));
+	}
+}
+
+} // namespace kernel_impl
+
+using HitBoxesFn = unsigned (*)(const double*, int, int, const double*, const double*, double, double, double*);
+using HitSpheresFn = int (*)(const double*, int, int, const double*, const double*, double, double, double*);
+using FillRandomFn = void (*)(uint32_t*, double*, int);
+using ToneMapFn = void (*)(const double*, int, double, unsigned char*);
+
+struct Kernels {
+	IsaLevel isa;
+	HitBoxesFn hit_boxes;
+	HitSpheresFn hit_spheres;
+	FillRandomFn fill_random;
+	ToneMapFn tone_map;
+};
+
+// stamps out one copy of every kernel compiled for `target_spec`.
+// the always_inline bodies above get inlined (and vectorized) in the wider target context.
+#define RAYFLOAT_KERNEL_SET(suffix, ...) \
+	namespace kernel_##suffix { \
+	__VA_ARGS__ inline unsigned hit_boxes(const double* b, int s, int n, const double* o, \
+			const double* inv, double t0, double t1, double* tn) { \
+		return kernel_impl::hit_boxes(b, s, n, o, inv, t0, t1, tn); \
+	} \
+	__VA_ARGS__ inline int hit_spheres(const double* sp, int s, int n, const double* o, \
+			const double* d, double t0, double t1, double* th) { \
+		return kernel_impl::hit_spheres(sp, s, n, o, d, t0, t1, th); \
+	} \
+	__VA_ARGS__ inline void fill_random(uint32_t* lanes, double* out, int n) { \
+		kernel_impl::fill_random(lanes, out, n); \
+	} \
+	__VA_ARGS__ inline void tone_map(const double* rgb, int n, double scale, unsigned char* out) { \
+		kernel_impl::tone_map(rgb, n, scale, out); \
+	} \
+	}
+
+RAYFLOAT_KERNEL_SET(scalar)
+#if defined(__x86_64__) || defined(__i386__)
+RAYFLOAT_KERNEL_SET(sse42, __attribute__((target("sse4.2"))))
+RAYFLOAT_KERNEL_SET(avx2, __attribute__((target("avx2,fma"))))
+// the auto-vectorized loops mostly see 2-4 lanes (binary BVH children, small leaves), where a
+// masked 512-bit loop costs more than it saves; the explicit zmm code lives in wide_bvh.h
+RAYFLOAT_KERNEL_SET(avx512, __attribute__((target("avx512f,avx512dq,avx512vl,avx2,fma,prefer-vector-width=256"))))
+#endif
+
+#define RAYFLOAT_KERNEL_TABLE(level, suffix) \
+	Kernels{ level, kernel_##suffix::hit_boxes, kernel_##suffix::hit_spheres, \
+			 kernel_##suffix::fill_random, kernel_##suffix::tone_map }
+
+inline Kernels kernels_for(IsaLevel level) {
+#if defined(__x86_64__) || defined(__i386__)
+	switch (level) {
+		case IsaLevel::AVX512: return RAYFLOAT_KERNEL_TABLE(IsaLevel::AVX512, avx512);
+		case IsaLevel::AVX2: return RAYFLOAT_KERNEL_TABLE(IsaLevel::AVX2, avx2);
+		case IsaLevel::SSE42: return RAYFLOAT_KERNEL_TABLE(IsaLevel::SSE42, sse42);
+		default: break;
+	}
+#endif
+	return RAYFLOAT_KERNEL_TABLE(IsaLevel::Scalar, scalar);
+}
+
+// the table every hot path calls through. it starts out on the best level the cpu
+// reports, so code that never calls select_kernels() still gets the fast path.
+inline Kernels& kernels() {
+	static Kernels active = kernels_for(detect_isa());
+	return active;
+}
+
+// pins the kernels to `requested`, clamped to what the cpu can actually run.
+// must be called before any parallel region starts. returns the level in use.
+inline IsaLevel select_kernels(IsaLevel requested) {
+	IsaLevel detected = detect_isa();
+	IsaLevel level = requested < detected ? requested : detected;
+	kernels() = kernels_for(level);
+	return level;
+}
+
+#endif
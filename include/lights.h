@@ -0,0 +1,180 @@
+#ifndef LIGHTS_H
+#define LIGHTS_H
+
+#include "hittable_list.h"
+#include "sphere.h"
+#include "material.h"
+#include "footprint.h"
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <omp.h>
+
+// totals over all threads for one render
+struct DirectLightStats {
+	long long shadow_rays = 0;
+	// shadow rays answered by the cached occluder alone
+	long long cache_hits = 0;
+	// shadow rays where the cached occluder was tried first and did not block
+	long long cache_misses = 0;
+	// full occluded() walks through the scene and the nodes + leaves they opened
+	long long traversals = 0;
+	long long traversal_visits = 0;
+
+	double hit_rate() const {
+		long long tried = cache_hits + cache_misses;
+		return tried > 0 ? double(cache_hits) / tried : 0.0;
+	}
+
+	// every cache hit skipped one full walk; charge it what the walks we did do cost on average
+	double saved_visits() const {
+		return traversals > 0 ? cache_hits * double(traversal_visits) / traversals : 0.0;
+	}
+};
+
+// the emitters of a scene (spheres with a DiffuseLight material) and the shadow rays toward
+// them. at every diffuse hit, ray_color asks sample() for the light arriving straight from one
+// of them, instead of waiting for a scattered ray to stumble into a small light by chance.
+//
+// consecutive shadow rays from nearby points toward the same light usually end on the same
+// blocker, so every thread remembers, per light, the last sphere that blocked one of its
+// shadow rays. that single sphere is tested first; only if it does not block is the ray
+// sent through the full occluded() walk.
+class LightSet {
+public:
+	LightSet(const HittableList& world, bool use_cache)
+		: use_cache(use_cache), threads(std::max(1, omp_get_max_threads())) {
+		for (const auto& object : world.objects) {
+			auto sphere = std::dynamic_pointer_cast<Sphere>(object);
+			if (!sphere)
+				continue;
+			auto light = std::dynamic_pointer_cast<DiffuseLight>(sphere->material);
+			if (light)
+				lights.push_back({ sphere->center, sphere->radius, light->emitted(), sphere->id });
+		}
+		for (auto& thread : threads)
+			thread.last.resize(lights.size());
+	}
+
+	bool empty() const { return lights.empty(); }
+	size_t size() const { return lights.size(); }
+
+	// light arriving at a diffuse hit directly from one light picked at random, already
+	// divided by the pick and direction pdfs and multiplied by the cosine at the hit. the
+	// caller multiplies by the albedo (the lambertian brdf is albedo / pi, the pi cancels
+	// against the one in the solid angle pdf below).
+	Color sample(const Hittable& world, const HitRecord& record, long long& rays_traced) const {
+		if (lights.empty())
+			return Color(0, 0, 0);
+
+		int index = std::min(static_cast<int>(random_double() * lights.size()), static_cast<int>(lights.size()) - 1);
+		const SphereLight& light = lights[index];
+
+		// uniform direction inside the cone the light's sphere covers, seen from the hit
+		Vec3 to_center = light.center - record.point;
+		double distance_squared = to_center.length_squared();
+		double radius_squared = light.radius * light.radius;
+		if (distance_squared <= radius_squared)
+			return Color(0, 0, 0);
+		double distance = std::sqrt(distance_squared);
+		double cos_max = std::sqrt(1.0 - radius_squared / distance_squared);
+
+		Vec3 w = to_center / distance;
+		Vec3 helper = std::abs(w.x) > 0.9 ? Vec3(0, 1, 0) : Vec3(1, 0, 0);
+		Vec3 v = w.cross(helper).unit_vector();
+		Vec3 u = w.cross(v);
+		double cos_theta = 1.0 - random_double() * (1.0 - cos_max);
+		double sin_theta = std::sqrt(std::max(0.0, 1.0 - cos_theta * cos_theta));
+		double phi = 2.0 * M_PI * random_double();
+		Vec3 direction = std::cos(phi) * sin_theta * u + std::sin(phi) * sin_theta * v + cos_theta * w;
+
+		double cosine = direction.dot(record.normal);
+		if (cosine <= 0)
+			return Color(0, 0, 0);
+
+		// the shadow ray stops just short of where it enters the light
+		double b = direction.dot(to_center);
+		double t_light = b - std::sqrt(std::max(0.0, b * b - (distance_squared - radius_squared)));
+		Ray shadow(record.point, direction);
+		++rays_traced;
+		if (blocked(world, shadow, 0.001, t_light * (1.0 - 1e-6), index))
+			return Color(0, 0, 0);
+		if (FootprintRecorder* recorder = footprint_recorder())
+			recorder->touch(light.primitive);
+
+		// emission / (pick pdf * solid angle pdf) * brdf without the albedo * cosine
+		double solid_angle = 2.0 * M_PI * (1.0 - cos_max);
+		return light.emission * (lights.size() * solid_angle / M_PI * cosine);
+	}
+
+	DirectLightStats stats() const {
+		DirectLightStats total;
+		for (const auto& thread : threads) {
+			total.shadow_rays += thread.stats.shadow_rays;
+			total.cache_hits += thread.stats.cache_hits;
+			total.cache_misses += thread.stats.cache_misses;
+			total.traversals += thread.stats.traversals;
+			total.traversal_visits += thread.stats.traversal_visits;
+		}
+		return total;
+	}
+
+	bool caching() const { return use_cache; }
+
+private:
+	struct SphereLight {
+		Vec3 center;
+		double radius;
+		Color emission;
+		int primitive;
+	};
+
+	// one per OpenMP thread, on its own cache line so the counters do not false share
+	struct alignas(64) ThreadState {
+		std::vector<Occluder> last; // per light, radius 0 until something blocked
+		DirectLightStats stats;
+	};
+
+	std::vector<SphereLight> lights;
+	bool use_cache;
+	mutable std::vector<ThreadState> threads;
+
+	static bool blocks(const Occluder& occluder, const Ray& ray, double t_min, double t_max) {
+		Vec3 oc = ray.origin - occluder.center;
+		double a = ray.direction.length_squared();
+		double half_b = oc.dot(ray.direction);
+		double c = oc.length_squared() - occluder.radius * occluder.radius;
+		double discriminant = half_b * half_b - a * c;
+		if (discriminant < 0)
+			return false;
+		double sqrtd = std::sqrt(discriminant);
+		double near_root = (-half_b - sqrtd) / a;
+		double far_root = (-half_b + sqrtd) / a;
+		return (near_root >= t_min && near_root <= t_max) || (far_root >= t_min && far_root <= t_max);
+	}
+
+	bool blocked(const Hittable& world, const Ray& ray, double t_min, double t_max, int light) const {
+		ThreadState& thread = threads[omp_get_thread_num()];
+		++thread.stats.shadow_rays;
+
+		Occluder& last = thread.last[light];
+		if (use_cache && last.radius > 0) {
+			if (blocks(last, ray, t_min, t_max)) {
+				++thread.stats.cache_hits;
+				return true;
+			}
+			++thread.stats.cache_misses;
+		}
+
+		long long visits_before = occlusion_visits();
+		Occluder occluder;
+		bool occluded = world.occluded(ray, t_min, t_max, occluder);
+		++thread.stats.traversals;
+		thread.stats.traversal_visits += occlusion_visits() - visits_before;
+		if (occluded && occluder.radius > 0)
+			last = occluder;
+		return occluded;
+	}
+};
+
+#endif
@@ -4,12 +4,33 @@
 #include "vec3.h"
 #include "ray.h"
 #include "hittable.h"
+#include "kernels.h"
 #include <random>
+#include <algorithm>
+#include <functional>
+#include <initializer_list>
 #include <omp.h>
 
+// something that hands out the numbers random_double() returns on one thread instead of the
+// xorshift below. the metropolis sampler (mlt.h) uses it to replay and mutate the numbers a
+// path was built from
+class RandomStream {
+public:
+	virtual ~RandomStream() = default;
+	virtual double next() = 0;
+};
+
+// the stream random_double() reads on this thread, null for the xorshift
+inline RandomStream*& random_stream_override() {
+	static thread_local RandomStream* stream = nullptr;
+	return stream;
+}
+
 // Fast, thread-local XorShift32 RNG
 // TODO: add further documentation on how this works
 inline double random_double() {
+	if (RandomStream* stream = random_stream_override())
+		return stream->next();
 	static thread_local uint32_t state = 123456789 + omp_get_thread_num();
 	state ^= state << 13;
 	state ^= state >> 17;
@@ -22,6 +43,28 @@ inline double random_double(double min, double max) {
 	return min + (max - min) * random_double();
 }
 
+// bulk version for callers that know up front how many numbers they need (e.g. the
+// per-pixel jitter). kRandomLanes separate xorshift streams per thread are advanced by
+// the dispatched fill_random kernel, so this runs at vector width instead of one at a time.
+inline void fill_random_doubles(double* out, int count) {
+	static thread_local uint32_t lanes[kRandomLanes] = {};
+	static thread_local bool seeded = false;
+	if (!seeded) {
+		for (int l = 0; l < kRandomLanes; ++l) {
+			// scramble the seeds so neighbouring lanes do not start out correlated
+			uint32_t seed = 123456789u + 7919u * static_cast<uint32_t>(omp_get_thread_num() * kRandomLanes + l);
+			seed ^= seed >> 16;
+			seed *= 0x7feb352du;
+			seed ^= seed >> 15;
+			seed *= 0x846ca68bu;
+			seed ^= seed >> 16;
+			lanes[l] = seed ? seed : 1u;
+		}
+		seeded = true;
+	}
+	kernels().fill_random(lanes, out, count);
+}
+
 inline Vec3 random_in_unit_sphere() {
 	while (true) {
 		Vec3 p(random_double(-1, 1), random_double(-1, 1), random_double(-1, 1));
@@ -40,6 +83,55 @@ public:
 		return Color(0, 0, 0);
 	}
 	virtual bool scatter(const Ray& ray_in, const HitRecord& record, Color& attenuation, Ray& scattered) const = 0;
+	// the object's own size, for memory_budget.h
+	virtual size_t memory_bytes() const = 0;
+	// ideal diffuse (cosine weighted scatter, attenuation = albedo): direct lighting
+	// can then sample the lights explicitly at this hit
+	virtual bool is_diffuse() const {
+		return false;
+	}
+	// for integrators that connect vertices of different paths (bdpt.h). all directions are
+	// unit vectors pointing away from the hit; normal is record.normal, which faces the side
+	// `to_previous` lies on. eval is the brdf for light going between the two directions,
+	// pdf the solid angle density with which scatter() picks to_next when the path arrived
+	// from to_previous. specular materials pick from a delta distribution: nothing can connect
+	// to them, and eval and pdf are left at zero.
+	virtual bool is_specular() const {
+		return true;
+	}
+	virtual Color eval(const Vec3& /*to_previous*/, const Vec3& /*to_next*/, const Vec3& /*normal*/) const {
+		return Color(0, 0, 0);
+	}
+	virtual double pdf(const Vec3& /*to_previous*/, const Vec3& /*to_next*/, const Vec3& /*normal*/) const {
+		return 0;
+	}
+
+	// the colour the surface itself adds, for the upsampler's albedo guide (upscale.h).
+	// white for materials that only bend light; emitters report what they emit
+	virtual Color guide_albedo() const {
+		return Color(1, 1, 1);
+	}
+
+	// value equality, so the scene compile pass (scene_compile.h) can fold identical materials
+	// into one instance. hash() must agree with it. the defaults only match the object itself.
+	virtual bool same_as(const Material& other) const {
+		return this == &other;
+	}
+	virtual size_t hash() const {
+		return std::hash<const void*>()(this);
+	}
+
+protected:
+	static size_t hash_values(std::initializer_list<double> values) {
+		size_t seed = 0;
+		for (double v : values)
+			seed ^= std::hash<double>()(v) + 0x9e3779b97f4a7c15ull + (seed << 6) + (seed >> 2);
+		return seed;
+	}
+
+	static bool same_color(const Color& a, const Color& b) {
+		return a.x == b.x && a.y == b.y && a.z == b.z;
+	}
 };
 
 class Lambertian : public Material {
@@ -61,6 +153,36 @@ public:
 		attenuation = albedo;
 		return true;
 	}
+
+	bool is_diffuse() const override {
+		return true;
+	}
+	Color guide_albedo() const override {
+		return albedo;
+	}
+
+	// scatter() adds a uniform unit vector to the normal: cosine weighted directions
+	bool is_specular() const override {
+		return false;
+	}
+	Color eval(const Vec3& /*to_previous*/, const Vec3& to_next, const Vec3& normal) const override {
+		return to_next.dot(normal) > 0 ? albedo / M_PI : Color(0, 0, 0);
+	}
+	double pdf(const Vec3& /*to_previous*/, const Vec3& to_next, const Vec3& normal) const override {
+		return std::max(0.0, to_next.dot(normal)) / M_PI;
+	}
+
+	size_t memory_bytes() const override {
+		return sizeof(Lambertian);
+	}
+
+	bool same_as(const Material& other) const override {
+		auto lambertian = dynamic_cast<const Lambertian*>(&other);
+		return lambertian && same_color(albedo, lambertian->albedo);
+	}
+	size_t hash() const override {
+		return hash_values({ 1, albedo.x, albedo.y, albedo.z });
+	}
 };
 
 /**
@@ -83,6 +205,53 @@ public:
 		attenuation = albedo;
 		return (scattered.direction.dot(record.normal) > 0);
 	}
+	Color guide_albedo() const override {
+		return albedo;
+	}
+
+	// with fuzz, scatter() picks the mirror direction r plus a point s on a sphere of radius
+	// fuzziness around its tip. a direction d meets that sphere at distances x from the hit
+	// where |x d - r| = fuzziness; a point there has density 1 / (4 pi fuzziness^2) on the
+	// sphere, which is x^2 / (4 pi fuzziness sqrt(disc)) per solid angle (disc as below).
+	// directions that end up below the surface are absorbed, so the brdf is what makes every
+	// kept direction weigh exactly albedo: pdf * albedo / cos.
+	bool is_specular() const override {
+		return fuzziness <= 0;
+	}
+	Color eval(const Vec3& to_previous, const Vec3& to_next, const Vec3& normal) const override {
+		double cosine = to_next.dot(normal);
+		if (cosine <= 0)
+			return Color(0, 0, 0);
+		return albedo * (pdf(to_previous, to_next, normal) / cosine);
+	}
+	double pdf(const Vec3& to_previous, const Vec3& to_next, const Vec3& normal) const override {
+		if (fuzziness <= 0 || to_next.dot(normal) <= 0)
+			return 0;
+		Vec3 mirror = reflect(-to_previous, normal);
+		double along = to_next.dot(mirror);
+		double disc = along * along - 1.0 + fuzziness * fuzziness;
+		if (disc <= 0)
+			return 0;
+		double root = std::sqrt(disc);
+		double density = 0;
+		for (double x : { along - root, along + root }) {
+			if (x > 0)
+				density += x * x;
+		}
+		return density / (4.0 * M_PI * fuzziness * root);
+	}
+
+	size_t memory_bytes() const override {
+		return sizeof(Metal);
+	}
+
+	bool same_as(const Material& other) const override {
+		auto metal = dynamic_cast<const Metal*>(&other);
+		return metal && same_color(albedo, metal->albedo) && fuzziness == metal->fuzziness;
+	}
+	size_t hash() const override {
+		return hash_values({ 2, albedo.x, albedo.y, albedo.z, fuzziness });
+	}
 };
 
 /**
@@ -116,6 +285,18 @@ public:
 		scattered = Ray(record.point, direction);
 		return true;
 	}
+
+	size_t memory_bytes() const override {
+		return sizeof(Dielectric);
+	}
+
+	bool same_as(const Material& other) const override {
+		auto dielectric = dynamic_cast<const Dielectric*>(&other);
+		return dielectric && ir == dielectric->ir;
+	}
+	size_t hash() const override {
+		return hash_values({ 3, ir });
+	}
 private:
 	static double reflectance(double cosine, double ref_idx) {
 		auto r0 = (1 - ref_idx) / (1 + ref_idx);
@@ -143,6 +324,21 @@ public:
 	Color emitted() const override {
 		return brightness * emit_color;
 	}
+	Color guide_albedo() const override {
+		return emitted();
+	}
+
+	size_t memory_bytes() const override {
+		return sizeof(DiffuseLight);
+	}
+
+	bool same_as(const Material& other) const override {
+		auto light = dynamic_cast<const DiffuseLight*>(&other);
+		return light && same_color(emit_color, light->emit_color) && brightness == light->brightness;
+	}
+	size_t hash() const override {
+		return hash_values({ 4, emit_color.x, emit_color.y, emit_color.z, brightness });
+	}
 };
 
 #endif
\ No newline at end of file
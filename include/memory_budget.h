@@ -0,0 +1,149 @@
+#ifndef MEMORY_BUDGET_H
+#define MEMORY_BUDGET_H
+
+#include "hittable_list.h"
+#include "sphere.h"
+#include "material.h"
+#include "sphere_pack.h"
+#include "bvh.h"
+#include "wide_bvh.h"
+#include <string>
+#include <atomic>
+#include <unordered_set>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+
+// what the renderer's large allocations add up to, per subsystem. the owners report their
+// sizes here as they allocate and free (MemoryCharge for the ones that live in one scope), and
+// the ledger keeps the current total and the peak per subsystem and overall. these are the
+// structures that grow with the scene and the image; small fixed things (the camera, option
+// strings, a few per thread vectors of a handful of entries) are not counted.
+
+enum class MemoryCategory { Primitives, Materials, Bvh, Textures, Framebuffers, Scratch };
+constexpr int kMemoryCategories = 6;
+
+inline const char* memory_category_name(MemoryCategory category) {
+	static const char* names[kMemoryCategories] = { "primitives", "materials", "bvh", "textures", "framebuffers", "scratch" };
+	return names[static_cast<int>(category)];
+}
+
+inline std::string format_bytes(long long bytes) {
+	std::ostringstream out;
+	out << std::fixed << std::setprecision(1);
+	if (bytes >= (1LL << 30)) out << bytes / double(1LL << 30) << " GiB";
+	else if (bytes >= (1LL << 20)) out << bytes / double(1LL << 20) << " MiB";
+	else if (bytes >= (1LL << 10)) out << bytes / double(1LL << 10) << " KiB";
+	else out << std::setprecision(0) << bytes << " B";
+	return out.str();
+}
+
+class MemoryLedger {
+public:
+	// negative bytes release
+	void add(MemoryCategory category, long long bytes) {
+		const int c = static_cast<int>(category);
+		long long now = current_[c].fetch_add(bytes, std::memory_order_relaxed) + bytes;
+		raise(peak_[c], now);
+		raise(peak_total_, total_.fetch_add(bytes, std::memory_order_relaxed) + bytes);
+	}
+
+	long long current(MemoryCategory category) const { return current_[static_cast<int>(category)].load(std::memory_order_relaxed); }
+	long long peak(MemoryCategory category) const { return peak_[static_cast<int>(category)].load(std::memory_order_relaxed); }
+	long long total() const { return total_.load(std::memory_order_relaxed); }
+	long long peak_total() const { return peak_total_.load(std::memory_order_relaxed); }
+
+private:
+	std::atomic<long long> current_[kMemoryCategories] = {};
+	std::atomic<long long> peak_[kMemoryCategories] = {};
+	std::atomic<long long> total_{0};
+	std::atomic<long long> peak_total_{0};
+
+	static void raise(std::atomic<long long>& peak, long long value) {
+		long long seen = peak.load(std::memory_order_relaxed);
+		while (value > seen && !peak.compare_exchange_weak(seen, value, std::memory_order_relaxed)) {}
+	}
+};
+
+inline MemoryLedger& memory_ledger() {
+	static MemoryLedger ledger;
+	return ledger;
+}
+
+// charges bytes to the ledger for as long as it lives
+class MemoryCharge {
+public:
+	MemoryCharge(MemoryCategory category, long long bytes) : category(category), bytes(bytes) {
+		memory_ledger().add(category, bytes);
+	}
+	~MemoryCharge() { memory_ledger().add(category, -bytes); }
+
+	MemoryCharge(const MemoryCharge&) = delete;
+	MemoryCharge& operator=(const MemoryCharge&) = delete;
+
+private:
+	MemoryCategory category;
+	long long bytes;
+};
+
+// the scene's primitives: the objects themselves, the list pointing at them and its packed copies
+inline long long primitive_bytes(const HittableList& world) {
+	long long bytes = static_cast<long long>(world.memory_bytes() - sizeof(HittableList));
+	for (const auto& object : world.objects)
+		bytes += (std::dynamic_pointer_cast<Sphere>(object) ? sizeof(Sphere) : sizeof(Hittable)) + kSharedControlBytes;
+	return bytes;
+}
+
+// every distinct material the primitives use, once
+inline long long material_bytes(const HittableList& world) {
+	std::unordered_set<const Material*> seen;
+	long long bytes = 0;
+	for (const auto& object : world.objects) {
+		auto sphere = std::dynamic_pointer_cast<Sphere>(object);
+		if (sphere && sphere->material && seen.insert(sphere->material.get()).second)
+			bytes += sphere->material->memory_bytes() + kSharedControlBytes;
+	}
+	return bytes;
+}
+
+// what the acceleration structure will take for this many primitives, before building it,
+// from the node layouts. the binary tree's median splits leave 2 to 4 spheres per leaf, taken
+// as 3 (which errs high, by 10-30% on the grids), and each leaf is a SpherePack with about one
+// inner node above it. the wide tree keeps a packed copy of every primitive; its splits stop
+// at 16 or fewer, so leaves are at least half full, with a node per 15 leaves above them and a
+// root. the brute force list is a list of pointers and SpherePacks of 16
+inline long long estimate_accel_bytes(size_t primitives, const std::string& accel) {
+	const double n = static_cast<double>(primitives);
+	if (accel == "list")
+		return static_cast<long long>(n * (sizeof(std::shared_ptr<Hittable>) + double(sizeof(SpherePack)) / SpherePack::kCapacity + sizeof(std::shared_ptr<Material>)));
+	if (accel == "wide") {
+		const double packed = sizeof(Vec3) + sizeof(double) + sizeof(std::shared_ptr<Material>) + sizeof(int);
+		const double leaves = n / (WideBVH::kWidth / 2);
+		return static_cast<long long>(n * packed + leaves * (WideBVH::leaf_bytes() + double(WideBVH::node_bytes()) / (WideBVH::kWidth - 1))
+									  + sizeof(WideBVH) + WideBVH::node_bytes() + WideBVH::leaf_bytes());
+	}
+	const double leaf = sizeof(BVHNode) + sizeof(SpherePack) + 2 * kSharedControlBytes + 4 * sizeof(std::shared_ptr<Material>);
+	return static_cast<long long>(n / 3.0 * leaf);
+}
+
+// a size from /proc/self/status ("VmHWM:", "VmRSS:"), -1 where there is none
+inline long long process_status_bytes(const std::string& field) {
+	std::ifstream in("/proc/self/status");
+	std::string key;
+	while (in >> key) {
+		if (key == field) {
+			long long kilobytes = 0;
+			in >> kilobytes;
+			return kilobytes * 1024;
+		}
+		std::string rest;
+		std::getline(in, rest);
+	}
+	return -1;
+}
+
+// the process' own high water mark, and what it has resident right now
+inline long long process_peak_bytes() { return process_status_bytes("VmHWM:"); }
+inline long long process_resident_bytes() { return process_status_bytes("VmRSS:"); }
+
+#endif
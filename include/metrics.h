@@ -0,0 +1,380 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "memory_budget.h"
+#include "bvh.h"
+#include "wide_bvh.h"
+#include "spool.h"
+#include <string>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <omp.h>
+#ifdef __linux__
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// live numbers of a running renderer in the Prometheus text format (--metrics-port serves
+// them on localhost, --metrics-file rewrites a file for node_exporter's textfile collector).
+//
+// the workers only touch a slot of their own (one writer each, on its own cache line) with
+// plain relaxed loads and stores: rays, rows and tiles done, and the nanoseconds spent tracing.
+// everything else is read at export time, so a render with metrics on runs the same code with
+// a clock read at either end of every row. rates (rays per second, each thread's busy ratio)
+// are taken between one export and the next of the same reader (the file, or the scrapers).
+
+// the acceleration structure built last, as counted right after the build
+struct AccelShape {
+	std::string accel;
+	size_t primitives = 0;
+	size_t nodes = 0;
+	size_t leaves = 0;
+	// binary BVH only, 0 for the others
+	int depth = 0;
+	long long bytes = 0;
+	double build_seconds = 0;
+};
+
+inline AccelShape describe_accel(const Hittable& accel, const std::string& name, size_t primitives, double build_seconds) {
+	AccelShape shape;
+	shape.accel = name;
+	shape.primitives = primitives;
+	shape.bytes = static_cast<long long>(accel.memory_bytes());
+	shape.build_seconds = build_seconds;
+	if (auto bvh = dynamic_cast<const BVHNode*>(&accel)) {
+		bvh->count_nodes(shape.nodes, shape.leaves, shape.depth);
+	} else if (auto wide = dynamic_cast<const WideBVH*>(&accel)) {
+		shape.nodes = wide->node_count();
+		shape.leaves = wide->leaf_count();
+	}
+	return shape;
+}
+
+class LiveMetrics {
+public:
+	explicit LiveMetrics(int threads) : slots(std::max(1, threads)), started(std::chrono::steady_clock::now()) {}
+
+	// the counters at a reader's previous export, which its rates are taken against
+	struct Baseline {
+		std::vector<long long> busy;
+		long long rays = 0;
+		std::chrono::steady_clock::time_point at;
+	};
+
+	// a baseline at the start, for a reader's first export
+	Baseline baseline() const { return { std::vector<long long>(slots.size()), 0, started }; }
+
+	// a worker finished a row: the rays it traced and the seconds it took
+	void row_done(long long rays, double seconds) {
+		Slot& slot = own_slot();
+		bump(slot.rays, rays);
+		bump(slot.rows, 1);
+		bump(slot.busy_nanoseconds, static_cast<long long>(seconds * 1e9));
+	}
+
+	void tile_done() { bump(own_slot().tiles, 1); }
+
+	// rows a render or a job is about to trace; the ones not done yet are the queue
+	void rows_planned(long long rows) { planned.fetch_add(rows, std::memory_order_relaxed); }
+
+	void set_jobs(long long count) { jobs.store(count, std::memory_order_relaxed); }
+
+	void set_accel(const AccelShape& shape) {
+		std::lock_guard<std::mutex> lock(mutex);
+		accel = shape;
+	}
+
+	// every metric, in the text exposition format, with the rates since `since`, which
+	// becomes this export
+	std::string exposition(Baseline& since) {
+		const auto now = std::chrono::steady_clock::now();
+		const double interval = std::chrono::duration<double>(now - since.at).count();
+
+		std::ostringstream out;
+		auto header = [&out](const char* name, const char* type, const char* help) {
+			out << "# HELP rayfloat_" << name << ' ' << help << "\n# TYPE rayfloat_" << name << ' ' << type << "\n";
+		};
+
+		long long rays = 0, rows = 0, tiles = 0;
+		std::vector<long long> busy(slots.size());
+		for (size_t t = 0; t < slots.size(); ++t) {
+			rays += slots[t].rays.load(std::memory_order_relaxed);
+			rows += slots[t].rows.load(std::memory_order_relaxed);
+			tiles += slots[t].tiles.load(std::memory_order_relaxed);
+			busy[t] = slots[t].busy_nanoseconds.load(std::memory_order_relaxed);
+		}
+
+		header("uptime_seconds", "gauge", "Seconds since the renderer started.");
+		out << "rayfloat_uptime_seconds " << std::chrono::duration<double>(now - started).count() << "\n";
+		header("rays_total", "counter", "Rays traced, camera, bounce and shadow rays alike.");
+		out << "rayfloat_rays_total " << rays << "\n";
+		header("rays_per_second", "gauge", "Rays traced per second since the previous export.");
+		out << "rayfloat_rays_per_second " << (interval > 0 ? (rays - since.rays) / interval : 0.0) << "\n";
+		header("rows_completed_total", "counter", "Pixel rows traced.");
+		out << "rayfloat_rows_completed_total " << rows << "\n";
+		header("tiles_completed_total", "counter", "32x32 tiles traced (tiled renders: daemon jobs, --cache-dir).");
+		out << "rayfloat_tiles_completed_total " << tiles << "\n";
+		header("queued_rows", "gauge", "Rows planned and not traced yet.");
+		out << "rayfloat_queued_rows " << std::max(0LL, planned.load(std::memory_order_relaxed) - rows) << "\n";
+		header("queued_jobs", "gauge", "Daemon jobs queued or rendering.");
+		out << "rayfloat_queued_jobs " << jobs.load(std::memory_order_relaxed) << "\n";
+
+		header("thread_busy_seconds_total", "counter", "Seconds each worker spent tracing rows.");
+		for (size_t t = 0; t < slots.size(); ++t)
+			out << "rayfloat_thread_busy_seconds_total{thread=\"" << t << "\"} " << busy[t] / 1e9 << "\n";
+		header("thread_busy_ratio", "gauge", "Share of the time since the previous export each worker spent tracing rows.");
+		for (size_t t = 0; t < slots.size(); ++t) {
+			const double ratio = interval > 0 ? (busy[t] - since.busy[t]) / 1e9 / interval : 0.0;
+			out << "rayfloat_thread_busy_ratio{thread=\"" << t << "\"} " << std::min(1.0, std::max(0.0, ratio)) << "\n";
+		}
+
+		const MemoryLedger& ledger = memory_ledger();
+		header("memory_bytes", "gauge", "Tracked memory per subsystem.");
+		for (int c = 0; c < kMemoryCategories; ++c)
+			out << "rayfloat_memory_bytes{subsystem=\"" << memory_category_name(static_cast<MemoryCategory>(c)) << "\"} "
+				<< ledger.current(static_cast<MemoryCategory>(c)) << "\n";
+		header("memory_peak_bytes", "gauge", "Peak tracked memory per subsystem.");
+		for (int c = 0; c < kMemoryCategories; ++c)
+			out << "rayfloat_memory_peak_bytes{subsystem=\"" << memory_category_name(static_cast<MemoryCategory>(c)) << "\"} "
+				<< ledger.peak(static_cast<MemoryCategory>(c)) << "\n";
+		if (long long resident = process_resident_bytes(); resident >= 0) {
+			header("process_resident_bytes", "gauge", "Resident set size of the process.");
+			out << "rayfloat_process_resident_bytes " << resident << "\n";
+		}
+
+		std::unique_lock<std::mutex> lock(mutex);
+		const AccelShape accel = this->accel;
+		lock.unlock();
+		if (!accel.accel.empty()) {
+			const std::string label = "{accel=\"" + accel.accel + "\"}";
+			header("bvh_primitives", "gauge", "Primitives in the acceleration structure built last.");
+			out << "rayfloat_bvh_primitives" << label << ' ' << accel.primitives << "\n";
+			header("bvh_nodes", "gauge", "Inner nodes of the acceleration structure built last.");
+			out << "rayfloat_bvh_nodes" << label << ' ' << accel.nodes << "\n";
+			header("bvh_leaves", "gauge", "Leaves of the acceleration structure built last.");
+			out << "rayfloat_bvh_leaves" << label << ' ' << accel.leaves << "\n";
+			if (accel.depth > 0) {
+				header("bvh_depth", "gauge", "Deepest level of the binary BVH built last.");
+				out << "rayfloat_bvh_depth" << label << ' ' << accel.depth << "\n";
+			}
+			header("bvh_bytes", "gauge", "Size of the acceleration structure built last.");
+			out << "rayfloat_bvh_bytes" << label << ' ' << accel.bytes << "\n";
+			header("bvh_build_seconds", "gauge", "Build time of the acceleration structure built last.");
+			out << "rayfloat_bvh_build_seconds" << label << ' ' << accel.build_seconds << "\n";
+		}
+
+		since = { busy, rays, now };
+		return out.str();
+	}
+
+private:
+	struct alignas(64) Slot {
+		std::atomic<long long> rays{0};
+		std::atomic<long long> rows{0};
+		std::atomic<long long> tiles{0};
+		std::atomic<long long> busy_nanoseconds{0};
+	};
+
+	std::vector<Slot> slots;
+	std::atomic<long long> planned{0};
+	std::atomic<long long> jobs{0};
+	const std::chrono::steady_clock::time_point started;
+
+	std::mutex mutex;
+	AccelShape accel;
+
+	// only the slot's own thread writes it: plain load / store, no read-modify-write
+	static void bump(std::atomic<long long>& counter, long long amount) {
+		counter.store(counter.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+	}
+
+	// the calling thread's number in the outermost team of more than one thread: a worker of
+	// a render, a daemon worker, or a --sweep-concurrent thread whose render runs alone in a
+	// team of its own. outside any team it is the main thread, 0
+	Slot& own_slot() {
+		int thread = 0;
+		for (int level = 1; level <= omp_get_level(); ++level) {
+			if (omp_get_team_size(level) > 1) {
+				thread = omp_get_ancestor_thread_num(level);
+				break;
+			}
+		}
+		return slots[std::min(static_cast<size_t>(thread), slots.size() - 1)];
+	}
+};
+
+// the metrics the renderer reports to, null while nothing is exported
+inline LiveMetrics*& live_metrics() {
+	static LiveMetrics* metrics = nullptr;
+	return metrics;
+}
+
+// owns the live metrics for as long as it lives, and exports them: rewrites `file` (if not
+// empty) every interval seconds and once more when it stops, and answers GET /metrics on
+// 127.0.0.1:port (if port > 0, Linux only)
+class MetricsExporter {
+public:
+	MetricsExporter(const std::string& file, int port, double interval)
+		: metrics(omp_get_max_threads()), file(file), interval(interval), file_baseline(metrics.baseline()), scrape_baseline(metrics.baseline()) {
+		if (port > 0)
+			listen_on(port);
+		live_metrics() = &metrics;
+		running = true;
+		if (!file.empty())
+			writer = std::thread([this] { write_loop(); });
+#ifdef __linux__
+		if (listener >= 0)
+			server = std::thread([this] { serve_loop(); });
+#endif
+	}
+
+	~MetricsExporter() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			running = false;
+		}
+		wake.notify_all();
+#ifdef __linux__
+		if (wake_pipe[1] >= 0) {
+			char byte = 0;
+			(void)!write(wake_pipe[1], &byte, 1);
+		}
+#endif
+		if (writer.joinable())
+			writer.join();
+		if (server.joinable())
+			server.join();
+		live_metrics() = nullptr;
+		if (!file.empty())
+			write_file();
+#ifdef __linux__
+		for (int descriptor : { listener, wake_pipe[0], wake_pipe[1] })
+			if (descriptor >= 0)
+				close(descriptor);
+#endif
+	}
+
+	MetricsExporter(const MetricsExporter&) = delete;
+	MetricsExporter& operator=(const MetricsExporter&) = delete;
+
+private:
+	LiveMetrics metrics;
+	const std::string file;
+	const double interval;
+	// each reader's rates run from its own previous export
+	LiveMetrics::Baseline file_baseline, scrape_baseline;
+	std::thread writer, server;
+	std::mutex mutex;
+	std::condition_variable wake;
+	bool running = false;
+	bool write_failed = false;
+	int listener = -1;
+	int wake_pipe[2] = { -1, -1 };
+
+	void write_loop() {
+		std::unique_lock<std::mutex> lock(mutex);
+		while (running) {
+			lock.unlock();
+			write_file();
+			lock.lock();
+			wake.wait_for(lock, std::chrono::duration<double>(interval), [this] { return !running; });
+		}
+	}
+
+	// replaced in one rename, so the collector never reads half of it. a file that cannot be
+	// written is reported the first time only, the render goes on
+	void write_file() {
+		try {
+			write_file_atomic(file, metrics.exposition(file_baseline));
+		} catch (const std::exception& e) {
+			if (!write_failed)
+				std::cerr << "rayfloat: " << e.what() << " The metrics file is not updated." << std::endl;
+			write_failed = true;
+		}
+	}
+
+	void listen_on(int port) {
+#ifdef __linux__
+		listener = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		int reuse = 1;
+		sockaddr_in address{};
+		address.sin_family = AF_INET;
+		address.sin_port = htons(static_cast<uint16_t>(port));
+		address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		if (listener < 0 || setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) != 0
+			|| bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(listener, 16) != 0
+			|| pipe2(wake_pipe, O_CLOEXEC) != 0) {
+			const std::string reason = std::strerror(errno);
+			if (listener >= 0)
+				close(listener);
+			throw std::runtime_error("Could not listen on 127.0.0.1:" + std::to_string(port) + " (" + reason + ").");
+		}
+#else
+		throw std::runtime_error("--metrics-port needs Linux, use --metrics-file.");
+#endif
+	}
+
+#ifdef __linux__
+	// one scrape at a time; a scraper that sends nothing is given a second
+	void serve_loop() {
+		pollfd requests[2] = { { listener, POLLIN, 0 }, { wake_pipe[0], POLLIN, 0 } };
+		while (true) {
+			if (poll(requests, 2, -1) < 0 && errno != EINTR)
+				return;
+			if (requests[1].revents)
+				return;
+			if (!(requests[0].revents & POLLIN))
+				continue;
+			int client = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+			if (client < 0)
+				continue;
+			timeval timeout = { 1, 0 };
+			setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+			std::string request;
+			char buffer[1024];
+			ssize_t got = 0;
+			while (request.find("\r\n\r\n") == std::string::npos && request.size() < 8192
+				   && (got = recv(client, buffer, sizeof(buffer), 0)) > 0)
+				request.append(buffer, static_cast<size_t>(got));
+			respond(client, request);
+			close(client);
+		}
+	}
+
+	void respond(int client, const std::string& request) {
+		const std::string line = request.substr(0, request.find("\r\n"));
+		const bool wanted = line.rfind("GET /metrics ", 0) == 0 || line.rfind("GET /metrics?", 0) == 0 || line.rfind("GET / ", 0) == 0;
+		const std::string body = wanted ? metrics.exposition(scrape_baseline) : "Not found, the metrics are at /metrics\n";
+		std::ostringstream response;
+		response << "HTTP/1.1 " << (wanted ? "200 OK" : "404 Not Found") << "\r\n"
+				 << "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+				 << "Content-Length: " << body.size() << "\r\n"
+				 << "Connection: close\r\n\r\n"
+				 << body;
+		const std::string text = response.str();
+		for (size_t sent = 0; sent < text.size();) {
+			ssize_t written = send(client, text.data() + sent, text.size() - sent, MSG_NOSIGNAL);
+			if (written <= 0)
+				return;
+			sent += static_cast<size_t>(written);
+		}
+	}
+#endif
+};
+
+#endif
@@ -0,0 +1,302 @@
+#ifndef MLT_H
+#define MLT_H
+
+#include "hittable.h"
+#include "material.h"
+#include "camera.h"
+#include "lights.h"
+#include "roulette.h"
+#include "options.h"
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <omp.h>
+
+// primary sample space metropolis light transport (Kelemen et al. 2002), run the way pbrt-v3
+// runs it. a path is a function of the numbers random_double() hands ray_color, so instead of
+// drawing fresh numbers for every sample, a markov chain wanders through the space of those
+// numbers: each step either perturbs all of them a little (small step, stays near a path that
+// carried light) or draws them anew (large step, keeps the chain from getting stuck). the
+// chain visits a path in proportion to its luminance, so the paths that matter are traced far
+// more often than the ones that bring back nothing.
+//
+// the first two numbers pick the point on the film. every step splats both the current and the
+// proposed path, each weighted by the chance it is where the chain ends up (the expected value
+// version of the acceptance test), into a shared buffer with atomic adds. the visit density is
+// only known up to a constant; a bootstrap of independent paths estimates it (the mean
+// luminance of the image) before the chains start.
+
+struct MetropolisSettings {
+	// independent chains, spread over the threads. each starts at a path the bootstrap picked
+	// in proportion to its luminance
+	int chains = 1024;
+	// independent paths traced to estimate the normalization and seed the chains
+	int bootstrap = 100000;
+	// standard deviation of a small step, per number
+	double sigma = 0.01;
+	// chance that a step is a large step
+	double large_step_probability = 0.3;
+};
+
+// totals over all chains for one render
+struct MetropolisStats {
+	long long mutations = 0;
+	long long accepted = 0;
+	long long large_steps = 0;
+	// mean luminance of the bootstrap paths, what one unit of splat weight is worth
+	double normalization = 0;
+
+	double acceptance() const { return mutations > 0 ? double(accepted) / mutations : 0.0; }
+};
+
+// splitmix64: seeds from consecutive integers give unrelated streams, which the sampler needs
+// (its seed is the bootstrap path's index)
+struct SplitMix64 {
+	uint64_t state;
+
+	explicit SplitMix64(uint64_t seed) : state(seed) {}
+
+	uint64_t next() {
+		uint64_t z = (state += 0x9e3779b97f4a7c15ull);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+		return z ^ (z >> 31);
+	}
+
+	// [0, 1)
+	double uniform() { return (next() >> 11) * (1.0 / 9007199254740992.0); }
+};
+
+// the numbers of one chain. they are made lazily: a number that was not used since the last
+// large step is drawn anew on first use, and small steps skipped while it was unused are
+// caught up in one go (the sum of n normal steps is one step sqrt(n) wide).
+//
+// a new sampler starts on a large step, so one made with the same seed returns the same
+// numbers as the one the bootstrap used: the chain can start at the path it picked
+class MetropolisSampler : public RandomStream {
+public:
+	MetropolisSampler(uint64_t seed, double sigma, double large_step_probability)
+		: rng(seed), sigma(sigma), large_step_probability(large_step_probability) {}
+
+	void start_iteration() {
+		++iteration;
+		large_step = rng.uniform() < large_step_probability;
+		index = 0;
+	}
+
+	double next() override {
+		if (index >= samples.size())
+			samples.resize(index + 1);
+		PrimarySample& x = samples[index++];
+		if (x.modified < last_large_step) {
+			x.value = rng.uniform();
+			x.modified = last_large_step;
+		}
+		x.backup = x.value;
+		x.modified_backup = x.modified;
+		if (large_step) {
+			x.value = rng.uniform();
+		} else {
+			double width = sigma * std::sqrt(static_cast<double>(iteration - x.modified));
+			x.value += width * normal();
+			x.value -= std::floor(x.value);
+			// x - floor(x) rounds up to 1 for tiny negative x
+			if (x.value >= 1.0)
+				x.value = 0.0;
+		}
+		x.modified = iteration;
+		return x.value;
+	}
+
+	void accept() {
+		if (large_step)
+			last_large_step = iteration;
+	}
+
+	void reject() {
+		for (PrimarySample& x : samples) {
+			if (x.modified == iteration) {
+				x.value = x.backup;
+				x.modified = x.modified_backup;
+			}
+		}
+		--iteration;
+	}
+
+	bool is_large_step() const { return large_step; }
+
+	// for the acceptance test
+	double uniform() { return rng.uniform(); }
+
+private:
+	struct PrimarySample {
+		double value = 0;
+		// iteration the value was last changed in, -1 for never
+		long long modified = -1;
+		double backup = 0;
+		long long modified_backup = -1;
+	};
+
+	SplitMix64 rng;
+	double sigma;
+	double large_step_probability;
+	std::vector<PrimarySample> samples;
+	size_t index = 0;
+	long long iteration = 0;
+	long long last_large_step = 0;
+	bool large_step = true;
+
+	double normal() {
+		double u1 = std::max(rng.uniform(), 1e-300);
+		double u2 = rng.uniform();
+		return std::sqrt(-2.0 * std::log(u1)) * std::cos(2.0 * M_PI * u2);
+	}
+};
+
+class MetropolisIntegrator {
+public:
+	MetropolisIntegrator(const Camera& camera, int image_width, int image_height, int max_depth, const Crop& crop, MetropolisSettings settings = MetropolisSettings())
+		: camera(camera), image_width(image_width), image_height(image_height), max_depth(max_depth), crop(crop), settings(settings),
+		  splats(static_cast<size_t>(image_width) * image_height, Color(0, 0, 0)), threads(std::max(1, omp_get_max_threads())) {}
+
+	// traces the bootstrap paths and sets the normalization. false if none of them carried
+	// any light (the chains would have nowhere to start)
+	bool bootstrap(const Hittable& world, const LightSet* lights, long long& rays_traced) {
+		bootstrap_weights.assign(settings.bootstrap, 0.0);
+		long long rays = 0;
+		#pragma omp parallel for schedule(dynamic, 256) reduction(+:rays)
+		for (int i = 0; i < settings.bootstrap; ++i) {
+			MetropolisSampler sampler(seed(i), settings.sigma, settings.large_step_probability);
+			int pixel = 0;
+			bootstrap_weights[i] = luminance(trace(world, lights, sampler, pixel, rays));
+		}
+		rays_traced += rays;
+
+		// running sums, for picking chain starts in proportion to the weights
+		double total = 0;
+		for (double& w : bootstrap_weights) {
+			total += w;
+			w = total;
+		}
+		normalization = total / settings.bootstrap;
+		return total > 0;
+	}
+
+	// runs one chain for `mutations` steps. chains may run in parallel, one per thread at a time
+	void run_chain(const Hittable& world, const LightSet* lights, int chain, long long mutations, long long& rays_traced) {
+		MetropolisStats& stats = threads[omp_get_thread_num()].stats;
+
+		// pick the starting path in proportion to its bootstrap luminance
+		SplitMix64 pick(~static_cast<uint64_t>(chain));
+		double target = pick.uniform() * bootstrap_weights.back();
+		int start = static_cast<int>(std::upper_bound(bootstrap_weights.begin(), bootstrap_weights.end(), target) - bootstrap_weights.begin());
+		start = std::min(start, settings.bootstrap - 1);
+
+		MetropolisSampler sampler(seed(start), settings.sigma, settings.large_step_probability);
+		int current_pixel = 0;
+		Color current = trace(world, lights, sampler, current_pixel, rays_traced);
+		double current_luminance = luminance(current);
+
+		for (long long m = 0; m < mutations; ++m) {
+			sampler.start_iteration();
+			int proposed_pixel = 0;
+			Color proposed = trace(world, lights, sampler, proposed_pixel, rays_traced);
+			double proposed_luminance = luminance(proposed);
+
+			double accept = current_luminance > 0 ? std::min(1.0, proposed_luminance / current_luminance) : 1.0;
+			if (proposed_luminance > 0)
+				splat(proposed_pixel, proposed * (accept / proposed_luminance));
+			if (current_luminance > 0)
+				splat(current_pixel, current * ((1.0 - accept) / current_luminance));
+
+			++stats.mutations;
+			if (sampler.is_large_step())
+				++stats.large_steps;
+			if (sampler.uniform() < accept) {
+				sampler.accept();
+				current = proposed;
+				current_luminance = proposed_luminance;
+				current_pixel = proposed_pixel;
+				++stats.accepted;
+			} else {
+				sampler.reject();
+			}
+		}
+	}
+
+	// writes the splats into a framebuffer that holds sums over samples_per_pixel samples, for
+	// a render that made `mutations` steps in total
+	void resolve(std::vector<Color>& framebuffer, int samples_per_pixel, long long mutations) const {
+		const double pixels = double(crop.x1 - crop.x0) * (crop.y1 - crop.y0);
+		const double scale = normalization * pixels * samples_per_pixel / std::max(1LL, mutations);
+		for (int y = crop.y0; y < crop.y1; ++y)
+			for (int x = crop.x0; x < crop.x1; ++x)
+				framebuffer[y * image_width + x] = splats[y * image_width + x] * scale;
+	}
+
+	MetropolisStats stats() const {
+		MetropolisStats total;
+		for (const auto& thread : threads) {
+			total.mutations += thread.stats.mutations;
+			total.accepted += thread.stats.accepted;
+			total.large_steps += thread.stats.large_steps;
+		}
+		total.normalization = normalization;
+		return total;
+	}
+
+	const MetropolisSettings& config() const { return settings; }
+
+	// the splat buffer, and the bootstrap weights (the samplers are a few numbers per bounce)
+	size_t splat_bytes() const { return splats.capacity() * sizeof(Color); }
+	size_t scratch_bytes() const { return settings.bootstrap * sizeof(double) + threads.capacity() * sizeof(ThreadState); }
+
+private:
+	struct alignas(64) ThreadState {
+		MetropolisStats stats;
+	};
+
+	Camera camera;
+	int image_width;
+	int image_height;
+	int max_depth;
+	Crop crop;
+	MetropolisSettings settings;
+	std::vector<Color> splats;
+	std::vector<double> bootstrap_weights;
+	double normalization = 0;
+	std::vector<ThreadState> threads;
+
+	static uint64_t seed(int bootstrap_index) {
+		return 0x5eed0000ull + static_cast<uint64_t>(bootstrap_index);
+	}
+
+	// one path with every random number taken from the sampler. the first two pick the point
+	// in the crop window, pixel is set to the pixel it lies in
+	Color trace(const Hittable& world, const LightSet* lights, MetropolisSampler& sampler, int& pixel, long long& rays_traced) const {
+		random_stream_override() = &sampler;
+		double fx = crop.x0 + random_double() * (crop.x1 - crop.x0);
+		double fy = crop.y0 + random_double() * (crop.y1 - crop.y0);
+		int x = std::min(static_cast<int>(fx), crop.x1 - 1);
+		int y = std::min(static_cast<int>(fy), crop.y1 - 1);
+		pixel = y * image_width + x;
+		// the same mapping render_pixel uses: row y covers v from (h - 1 - y) to (h - y) / (h - 1)
+		Ray ray = camera.get_ray(fx / (image_width - 1), (image_height - fy) / (image_height - 1));
+		Color color = ray_color(ray, world, max_depth, rays_traced, lights);
+		random_stream_override() = nullptr;
+		return color;
+	}
+
+	void splat(int pixel, const Color& value) {
+		Color& target = splats[pixel];
+		#pragma omp atomic
+		target.x += value.x;
+		#pragma omp atomic
+		target.y += value.y;
+		#pragma omp atomic
+		target.z += value.z;
+	}
+};
+
+#endif
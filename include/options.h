@@ -0,0 +1,343 @@
+#ifndef OPTIONS_H
+#define OPTIONS_H
+
+#include <string>
+#include <vector>
+#include <sstream>
+#include <stdexcept>
+#include <algorithm>
+
+// pixel window to render in image coordinates (origin top left, x1 and y1 exclusive).
+// everything outside it stays black. the default (all zero) means the full image.
+struct Crop {
+	int x0 = 0;
+	int y0 = 0;
+	int x1 = 0;
+	int y1 = 0;
+
+	bool full() const { return x0 == 0 && y0 == 0 && x1 == 0 && y1 == 0; }
+};
+
+// everything main() used to hard-code, overridable from the command line as --name=value.
+// the defaults reproduce the original 1600px, 500 spp, depth 10 render.
+struct Options {
+	int image_width = 1600;
+	int samples_per_pixel = 500;
+	int max_depth = 10;
+	std::string output = "output/image.ppm";
+	// "auto" picks the best kernels the cpu supports, anything else caps the level
+	std::string isa = "auto";
+	// "default" is the five sphere scene, "grid" the N^3 sphere grid with N = grid_size
+	std::string scene = "default";
+	int grid_size = 10;
+	// "bvh" is the binary BVHNode tree, "wide" the 16-wide WideBVH, "list" no acceleration
+	// structure at all (brute force scan). "auto" uses "list" for tiny scenes, else "bvh".
+	std::string accel = "auto";
+	// rays kept in flight per thread by the interleaved traversal, 0 traces one ray at a time
+	int interleave = 0;
+	// binary BVH levels built up front, the rest is built lazily on first traversal (-1: all)
+	int lazy_levels = -1;
+	Crop crop;
+	// the camera: where it stands, the point it looks at and the vertical field of view in degrees
+	double lookfrom[3] = { 0, 0, 0 };
+	double lookat[3] = { 0, 0, -1 };
+	double vfov = 90;
+	// fold identical materials and reorder primitives before building the BVH (scene_compile.h)
+	bool compile_scene = true;
+	// sample the scene's DiffuseLight spheres with shadow rays at diffuse hits
+	bool direct_lighting = true;
+	// try the last sphere that blocked a shadow ray (per thread and light) before a full walk
+	bool occluder_cache = true;
+	// coarse to fine: previews in 16x16 ... 1x1 blocks, then one more sample per pass, each
+	// preview written over `output` as soon as it is ready
+	bool progressive = false;
+	// > 1 traces paths at 1/upscale of the resolution and upsamples guided by full size
+	// depth, normal and albedo (upscale.h). for quick drafts
+	int upscale = 1;
+	// ppm to compare the written image against (rmse / psnr in the run output)
+	std::string reference;
+	// grayscale ppm (P2 or P3): the spp * pixels total is spread in proportion to it, every
+	// pixel keeping at least importance_min_spp (sample_budget.h)
+	std::string importance;
+	int importance_min_spp = 1;
+	// learned russian roulette and splitting (roulette.h), rendered in doubling passes
+	bool roulette = false;
+	// "path" is ray_color, "bdpt" the bidirectional path tracer (bdpt.h), "mlt" metropolis
+	// light transport over ray_color's random numbers (mlt.h)
+	std::string integrator = "path";
+	// mlt only: chains, bootstrap paths, small step size and large step probability
+	int mlt_chains = 1024;
+	int mlt_bootstrap = 100000;
+	double mlt_sigma = 0.01;
+	double mlt_large_step = 0.3;
+	// governor.h: hold the hottest thermal zone under max_temperature (celsius) and the RAPL
+	// packages under max_power (watts), reading the sensors every governor_interval seconds.
+	// either cap or a governor_log (readings go there instead of stderr) turns it on
+	double max_temperature = 0;
+	double max_power = 0;
+	double governor_interval = 1.0;
+	std::string governor_log;
+	// where the sensors live (the powercap root also feeds the energy report in the run
+	// summary), replaceable by a directory laid out the same way
+	std::string thermal_root = "/sys/class/thermal";
+	std::string powercap_root = "/sys/class/powercap";
+	// seconds between progress lines on stderr (0: none), or status file rewritten instead
+	double progress_interval = 10;
+	std::string status_file;
+	// MiB the render may use (memory_budget.h), checked against an estimate before the BVH is
+	// built. 0: no limit
+	int memory_budget_mb = 0;
+	// directory of finished tiles from earlier renders (render_cache.h), empty: no cache. the
+	// least recently used tiles go once it holds more than cache_size_mb MiB
+	std::string cache_dir;
+	int cache_size_mb = 1024;
+	// record what each tile's paths touch (footprint.h), so after a material edit only the
+	// tiles it affects are rendered again
+	bool footprints = false;
+	// scene edits, "index:r,g,b" each: give primitive `index` (in build order) that colour
+	std::vector<std::string> recolor;
+	// spool directory to watch for jobs (spool.h) instead of rendering once, and the seconds
+	// without a job after which the daemon exits (0: never)
+	std::string daemon;
+	double idle_exit = 0;
+	// sweep plan (sweep.h): render every variant it lists in this process, reusing the scene.
+	// concurrent renders several variants at once, one per thread, instead of one after the other
+	std::string sweep;
+	bool sweep_concurrent = false;
+	// live metrics in the Prometheus text format (metrics.h): served on 127.0.0.1:metrics_port
+	// (0: not served) and/or rewritten into metrics_file every metrics_interval seconds
+	int metrics_port = 0;
+	std::string metrics_file;
+	double metrics_interval = 5;
+	// > 0 skips rendering and instead times this many random rays through the RayQuery batch API
+	int query_rays = 0;
+};
+
+inline int parse_int_option(const std::string& name, const std::string& value) {
+	try {
+		size_t used = 0;
+		int result = std::stoi(value, &used);
+		if (used != value.size())
+			throw std::invalid_argument(value);
+		return result;
+	} catch (const std::exception&) {
+		throw std::runtime_error("Option --" + name + " expects an integer, got '" + value + "'.");
+	}
+}
+
+inline double parse_double_option(const std::string& name, const std::string& value) {
+	try {
+		size_t used = 0;
+		double result = std::stod(value, &used);
+		if (used != value.size())
+			throw std::invalid_argument(value);
+		return result;
+	} catch (const std::exception&) {
+		throw std::runtime_error("Option --" + name + " expects a number, got '" + value + "'.");
+	}
+}
+
+inline bool parse_switch(const std::string& name, const std::string& value) {
+	if (value == "on") return true;
+	if (value == "off") return false;
+	throw std::runtime_error("Option --" + name + " expects on or off, got '" + value + "'.");
+}
+
+inline Crop parse_crop(const std::string& value) {
+	Crop crop;
+	int* fields[4] = { &crop.x0, &crop.y0, &crop.x1, &crop.y1 };
+	size_t begin = 0;
+	for (int f = 0; f < 4; ++f) {
+		size_t end = value.find(',', begin);
+		if ((f < 3) != (end != std::string::npos))
+			throw std::runtime_error("Option --crop expects x0,y0,x1,y1, got '" + value + "'.");
+		*fields[f] = parse_int_option("crop", value.substr(begin, end - begin));
+		begin = end + 1;
+	}
+	if (crop.x0 < 0 || crop.y0 < 0 || crop.x1 <= crop.x0 || crop.y1 <= crop.y0)
+		throw std::runtime_error("Option --crop needs 0 <= x0 < x1 and 0 <= y0 < y1.");
+	return crop;
+}
+
+inline void parse_point(const std::string& name, const std::string& value, double point[3]) {
+	size_t begin = 0;
+	for (int c = 0; c < 3; ++c) {
+		size_t end = value.find(',', begin);
+		if ((c < 2) != (end != std::string::npos))
+			throw std::runtime_error("Option --" + name + " expects x,y,z, got '" + value + "'.");
+		point[c] = parse_double_option(name, value.substr(begin, end - begin));
+		begin = end + 1;
+	}
+}
+
+// the options given, on top of `options`
+inline Options parse_options(int argc, char** argv, Options options = Options()) {
+
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		size_t eq = arg.find('=');
+		if (arg.rfind("--", 0) != 0 || eq == std::string::npos)
+			throw std::runtime_error("Expected --name=value, got '" + arg + "'.");
+
+		std::string name = arg.substr(2, eq - 2);
+		std::string value = arg.substr(eq + 1);
+
+		if (name == "width") options.image_width = parse_int_option(name, value);
+		else if (name == "spp") options.samples_per_pixel = parse_int_option(name, value);
+		else if (name == "depth") options.max_depth = parse_int_option(name, value);
+		else if (name == "output") options.output = value;
+		else if (name == "isa") options.isa = value;
+		else if (name == "scene") options.scene = value;
+		else if (name == "grid") options.grid_size = parse_int_option(name, value);
+		else if (name == "accel") options.accel = value;
+		else if (name == "interleave") options.interleave = parse_int_option(name, value);
+		else if (name == "lazy-levels") options.lazy_levels = parse_int_option(name, value);
+		else if (name == "crop") options.crop = parse_crop(value);
+		else if (name == "lookfrom") parse_point(name, value, options.lookfrom);
+		else if (name == "lookat") parse_point(name, value, options.lookat);
+		else if (name == "vfov") options.vfov = parse_double_option(name, value);
+		else if (name == "compile") options.compile_scene = parse_switch(name, value);
+		else if (name == "direct") options.direct_lighting = parse_switch(name, value);
+		else if (name == "occluder-cache") options.occluder_cache = parse_switch(name, value);
+		else if (name == "progressive") options.progressive = parse_switch(name, value);
+		else if (name == "upscale") options.upscale = parse_int_option(name, value);
+		else if (name == "reference") options.reference = value;
+		else if (name == "importance") options.importance = value;
+		else if (name == "importance-min") options.importance_min_spp = parse_int_option(name, value);
+		else if (name == "roulette") options.roulette = parse_switch(name, value);
+		else if (name == "integrator") options.integrator = value;
+		else if (name == "mlt-chains") options.mlt_chains = parse_int_option(name, value);
+		else if (name == "mlt-bootstrap") options.mlt_bootstrap = parse_int_option(name, value);
+		else if (name == "mlt-sigma") options.mlt_sigma = parse_double_option(name, value);
+		else if (name == "mlt-large-step") options.mlt_large_step = parse_double_option(name, value);
+		else if (name == "max-temp") options.max_temperature = parse_double_option(name, value);
+		else if (name == "max-power") options.max_power = parse_double_option(name, value);
+		else if (name == "governor-interval") options.governor_interval = parse_double_option(name, value);
+		else if (name == "governor-log") options.governor_log = value;
+		else if (name == "thermal-root") options.thermal_root = value;
+		else if (name == "powercap-root") options.powercap_root = value;
+		else if (name == "progress") options.progress_interval = parse_double_option(name, value);
+		else if (name == "status-file") options.status_file = value;
+		else if (name == "memory-budget") options.memory_budget_mb = parse_int_option(name, value);
+		else if (name == "cache-dir") options.cache_dir = value;
+		else if (name == "cache-size") options.cache_size_mb = parse_int_option(name, value);
+		else if (name == "footprints") options.footprints = parse_switch(name, value);
+		else if (name == "recolor") options.recolor.push_back(value);
+		else if (name == "daemon") options.daemon = value;
+		else if (name == "idle-exit") options.idle_exit = parse_double_option(name, value);
+		else if (name == "sweep") options.sweep = value;
+		else if (name == "sweep-concurrent") options.sweep_concurrent = parse_switch(name, value);
+		else if (name == "metrics-port") options.metrics_port = parse_int_option(name, value);
+		else if (name == "metrics-file") options.metrics_file = value;
+		else if (name == "metrics-interval") options.metrics_interval = parse_double_option(name, value);
+		else if (name == "query") options.query_rays = parse_int_option(name, value);
+		else throw std::runtime_error("Unknown option --" + name + ".");
+	}
+
+	if (options.image_width < 2 || options.samples_per_pixel < 1 || options.max_depth < 1)
+		throw std::runtime_error("Width must be at least 2, spp and depth at least 1.");
+	if (!(options.vfov > 0 && options.vfov < 180))
+		throw std::runtime_error("--vfov must lie between 0 and 180 degrees.");
+	if (options.lookfrom[0] == options.lookat[0] && options.lookfrom[1] == options.lookat[1] && options.lookfrom[2] == options.lookat[2])
+		throw std::runtime_error("--lookfrom and --lookat must be different points.");
+	if (options.scene != "default" && options.scene != "grid")
+		throw std::runtime_error("Unknown scene '" + options.scene + "'.");
+	if (options.grid_size < 1)
+		throw std::runtime_error("Grid size must be at least 1.");
+	if (options.accel != "auto" && options.accel != "bvh" && options.accel != "wide" && options.accel != "list")
+		throw std::runtime_error("Unknown acceleration structure '" + options.accel + "'.");
+	if (options.interleave < 0 || options.interleave > 32)
+		throw std::runtime_error("Interleave group size must be between 0 and 32.");
+	if (options.interleave > 0 && options.accel != "wide")
+		throw std::runtime_error("--interleave needs --accel=wide.");
+	if (options.lazy_levels >= 0 && options.accel != "bvh" && options.accel != "auto")
+		throw std::runtime_error("--lazy-levels needs --accel=bvh.");
+	if (options.progressive && options.interleave > 0)
+		throw std::runtime_error("--progressive traces one sample at a time and cannot be combined with --interleave.");
+	if (options.upscale < 1 || options.upscale > 16)
+		throw std::runtime_error("--upscale must be between 1 and 16.");
+	if (options.upscale > 1 && (options.progressive || !options.crop.full()))
+		throw std::runtime_error("--upscale renders the whole image in one go and cannot be combined with --progressive or --crop.");
+	if (!options.importance.empty() && (options.progressive || options.upscale > 1))
+		throw std::runtime_error("--importance cannot be combined with --progressive or --upscale.");
+	if (options.roulette && (options.progressive || options.upscale > 1 || !options.importance.empty() || options.interleave > 0))
+		throw std::runtime_error("--roulette renders in its own passes and cannot be combined with --progressive, --upscale, --importance or --interleave.");
+	if (options.integrator != "path" && options.integrator != "bdpt" && options.integrator != "mlt")
+		throw std::runtime_error("Unknown integrator '" + options.integrator + "'.");
+	if (options.integrator != "path" && (options.roulette || options.progressive || options.upscale > 1 || !options.importance.empty() || options.interleave > 0))
+		throw std::runtime_error("--integrator=" + options.integrator + " cannot be combined with --roulette, --progressive, --upscale, --importance or --interleave.");
+	if (options.mlt_chains < 1 || options.mlt_bootstrap < 1)
+		throw std::runtime_error("--mlt-chains and --mlt-bootstrap must be at least 1.");
+	if (!(options.mlt_sigma > 0 && options.mlt_sigma < 1))
+		throw std::runtime_error("--mlt-sigma must lie between 0 and 1.");
+	if (!(options.mlt_large_step >= 0 && options.mlt_large_step <= 1))
+		throw std::runtime_error("--mlt-large-step must lie between 0 and 1.");
+	if (options.max_temperature < 0 || options.max_power < 0 || !(options.governor_interval > 0))
+		throw std::runtime_error("--max-temp and --max-power cannot be negative, --governor-interval must be positive.");
+	if ((options.max_temperature > 0 || options.max_power > 0 || !options.governor_log.empty())
+		&& (options.integrator != "path" || options.roulette || options.progressive))
+		throw std::runtime_error("The governor paces the plain renderer and cannot be combined with --integrator, --roulette or --progressive.");
+	if (options.progress_interval < 0)
+		throw std::runtime_error("--progress needs an interval of 0 (off) or more seconds.");
+	if (!options.status_file.empty() && options.progress_interval <= 0)
+		throw std::runtime_error("--status-file needs a --progress interval.");
+	if (options.memory_budget_mb < 0)
+		throw std::runtime_error("--memory-budget cannot be negative.");
+	if (options.cache_size_mb < 1)
+		throw std::runtime_error("--cache-size must be at least 1 MiB.");
+	if (!options.cache_dir.empty() && (options.integrator != "path" || options.roulette || options.progressive || options.upscale > 1))
+		throw std::runtime_error("--cache-dir caches tiles of the plain renderer and cannot be combined with --integrator, --roulette, --progressive or --upscale.");
+	if (options.footprints && options.cache_dir.empty())
+		throw std::runtime_error("--footprints are kept with the tiles and need --cache-dir.");
+	if (options.idle_exit < 0)
+		throw std::runtime_error("--idle-exit cannot be negative.");
+	if (!options.sweep.empty() && !options.daemon.empty())
+		throw std::runtime_error("--sweep and --daemon cannot be combined.");
+	if (options.metrics_port < 0 || options.metrics_port > 65535)
+		throw std::runtime_error("--metrics-port must be between 1 and 65535 (0: off).");
+	if (!(options.metrics_interval > 0))
+		throw std::runtime_error("--metrics-interval must be positive.");
+	if (options.query_rays < 0)
+		throw std::runtime_error("--query needs a ray count of at least 1.");
+	return options;
+}
+
+// the pixels --crop asks for, clipped to the image (all of it without a crop)
+inline Crop render_window(Crop crop, int image_width, int image_height) {
+	if (crop.full()) {
+		crop.x1 = image_width;
+		crop.y1 = image_height;
+	}
+	crop.x1 = std::min(crop.x1, image_width);
+	crop.y1 = std::min(crop.y1, image_height);
+	if (crop.x0 >= crop.x1 || crop.y0 >= crop.y1)
+		throw std::runtime_error("Crop window lies outside the image.");
+	return crop;
+}
+
+// the options that decide the geometry and its acceleration structure
+inline std::string geometry_identity(const Options& options) {
+	std::ostringstream id;
+	id << options.scene << ' ' << options.grid_size << ' ' << options.compile_scene << ' ' << options.accel << ' '
+	   << options.lazy_levels << ' ' << options.occluder_cache;
+	return id.str();
+}
+
+// the options that decide what LoadedScene holds: the geometry and the edits to its materials
+inline std::string scene_identity(const Options& options) {
+	std::string id = geometry_identity(options);
+	for (const std::string& edit : options.recolor)
+		id += ' ' + edit;
+	return id;
+}
+
+// --daemon jobs and --sweep variants render with render_image alone, none of the modes that
+// need their own loop or their own output
+inline void require_plain_render(const Options& o, const std::string& what) {
+	if (o.integrator != "path" || o.roulette || o.progressive || o.upscale > 1 || !o.importance.empty()
+		|| !o.cache_dir.empty() || o.query_rays > 0 || !o.daemon.empty() || !o.sweep.empty() || o.max_temperature > 0 || o.max_power > 0 || !o.status_file.empty()
+		|| o.metrics_port > 0 || !o.metrics_file.empty())
+		throw std::runtime_error(what + " use the plain renderer, without --integrator, --roulette, --progressive, --upscale, --importance, --cache-dir, --query, --daemon, --sweep, the governor, --status-file or metrics of their own.");
+}
+
+#endif
@@ -0,0 +1,172 @@
+#ifndef PROGRESS_H
+#define PROGRESS_H
+
+#include "spool.h"
+#include <string>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <sstream>
+#include <iostream>
+#include <iomanip>
+#include <stdexcept>
+#include <algorithm>
+#include <cmath>
+#include <omp.h>
+
+// progress and time left for a render, printed every interval by a thread of its own. the
+// workers only touch a relaxed atomic counter of finished rows and a per thread slot (one
+// writer each, on its own cache line) with the count, sum and sum of squares of their row
+// times, so reporting adds no contention to the render.
+//
+// the time left is the remaining rows at the wall clock rate so far (which already includes
+// whatever the other threads and the governor did to it). rows differ a lot in cost (sky
+// against dense geometry), so it comes with a spread: render_image hands out the rows in a
+// scattered order, which makes the remaining rows cost like the ones done so far, and then
+// their total lands within 1.96 standard deviations, sqrt(rows left * row variance), of the
+// estimate about 95% of the time.
+
+struct ProgressSnapshot {
+	long long done = 0;
+	long long total = 0;
+	double elapsed = 0;
+	// seconds left and the 95% half width around it, NaN until a row is done
+	double remaining = NAN;
+	double spread = NAN;
+};
+
+class ProgressReporter {
+public:
+	// interval in seconds; status_file, if not empty, is rewritten (atomically) every interval
+	// instead of printing to stderr
+	ProgressReporter(long long total_rows, double interval, const std::string& status_file = "")
+		: total(total_rows), interval(interval), status_file(status_file), slots(std::max(1, omp_get_max_threads())) {}
+
+	~ProgressReporter() { stop(); }
+
+	ProgressReporter(const ProgressReporter&) = delete;
+	ProgressReporter& operator=(const ProgressReporter&) = delete;
+
+	void start() {
+		running = true;
+		started = std::chrono::steady_clock::now();
+		reporter = std::thread([this] { run(); });
+	}
+
+	// the status file ends up saying "done"
+	void stop() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (!running)
+				return;
+			running = false;
+		}
+		wake.notify_all();
+		if (reporter.joinable())
+			reporter.join();
+		if (!status_file.empty())
+			write_status(snapshot(), "done");
+	}
+
+	// a worker finished a row that took `seconds`
+	void row_done(double seconds) {
+		Slot& slot = slots[omp_get_thread_num()];
+		// only this thread writes its slot: plain load / store, no read-modify-write
+		slot.count.store(slot.count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		slot.sum.store(slot.sum.load(std::memory_order_relaxed) + seconds, std::memory_order_relaxed);
+		slot.sum_squares.store(slot.sum_squares.load(std::memory_order_relaxed) + seconds * seconds, std::memory_order_relaxed);
+		done.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	ProgressSnapshot snapshot() const {
+		ProgressSnapshot s;
+		s.total = total;
+		s.done = std::min(total, done.load(std::memory_order_relaxed));
+		s.elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+
+		long long count = 0;
+		double sum = 0, sum_squares = 0;
+		for (const auto& slot : slots) {
+			count += slot.count.load(std::memory_order_relaxed);
+			sum += slot.sum.load(std::memory_order_relaxed);
+			sum_squares += slot.sum_squares.load(std::memory_order_relaxed);
+		}
+		if (s.done == 0 || count == 0 || sum <= 0)
+			return s;
+		const double left = double(s.total - s.done);
+		s.remaining = left * s.elapsed / s.done;
+		const double mean = sum / count;
+		const double variance = std::max(0.0, sum_squares / count - mean * mean);
+		// relative spread of the remaining rows' total cost, applied to the wall clock estimate
+		s.spread = left > 0 ? s.remaining * 1.96 * std::sqrt(left * variance) / (left * mean) : 0.0;
+		return s;
+	}
+
+private:
+	struct alignas(64) Slot {
+		std::atomic<long long> count{0};
+		std::atomic<double> sum{0};
+		std::atomic<double> sum_squares{0};
+	};
+
+	const long long total;
+	const double interval;
+	const std::string status_file;
+	std::vector<Slot> slots;
+	std::atomic<long long> done{0};
+
+	std::thread reporter;
+	std::mutex mutex;
+	std::condition_variable wake;
+	bool running = false;
+	std::chrono::steady_clock::time_point started;
+	bool write_failed = false;
+
+	void run() {
+		std::unique_lock<std::mutex> lock(mutex);
+		while (running) {
+			wake.wait_for(lock, std::chrono::duration<double>(interval), [this] { return !running; });
+			if (!running)
+				break;
+			ProgressSnapshot s = snapshot();
+			if (status_file.empty())
+				print(s);
+			else
+				write_status(s, "rendering");
+		}
+	}
+
+	static void print(const ProgressSnapshot& s) {
+		std::ostringstream line;
+		line << std::fixed << std::setprecision(1) << "progress: " << 100.0 * s.done / std::max(1LL, s.total) << "% ("
+			 << s.done << "/" << s.total << " rows), " << s.elapsed << " s elapsed";
+		if (!std::isnan(s.remaining))
+			line << ", ~" << s.remaining << " s left (+-" << s.spread << " s)";
+		std::cerr << line.str() << std::endl;
+	}
+
+	// key=value lines, replaced in one rename so a reader never sees half of them. a file that
+	// cannot be written is reported the first time only, the render goes on
+	void write_status(const ProgressSnapshot& s, const char* state) {
+		std::ostringstream out;
+		out << "state=" << state << "\n"
+			<< "rows_done=" << s.done << "\n"
+			<< "rows_total=" << s.total << "\n"
+			<< "elapsed_seconds=" << s.elapsed << "\n";
+		if (!std::isnan(s.remaining))
+			out << "remaining_seconds=" << s.remaining << "\n"
+				<< "remaining_spread_seconds=" << s.spread << "\n";
+		try {
+			write_file_atomic(status_file, out.str());
+		} catch (const std::exception& e) {
+			if (!write_failed)
+				std::cerr << "rayfloat: " << e.what() << " The status file is not updated." << std::endl;
+			write_failed = true;
+		}
+	}
+};
+
+#endif
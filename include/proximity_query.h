@@ -0,0 +1,178 @@
+#ifndef PROXIMITY_QUERY_H
+#define PROXIMITY_QUERY_H
+
+#include "hittable_list.h"
+#include "wide_bvh.h"
+#include "ray_query.h"
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cmath>
+#include <omp.h>
+
+// nearest surface, k nearest and overlap queries for scene assembly tools (placement,
+// collision checks). same shape as RayQuery: SoA arrays in, SoA arrays out, the batch is
+// cut into chunks that the OpenMP threads pick up, and every query walks the WideBVH with
+// branch and bound instead of looking at every object in the list.
+
+struct PointBatch {
+	size_t count = 0;
+	const double* x = nullptr;
+	const double* y = nullptr;
+	const double* z = nullptr;
+	// search radius per point; null means unlimited
+	const double* max_distance = nullptr;
+};
+
+struct NearestBatch {
+	// index of the nearest sphere in the list, -1 if none is within max_distance
+	int32_t* primitive = nullptr;
+	// unsigned distance to its surface, INFINITY if none
+	double* distance = nullptr;
+	// the nearest point on that surface. the three may be null if not needed
+	double* point_x = nullptr;
+	double* point_y = nullptr;
+	double* point_z = nullptr;
+};
+
+struct BoxBatch {
+	size_t count = 0;
+	const double* min_x = nullptr;
+	const double* min_y = nullptr;
+	const double* min_z = nullptr;
+	const double* max_x = nullptr;
+	const double* max_y = nullptr;
+	const double* max_z = nullptr;
+};
+
+struct SphereBatch {
+	size_t count = 0;
+	const double* center_x = nullptr;
+	const double* center_y = nullptr;
+	const double* center_z = nullptr;
+	const double* radius = nullptr;
+};
+
+// overlap results vary in length, so they are packed: the primitives overlapping query i
+// are primitives[offsets[i] .. offsets[i + 1]), in no particular order
+struct OverlapResult {
+	std::vector<size_t> offsets;
+	std::vector<int32_t> primitives;
+};
+
+class ProximityQuery {
+public:
+	// queries handed to a thread at a time
+	static constexpr size_t kChunkSize = 1024;
+
+	explicit ProximityQuery(const HittableList& scene) : bvh(scene) {}
+
+	QueryStats nearest(const PointBatch& points, const NearestBatch& out) const {
+		return for_each_chunk(points.count, [&](size_t begin, size_t end) {
+			for (size_t i = begin; i < end; ++i) {
+				Vec3 point(points.x[i], points.y[i], points.z[i]);
+				double distance = INFINITY;
+				int primitive = bvh.nearest(point, max_distance(points, i), distance);
+				out.primitive[i] = primitive;
+				out.distance[i] = primitive >= 0 ? distance : INFINITY;
+				if (!out.point_x || !out.point_y || !out.point_z)
+					continue;
+				Vec3 surface = primitive >= 0 ? bvh.closest_surface_point(primitive, point) : Vec3(NAN, NAN, NAN);
+				out.point_x[i] = surface.x;
+				out.point_y[i] = surface.y;
+				out.point_z[i] = surface.z;
+			}
+		});
+	}
+
+	// the k nearest primitives of every point, nearest first. results for point i are in
+	// primitive[i * k .. i * k + k) and distance[i * k .. i * k + k); slots past the number
+	// found hold -1 and INFINITY.
+	QueryStats k_nearest(const PointBatch& points, int k, int32_t* primitive, double* distance) const {
+		return for_each_chunk(points.count, [&](size_t begin, size_t end) {
+			for (size_t i = begin; i < end; ++i) {
+				Vec3 point(points.x[i], points.y[i], points.z[i]);
+				int32_t* ids = primitive + i * k;
+				double* distances = distance + i * k;
+				int found = bvh.k_nearest(point, k, max_distance(points, i), ids, distances);
+				std::fill(ids + found, ids + k, -1);
+				std::fill(distances + found, distances + k, INFINITY);
+			}
+		});
+	}
+
+	QueryStats overlap_boxes(const BoxBatch& boxes, OverlapResult& out) const {
+		return collect(boxes.count, out, [&](size_t i, std::vector<int32_t>& hits) {
+			AABB box(Vec3(boxes.min_x[i], boxes.min_y[i], boxes.min_z[i]),
+					 Vec3(boxes.max_x[i], boxes.max_y[i], boxes.max_z[i]));
+			bvh.overlap_box(box, hits);
+		});
+	}
+
+	QueryStats overlap_spheres(const SphereBatch& spheres, OverlapResult& out) const {
+		return collect(spheres.count, out, [&](size_t i, std::vector<int32_t>& hits) {
+			Vec3 center(spheres.center_x[i], spheres.center_y[i], spheres.center_z[i]);
+			bvh.overlap_sphere(center, spheres.radius[i], hits);
+		});
+	}
+
+	size_t primitive_count() const { return bvh.primitive_count(); }
+
+private:
+	WideBVH bvh;
+
+	static double max_distance(const PointBatch& points, size_t i) {
+		return points.max_distance ? points.max_distance[i] : INFINITY;
+	}
+
+	template <class Work>
+	QueryStats for_each_chunk(size_t count, Work work) const {
+		auto start = std::chrono::high_resolution_clock::now();
+		const long long chunks = static_cast<long long>((count + kChunkSize - 1) / kChunkSize);
+
+		#pragma omp parallel for schedule(dynamic)
+		for (long long c = 0; c < chunks; ++c) {
+			size_t begin = static_cast<size_t>(c) * kChunkSize;
+			work(begin, std::min(begin + kChunkSize, count));
+		}
+
+		std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start;
+		QueryStats stats;
+		stats.queries = count;
+		stats.seconds = elapsed.count();
+		return stats;
+	}
+
+	// every chunk gathers its overlaps on the side, then the chunks are stitched together
+	// in order. the per query counts go into offsets first and are prefix summed at the end.
+	template <class Query>
+	QueryStats collect(size_t count, OverlapResult& out, Query query) const {
+		auto start = std::chrono::high_resolution_clock::now();
+		const size_t chunks = (count + kChunkSize - 1) / kChunkSize;
+		std::vector<std::vector<int32_t>> chunk_hits(chunks);
+		out.offsets.assign(count + 1, 0);
+
+		QueryStats stats = for_each_chunk(count, [&](size_t begin, size_t end) {
+			std::vector<int32_t>& hits = chunk_hits[begin / kChunkSize];
+			for (size_t i = begin; i < end; ++i) {
+				size_t before = hits.size();
+				query(i, hits);
+				out.offsets[i + 1] = hits.size() - before;
+			}
+		});
+
+		for (size_t i = 0; i < count; ++i)
+			out.offsets[i + 1] += out.offsets[i];
+		out.primitives.clear();
+		out.primitives.reserve(out.offsets[count]);
+		for (const auto& hits : chunk_hits)
+			out.primitives.insert(out.primitives.end(), hits.begin(), hits.end());
+
+		std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start;
+		stats.seconds = elapsed.count();
+		return stats;
+	}
+};
+
+#endif
@@ -0,0 +1,214 @@
+#ifndef RAY_QUERY_H
+#define RAY_QUERY_H
+
+#include "hittable_list.h"
+#include "wide_bvh.h"
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cmath>
+#include <omp.h>
+
+// batch ray queries against a scene, for callers that are not rendering (line of sight,
+// range finding, visibility). rays come in and results go out as SoA arrays: one array
+// per component, all `count` long, no Ray objects, no HitRecords and no materials.
+
+struct RayBatch {
+	size_t count = 0;
+	const double* origin_x = nullptr;
+	const double* origin_y = nullptr;
+	const double* origin_z = nullptr;
+	const double* direction_x = nullptr;
+	const double* direction_y = nullptr;
+	const double* direction_z = nullptr;
+	// ray i only counts hits with t_min[i] <= t <= t_max[i]
+	const double* t_min = nullptr;
+	const double* t_max = nullptr;
+};
+
+struct HitBatch {
+	// distance along the ray (in units of the direction's length), INFINITY on a miss
+	double* t = nullptr;
+	// index of the sphere in the list the query was built from, -1 on a miss
+	int32_t* primitive = nullptr;
+	// outward unit normal at the hit, zero on a miss. the three may be null if not needed
+	double* normal_x = nullptr;
+	double* normal_y = nullptr;
+	double* normal_z = nullptr;
+};
+
+// how long a batch took. queries counts rays here and points / boxes / spheres for the
+// proximity queries (proximity_query.h)
+struct QueryStats {
+	size_t queries = 0;
+	double seconds = 0;
+
+	// Mrays/s for ray batches
+	double millions_per_second() const { return seconds > 0 ? queries / seconds / 1e6 : 0; }
+};
+
+struct RayQueryOptions {
+	// rays every thread keeps in flight in the interleaved walk (WideBVH::hit_batch)
+	int group_size = 8;
+	// reorder every chunk by direction octant and origin before tracing it. off by default:
+	// it only pays once the tree no longer fits in cache (see docs/benchmarks.md)
+	bool sort = false;
+	// rays handed to a thread at a time, also the span over which rays get sorted
+	int chunk_size = 4096;
+};
+
+// the scene is put in a WideBVH once; every query after that is read only, so one RayQuery
+// can be shared by any number of threads. like WideBVH it only takes spheres.
+//
+// inside a query the batch is cut into chunks that the OpenMP threads pick up dynamically.
+// each chunk can be sorted so that rays leaving the same region in the same general direction
+// sit next to each other, and is then walked a group at a time by the interleaved traversal:
+// neighbouring rays tend to visit the same nodes, so the group shares what one of them
+// pulled into cache. this stands in for classic packet tracing, which would test several
+// rays against one box at once; the 16-wide nodes already fill the vector unit with one ray.
+class RayQuery {
+public:
+	explicit RayQuery(const HittableList& scene, RayQueryOptions options = RayQueryOptions())
+		: bvh(scene), options(options) {
+		this->options.chunk_size = std::max(1, options.chunk_size);
+	}
+
+	QueryStats intersect(const RayBatch& rays, const HitBatch& hits) const {
+		return run(rays, [&](const Chunk& chunk, size_t index, int local) {
+			int32_t primitive = chunk.primitive[local];
+			double t = primitive >= 0 ? chunk.t[local] : INFINITY;
+			hits.t[index] = t;
+			hits.primitive[index] = primitive;
+			if (!hits.normal_x || !hits.normal_y || !hits.normal_z)
+				return;
+			Vec3 normal(0, 0, 0);
+			if (primitive >= 0)
+				normal = bvh.outward_normal(primitive, chunk.rays[local].at(t));
+			hits.normal_x[index] = normal.x;
+			hits.normal_y[index] = normal.y;
+			hits.normal_z[index] = normal.z;
+		}, false);
+	}
+
+	// occluded[i] = 1 if anything lies on ray i within its t range, else 0
+	QueryStats occluded(const RayBatch& rays, uint8_t* occluded) const {
+		return run(rays, [&](const Chunk& chunk, size_t index, int local) {
+			occluded[index] = chunk.primitive[local] >= 0 ? 1 : 0;
+		}, true);
+	}
+
+	size_t primitive_count() const { return bvh.primitive_count(); }
+
+private:
+	WideBVH bvh;
+	RayQueryOptions options;
+
+	// per thread scratch for one chunk, reused across chunks and queries
+	struct Chunk {
+		std::vector<uint16_t> keys;
+		std::vector<uint32_t> order; // order[i]: position in the chunk of the i-th ray traced
+		std::vector<Ray> rays;
+		std::vector<double> t_min;
+		std::vector<double> t_max;
+		std::vector<int32_t> primitive;
+		std::vector<double> t;
+	};
+
+	// rays are bucketed by direction octant and by which of 4 x 4 x 4 cells of the chunk's
+	// origin bounds they start in, cells in morton order. a comparison sort by a fine key cost
+	// about half as much as tracing the chunk, one counting sort pass over 512 buckets is cheap.
+	static constexpr int kSortBuckets = 8 * 64;
+
+	static uint32_t spread_bits(uint32_t v) {
+		// 2 bit input: ab -> a00b
+		return (v & 1u) | ((v & 2u) << 2);
+	}
+
+	void sort_chunk(const RayBatch& rays, size_t begin, int count, Chunk& chunk) const {
+		double lo[3] = { INFINITY, INFINITY, INFINITY };
+		double hi[3] = { -INFINITY, -INFINITY, -INFINITY };
+		const double* origin[3] = { rays.origin_x + begin, rays.origin_y + begin, rays.origin_z + begin };
+		for (int a = 0; a < 3; ++a) {
+			for (int i = 0; i < count; ++i) {
+				lo[a] = std::min(lo[a], origin[a][i]);
+				hi[a] = std::max(hi[a], origin[a][i]);
+			}
+		}
+		double scale[3];
+		for (int a = 0; a < 3; ++a)
+			scale[a] = (hi[a] > lo[a]) ? 3.999 / (hi[a] - lo[a]) : 0.0;
+
+		chunk.keys.resize(count);
+		uint32_t counts[kSortBuckets] = {};
+		for (int i = 0; i < count; ++i) {
+			size_t r = begin + i;
+			uint32_t octant = (rays.direction_x[r] < 0 ? 1u : 0u) | (rays.direction_y[r] < 0 ? 2u : 0u) | (rays.direction_z[r] < 0 ? 4u : 0u);
+			uint32_t cell = 0;
+			for (int a = 0; a < 3; ++a)
+				cell |= spread_bits(static_cast<uint32_t>((origin[a][i] - lo[a]) * scale[a])) << a;
+			uint32_t key = octant << 6 | cell;
+			chunk.keys[i] = key;
+			++counts[key];
+		}
+
+		uint32_t offset = 0;
+		for (int k = 0; k < kSortBuckets; ++k) {
+			uint32_t c = counts[k];
+			counts[k] = offset;
+			offset += c;
+		}
+		chunk.order.resize(count);
+		for (int i = 0; i < count; ++i)
+			chunk.order[counts[chunk.keys[i]]++] = static_cast<uint32_t>(i);
+	}
+
+	template <class Emit>
+	QueryStats run(const RayBatch& rays, Emit emit, bool any_hit) const {
+		auto start = std::chrono::high_resolution_clock::now();
+		const size_t chunk_size = static_cast<size_t>(options.chunk_size);
+		const long long chunks = static_cast<long long>((rays.count + chunk_size - 1) / chunk_size);
+
+		#pragma omp parallel for schedule(dynamic)
+		for (long long c = 0; c < chunks; ++c) {
+			static thread_local Chunk chunk;
+			const size_t begin = static_cast<size_t>(c) * chunk_size;
+			const int count = static_cast<int>(std::min(chunk_size, rays.count - begin));
+
+			if (options.sort) {
+				sort_chunk(rays, begin, count, chunk);
+			} else {
+				chunk.order.resize(count);
+				for (int i = 0; i < count; ++i)
+					chunk.order[i] = static_cast<uint32_t>(i);
+			}
+
+			chunk.rays.resize(count);
+			chunk.t_min.resize(count);
+			chunk.t_max.resize(count);
+			for (int i = 0; i < count; ++i) {
+				size_t r = begin + chunk.order[i];
+				chunk.rays[i] = Ray(Vec3(rays.origin_x[r], rays.origin_y[r], rays.origin_z[r]),
+									Vec3(rays.direction_x[r], rays.direction_y[r], rays.direction_z[r]));
+				chunk.t_min[i] = rays.t_min[r];
+				chunk.t_max[i] = rays.t_max[r];
+			}
+
+			chunk.primitive.resize(count);
+			chunk.t.resize(count);
+			bvh.closest_hit_batch(chunk.rays.data(), chunk.t_min.data(), chunk.t_max.data(), 1, count,
+								  chunk.primitive.data(), chunk.t.data(), options.group_size, any_hit);
+
+			for (int i = 0; i < count; ++i)
+				emit(chunk, begin + chunk.order[i], i);
+		}
+
+		std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start;
+		QueryStats stats;
+		stats.queries = rays.count;
+		stats.seconds = elapsed.count();
+		return stats;
+	}
+};
+
+#endif
@@ -0,0 +1,326 @@
+#ifndef RENDER_CACHE_H
+#define RENDER_CACHE_H
+
+#include "options.h"
+#include "vec3.h"
+#include "footprint.h"
+#include <string>
+#include <vector>
+#include <fstream>
+#include <filesystem>
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <type_traits>
+#include <iterator>
+
+// finished tiles of earlier renders, on disk and addressed by what they show. a render's key
+// hashes every input that decides its image (the scene by value, the camera, the size, spp,
+// depth, ...), a tile's key is that plus the tile's rectangle, and the tile's file is named
+// after its key. the image is cut into a fixed grid of kTileSize tiles, so crops that overlap
+// share the tiles both touch. a tile found on disk is copied into the framebuffer instead of
+// being traced; the others are traced whole (even where the crop only covers part of one)
+// and written back for next time.
+//
+// files are replaced atomically. a hit refreshes the file's modification time, and the files
+// modified longest ago are deleted first once the directory grows over its size limit (LRU).
+//
+// with footprints (footprint.h) a tile also keeps what its paths touched, and every set of
+// render settings remembers the scene it last rendered. after an edit that leaves the geometry
+// and the lights where they were (a recolour), the last render's tiles that touched none of
+// the edited primitives are taken over as they are, and only the others are traced again.
+
+// FNV-1a over the bytes of the values added, in order. doubles are hashed by their bits with
+// -0 folded into 0, so equal inputs always give equal keys
+class InputHash {
+public:
+	template <typename T>
+	InputHash& add(T value) {
+		static_assert(std::is_arithmetic<T>::value, "hash numbers, or add the fields one by one");
+		if constexpr (std::is_floating_point<T>::value) {
+			double v = (value == 0) ? 0.0 : static_cast<double>(value);
+			bytes(&v, sizeof(v));
+		} else {
+			bytes(&value, sizeof(value));
+		}
+		return *this;
+	}
+
+	InputHash& add(const Vec3& v) { return add(v.x).add(v.y).add(v.z); }
+
+	InputHash& add(const std::string& text) {
+		add(text.size());
+		bytes(text.data(), text.size());
+		return *this;
+	}
+
+	uint64_t value() const { return state; }
+
+private:
+	uint64_t state = 14695981039346656037ull;
+
+	void bytes(const void* data, size_t size) {
+		const unsigned char* p = static_cast<const unsigned char*>(data);
+		for (size_t i = 0; i < size; ++i) {
+			state ^= p[i];
+			state *= 1099511628211ull;
+		}
+	}
+};
+
+// one primitive of the scene: its value hash (shape and material) and its shape alone
+struct SceneEntry {
+	uint64_t object = 0;
+	uint64_t shape = 0;
+	bool emitter = false;
+};
+
+// how a scene differs from the one rendered before with the same settings
+struct SceneEdit {
+	// the shapes and the emitters are the same, only materials changed: tiles whose
+	// footprints miss every changed primitive are still right
+	bool materials_only = false;
+	// value hashes of the previous scene's primitives that are gone or changed
+	std::vector<uint64_t> changed;
+};
+
+struct CacheStats {
+	int hits = 0;
+	int misses = 0;
+	// tiles of the previous scene taken over after an edit, and the ones the edit touched
+	int reused = 0;
+	int invalidated = 0;
+	int stored = 0;
+	int evicted = 0;
+	// size of the cache directory after the last eviction
+	long long bytes = 0;
+};
+
+class RenderCache {
+public:
+	static constexpr int kTileSize = 32;
+
+	RenderCache(const std::string& directory, long long max_bytes) : directory(directory), max_bytes(max_bytes) {
+		std::error_code error;
+		std::filesystem::create_directories(directory, error);
+		if (!std::filesystem::is_directory(directory))
+			throw std::runtime_error("Could not create the cache directory " + directory + ".");
+	}
+
+	// the grid tiles (clamped to the image) that overlap the crop
+	static std::vector<Crop> tiles(const Crop& crop, int image_width, int image_height) {
+		std::vector<Crop> result;
+		for (int y = crop.y0 / kTileSize * kTileSize; y < crop.y1; y += kTileSize)
+			for (int x = crop.x0 / kTileSize * kTileSize; x < crop.x1; x += kTileSize)
+				result.push_back({ x, y, std::min(x + kTileSize, image_width), std::min(y + kTileSize, image_height) });
+		return result;
+	}
+
+	// the key of a scene rendered with the settings `base`, in any primitive order
+	static uint64_t scene_key(uint64_t base, std::vector<SceneEntry> scene) {
+		std::sort(scene.begin(), scene.end(), [](const SceneEntry& a, const SceneEntry& b) { return a.object < b.object; });
+		InputHash hash;
+		hash.add(base);
+		for (const SceneEntry& entry : scene)
+			hash.add(entry.object);
+		return hash.value();
+	}
+
+	static SceneEdit compare(const std::vector<SceneEntry>& before, const std::vector<SceneEntry>& after) {
+		auto sorted = [](const std::vector<SceneEntry>& scene, bool emitters_only, auto field) {
+			std::vector<uint64_t> values;
+			for (const SceneEntry& entry : scene)
+				if (!emitters_only || entry.emitter)
+					values.push_back(entry.*field);
+			std::sort(values.begin(), values.end());
+			return values;
+		};
+		SceneEdit edit;
+		edit.materials_only = sorted(before, false, &SceneEntry::shape) == sorted(after, false, &SceneEntry::shape)
+			&& sorted(before, true, &SceneEntry::shape) == sorted(after, true, &SceneEntry::shape);
+		std::vector<uint64_t> old_objects = sorted(before, false, &SceneEntry::object);
+		std::vector<uint64_t> new_objects = sorted(after, false, &SceneEntry::object);
+		std::set_difference(old_objects.begin(), old_objects.end(), new_objects.begin(), new_objects.end(), std::back_inserter(edit.changed));
+		return edit;
+	}
+
+	// copies the tile into the framebuffer if it is cached. footprint, if not null, gets the
+	// tile's footprint, and a tile stored without one does not count
+	bool load(uint64_t render_key, const Crop& tile, std::vector<Color>& framebuffer, int image_width, TileFootprint* footprint = nullptr) {
+		std::vector<Color> pixels;
+		if (!read(tile_key(render_key, tile), tile, pixels, footprint)) {
+			++stats_.misses;
+			return false;
+		}
+		copy_in(tile, pixels, framebuffer, image_width);
+		++stats_.hits;
+		return true;
+	}
+
+	// the tile as a render of the previous scene left it, if its footprint shows that none
+	// of the changed primitives mattered to it
+	bool load_unaffected(uint64_t previous_key, const Crop& tile, const SceneEdit& edit, std::vector<Color>& framebuffer, int image_width, TileFootprint& footprint) {
+		std::vector<Color> pixels;
+		if (!read(tile_key(previous_key, tile), tile, pixels, &footprint))
+			return false;
+		for (uint64_t changed : edit.changed) {
+			if (footprint.may_contain(changed)) {
+				++stats_.invalidated;
+				return false;
+			}
+		}
+		copy_in(tile, pixels, framebuffer, image_width);
+		++stats_.reused;
+		return true;
+	}
+
+	// the scene last rendered with the settings `base`, false if there is none (or the file
+	// is truncated or corrupt: its count has to agree with its size before anything is allocated)
+	bool read_scene(uint64_t base, std::vector<SceneEntry>& scene) const {
+		const std::string path = scene_file_for(base);
+		std::error_code error;
+		const uintmax_t size = std::filesystem::file_size(path, error);
+		std::ifstream in(path, std::ios::binary);
+		uint64_t count = 0;
+		if (error || !in.read(reinterpret_cast<char*>(&count), sizeof(count)))
+			return false;
+		if (count != (size - sizeof(count)) / sizeof(SceneEntry) || (size - sizeof(count)) % sizeof(SceneEntry) != 0)
+			return false;
+		scene.resize(count);
+		return static_cast<bool>(in.read(reinterpret_cast<char*>(scene.data()), count * sizeof(SceneEntry)));
+	}
+
+	void write_scene(uint64_t base, const std::vector<SceneEntry>& scene) {
+		const std::string path = scene_file_for(base);
+		const std::string temporary = path + ".partial";
+		{
+			std::ofstream out(temporary, std::ios::binary);
+			uint64_t count = scene.size();
+			out.write(reinterpret_cast<const char*>(&count), sizeof(count));
+			out.write(reinterpret_cast<const char*>(scene.data()), scene.size() * sizeof(SceneEntry));
+			if (!out)
+				throw std::runtime_error("Could not write " + temporary + ".");
+		}
+		if (std::rename(temporary.c_str(), path.c_str()) != 0)
+			throw std::runtime_error("Could not move " + temporary + " to " + path + ".");
+	}
+
+	void store(uint64_t render_key, const Crop& tile, const std::vector<Color>& framebuffer, int image_width, const TileFootprint* footprint = nullptr) {
+		Header header;
+		std::memcpy(header.magic, kMagic, sizeof(header.magic));
+		header.key = tile_key(render_key, tile);
+		header.width = tile.x1 - tile.x0;
+		header.height = tile.y1 - tile.y0;
+		header.has_footprint = footprint != nullptr;
+
+		const std::string path = file_for(header.key);
+		const std::string temporary = path + ".partial";
+		{
+			std::ofstream out(temporary, std::ios::binary);
+			out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+			for (int y = tile.y0; y < tile.y1; ++y)
+				out.write(reinterpret_cast<const char*>(&framebuffer[y * image_width + tile.x0]), header.width * sizeof(Color));
+			if (footprint)
+				out.write(reinterpret_cast<const char*>(footprint->words), sizeof(footprint->words));
+			if (!out)
+				throw std::runtime_error("Could not write " + temporary + ".");
+		}
+		if (std::rename(temporary.c_str(), path.c_str()) != 0)
+			throw std::runtime_error("Could not move " + temporary + " to " + path + ".");
+		++stats_.stored;
+	}
+
+	// deletes the least recently used tiles until the directory fits the size limit
+	void evict() {
+		struct Entry {
+			std::filesystem::file_time_type used;
+			long long size;
+			std::filesystem::path path;
+		};
+		std::vector<Entry> entries;
+		long long total = 0;
+		std::error_code error;
+		for (const auto& entry : std::filesystem::directory_iterator(directory, error)) {
+			std::error_code gone;
+			if (entry.path().extension() != ".tile")
+				continue;
+			long long size = static_cast<long long>(entry.file_size(gone));
+			auto used = entry.last_write_time(gone);
+			if (gone)
+				continue;
+			entries.push_back({ used, size, entry.path() });
+			total += size;
+		}
+		std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) { return a.used < b.used; });
+		for (const Entry& entry : entries) {
+			if (total <= max_bytes)
+				break;
+			std::error_code gone;
+			if (std::filesystem::remove(entry.path, gone)) {
+				total -= entry.size;
+				++stats_.evicted;
+			}
+		}
+		stats_.bytes = total;
+	}
+
+	const CacheStats& stats() const { return stats_; }
+
+private:
+	static constexpr char kMagic[8] = { 'r', 'f', 't', 'i', 'l', 'e', '0', '2' };
+
+	// followed by the pixels, row by row, and the footprint's words if it has one
+	struct Header {
+		char magic[8];
+		uint64_t key;
+		int32_t width;
+		int32_t height;
+		int32_t has_footprint;
+		int32_t unused = 0;
+	};
+
+	std::string directory;
+	long long max_bytes;
+	CacheStats stats_;
+
+	static uint64_t tile_key(uint64_t render_key, const Crop& tile) {
+		return InputHash().add(render_key).add(tile.x0).add(tile.y0).add(tile.x1).add(tile.y1).value();
+	}
+
+	std::string file_for(uint64_t key, const char* extension = ".tile") const {
+		char name[32];
+		std::snprintf(name, sizeof(name), "%016llx%s", static_cast<unsigned long long>(key), extension);
+		return (std::filesystem::path(directory) / name).string();
+	}
+
+	std::string scene_file_for(uint64_t base) const { return file_for(base, ".scene"); }
+
+	bool read(uint64_t key, const Crop& tile, std::vector<Color>& pixels, TileFootprint* footprint) {
+		const std::string path = file_for(key);
+		std::ifstream in(path, std::ios::binary);
+		Header header;
+		if (!in || !in.read(reinterpret_cast<char*>(&header), sizeof(header)) || std::memcmp(header.magic, kMagic, sizeof(header.magic)) != 0
+			|| header.key != key || header.width != tile.x1 - tile.x0 || header.height != tile.y1 - tile.y0 || (footprint && !header.has_footprint))
+			return false;
+		pixels.resize(static_cast<size_t>(header.width) * header.height);
+		if (!in.read(reinterpret_cast<char*>(pixels.data()), pixels.size() * sizeof(Color)))
+			return false;
+		if (footprint && !in.read(reinterpret_cast<char*>(footprint->words), sizeof(footprint->words)))
+			return false;
+
+		// most recently used
+		std::error_code error;
+		std::filesystem::last_write_time(path, std::filesystem::file_time_type::clock::now(), error);
+		return true;
+	}
+
+	static void copy_in(const Crop& tile, const std::vector<Color>& pixels, std::vector<Color>& framebuffer, int image_width) {
+		const int width = tile.x1 - tile.x0;
+		for (int y = tile.y0; y < tile.y1; ++y)
+			std::copy_n(&pixels[(y - tile.y0) * width], width, &framebuffer[y * image_width + tile.x0]);
+	}
+};
+
+#endif
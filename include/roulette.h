@@ -0,0 +1,288 @@
+#ifndef ROULETTE_H
+#define ROULETTE_H
+
+#include "hittable_list.h"
+#include "material.h"
+#include "camera.h"
+#include "lights.h"
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <omp.h>
+
+// learned russian roulette and splitting, after "efficiency-aware russian roulette and
+// splitting" (Rath et al. 2022), spatial part only.
+//
+// at every scattering vertex a path is continued with an expected q copies (q < 1 is russian
+// roulette, q > 1 splitting), each weighted by 1 / q, which keeps the estimate unbiased for
+// any q. the q that minimizes variance * cost of the whole pixel estimate is about
+//
+//   q = throughput * sqrt(X / (I * V)) * sqrt(C / c)
+//
+// with c the cost (rays) of what the continuation brings back, I the pixel's value, V the per
+// sample variance of a pixel divided by its value and C the rays per sample, the last two
+// averaged over the image. splitting (q > 1) only averages away the continuation's variance,
+// so X is its variance there; roulette (q < 1) also throws away its mean, so X is its second
+// moment there. the statistics of the continuations are learned per cell of a hashed grid
+// from every one traced so far; I, V and C come from the samples of the earlier passes.
+//
+// the paper divides the variance by I^2 (relative error). the image is written with gamma 2,
+// where an error of e at a pixel of value I shows up as about e / (2 sqrt(I)), so the error
+// that ends up in the file scales with variance / I instead. minimizing plain variance spent
+// too little on dark pixels, relative variance too much.
+
+inline double luminance(const Color& c) {
+	return 0.2126 * c.x + 0.7152 * c.y + 0.0722 * c.z;
+}
+
+struct RouletteSettings {
+	double min_factor = 0.1;
+	double max_factor = 4.0;
+	// product of the split factors along one path; stops a few bright cells from multiplying
+	// a path into thousands
+	double max_branching = 8.0;
+	// continuations a cell needs to have seen before its estimate is used, and after which it
+	// stops learning (recording costs about as much as the lookup)
+	int min_samples = 16;
+	int max_samples = 4096;
+};
+
+// how the roulette did over one render
+struct RouletteStats {
+	long long vertices = 0;
+	long long terminated = 0;
+	long long split = 0;
+};
+
+class RouletteCache {
+public:
+	// cells are about the size of a typical primitive (the median bounding box diagonal)
+	RouletteCache(const HittableList& world, RouletteSettings settings = RouletteSettings())
+		: settings(settings), cells(kTableSize), threads(std::max(1, omp_get_max_threads())) {
+		std::vector<double> sizes;
+		for (const auto& object : world.objects) {
+			AABB box;
+			if (object->bounding_box(box))
+				sizes.push_back((box.maximum - box.minimum).length());
+		}
+		if (!sizes.empty()) {
+			std::nth_element(sizes.begin(), sizes.begin() + sizes.size() / 2, sizes.end());
+			cell_size = std::max(1e-6, sizes[sizes.size() / 2]);
+		}
+	}
+
+	// learned estimates are only used once the earlier passes have set these
+	void set_image_estimates(double variance_per_value, double rays_per_sample) {
+		image_variance = variance_per_value;
+		image_cost = rays_per_sample;
+	}
+
+	uint64_t cell(const Vec3& p) const {
+		auto axis = [this](double v) {
+			return static_cast<uint64_t>(static_cast<int64_t>(std::floor(v / cell_size)) + (1 << 20)) & 0x1fffff;
+		};
+		// 0 marks an empty slot, so keys start at 1
+		return (axis(p.x) | axis(p.y) << 21 | axis(p.z) << 42) + 1;
+	}
+
+	// the continuation from a vertex in `cell` brought back `value` (luminance) for `cost` rays
+	void record(uint64_t cell, double value, double cost) {
+		ThreadState& thread = threads[omp_get_thread_num()];
+		if (thread.pending.empty())
+			thread.pending.resize(kTableSize);
+		Accumulator* a = insert(thread.pending, cell);
+		if (!a)
+			return; // table full around this slot, the sample is dropped
+		a->count += 1;
+		a->sum += value;
+		a->second_moment += value * value;
+		a->cost += cost;
+	}
+
+	// folds what the threads recorded during the last pass into the estimates
+	void update() {
+		for (auto& thread : threads) {
+			for (const Accumulator& pending : thread.pending) {
+				if (pending.key == 0)
+					continue;
+				Accumulator* a = insert(cells, pending.key);
+				if (!a)
+					continue;
+				a->count += pending.count;
+				a->sum += pending.sum;
+				a->second_moment += pending.second_moment;
+				a->cost += pending.cost;
+			}
+			std::fill(thread.pending.begin(), thread.pending.end(), Accumulator());
+		}
+	}
+
+	// expected copies of the continuation from `cell` for a path with this (luminance)
+	// throughput, in a pixel whose value is estimated at `pixel`. learn is set if the cell
+	// still wants record() to hear about the continuations
+	double factor(uint64_t cell, double throughput, double pixel, double branching, bool& learn) const {
+		const Accumulator* a = find(cells, cell);
+		learn = !a || a->count < settings.max_samples;
+		if (image_variance <= 0 || pixel <= 0 || !a || a->count < settings.min_samples)
+			return 1.0;
+		double second_moment = a->second_moment / a->count;
+		double mean = a->sum / a->count;
+		double variance = std::max(0.0, second_moment - mean * mean);
+		double cost = std::max(1.0, a->cost / a->count);
+		// a cell whose continuations vary a lot but bring back little on average gets split;
+		// one whose continuations are dim and steady gets roulette; in between, q stays 1
+		double scale = throughput * std::sqrt(image_cost / (cost * pixel * image_variance));
+		double q = 1.0;
+		if (scale * std::sqrt(variance) > 1.0)
+			q = scale * std::sqrt(variance);
+		else if (scale * std::sqrt(second_moment) < 1.0)
+			q = scale * std::sqrt(second_moment);
+		q = std::min(q, settings.max_branching / branching);
+		return std::clamp(q, settings.min_factor, settings.max_factor);
+	}
+
+	RouletteStats& stats() const { return threads[omp_get_thread_num()].stats; }
+
+	RouletteStats total_stats() const {
+		RouletteStats total;
+		for (const auto& thread : threads) {
+			total.vertices += thread.stats.vertices;
+			total.terminated += thread.stats.terminated;
+			total.split += thread.stats.split;
+		}
+		return total;
+	}
+
+	// the shared table and one pending table per thread, once every thread has recorded
+	static size_t table_bytes(int threads) {
+		return (static_cast<size_t>(threads) + 1) * kTableSize * sizeof(Accumulator);
+	}
+
+	size_t cell_count() const {
+		return std::count_if(cells.begin(), cells.end(), [](const Accumulator& a) { return a.key != 0; });
+	}
+
+private:
+	// open addressing, linear probing over at most kProbes slots. every thread has a table
+	// of its own for the pass in flight, so recording takes no locks
+	static constexpr size_t kTableSize = size_t(1) << 15;
+	static constexpr size_t kProbes = 16;
+
+	struct Accumulator {
+		uint64_t key = 0;
+		long long count = 0;
+		double sum = 0;
+		double second_moment = 0;
+		double cost = 0;
+	};
+
+	struct alignas(64) ThreadState {
+		std::vector<Accumulator> pending;
+		RouletteStats stats;
+	};
+
+	RouletteSettings settings;
+	double cell_size = 1.0;
+	double image_variance = 0;
+	double image_cost = 0;
+	std::vector<Accumulator> cells;
+	mutable std::vector<ThreadState> threads;
+
+	static size_t slot(uint64_t key) {
+		key ^= key >> 33;
+		key *= 0xff51afd7ed558ccdull;
+		key ^= key >> 33;
+		return static_cast<size_t>(key) & (kTableSize - 1);
+	}
+
+	static const Accumulator* find(const std::vector<Accumulator>& table, uint64_t key) {
+		size_t s = slot(key);
+		for (size_t probe = 0; probe < kProbes; ++probe, s = (s + 1) & (kTableSize - 1)) {
+			if (table[s].key == key)
+				return &table[s];
+			if (table[s].key == 0)
+				return nullptr;
+		}
+		return nullptr;
+	}
+
+	static Accumulator* insert(std::vector<Accumulator>& table, uint64_t key) {
+		size_t s = slot(key);
+		for (size_t probe = 0; probe < kProbes; ++probe, s = (s + 1) & (kTableSize - 1)) {
+			if (table[s].key == 0)
+				table[s].key = key;
+			if (table[s].key == key)
+				return &table[s];
+		}
+		return nullptr;
+	}
+};
+
+// ray_color with roulette and splitting: the radiance arriving along `ray`. recursive, since
+// a split vertex has to add up several continuations.
+//
+// ray_color drops a path that is still bouncing at max depth, light it collected included.
+// to converge to the same image, every call also estimates the chance that the path from here
+// on ends within the depth (`completes`), and light collected at a vertex is weighted by the
+// estimate for the continuation after it.
+//
+// pixel is the pixel's value estimated by the earlier passes (0 before there is one: no
+// roulette), throughput the luminance weight of this ray in it, branching the split factor so far.
+inline Color ray_color_roulette(const Ray& ray, const Hittable& world, int depth, long long& rays_traced, const LightSet* lights, RouletteCache& cache, double& completes, double pixel, double throughput = 1.0, double branching = 1.0, bool skip_emission = false) {
+	completes = 0;
+	if (depth <= 0)
+		return Color(0, 0, 0);
+
+	HitRecord record;
+	++rays_traced;
+	completes = 1;
+	if (!world.hit(ray, 0.001, INFINITY, record))
+		return sky_color(ray);
+
+	Color collected = skip_emission ? Color(0, 0, 0) : record.material->emitted();
+	Ray scattered;
+	Color attenuation;
+	if (!record.material->scatter(ray, record, attenuation, scattered))
+		return collected;
+
+	bool sampled_lights = lights && record.material->is_diffuse();
+	if (sampled_lights)
+		collected += attenuation * lights->sample(world, record, rays_traced);
+
+	RouletteStats& stats = cache.stats();
+	++stats.vertices;
+	const uint64_t cell = cache.cell(record.point);
+	bool learn = false;
+	double q = cache.factor(cell, throughput, pixel, branching, learn);
+	int copies = static_cast<int>(q);
+	if (random_double() < q - copies)
+		++copies;
+	if (copies == 0)
+		++stats.terminated;
+	else if (copies > 1)
+		++stats.split;
+
+	const double child_throughput = throughput * luminance(attenuation) / q;
+	const double child_branching = branching * std::max(1.0, q);
+	Color continuation(0, 0, 0);
+	double continuation_completes = 0;
+	for (int c = 0; c < copies; ++c) {
+		// every copy scatters on its own
+		if (c > 0 && !record.material->scatter(ray, record, attenuation, scattered)) {
+			continuation_completes += 1;
+			continue;
+		}
+		long long rays_before = rays_traced;
+		double child_completes = 0;
+		Color incoming = attenuation * ray_color_roulette(scattered, world, depth - 1, rays_traced, lights, cache, child_completes, pixel, child_throughput, child_branching, sampled_lights);
+		if (learn)
+			cache.record(cell, luminance(incoming), static_cast<double>(rays_traced - rays_before));
+		continuation += incoming;
+		continuation_completes += child_completes;
+	}
+	completes = continuation_completes / q;
+	return collected * completes + continuation / q;
+}
+
+#endif
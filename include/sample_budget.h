@@ -0,0 +1,83 @@
+#ifndef SAMPLE_BUDGET_H
+#define SAMPLE_BUDGET_H
+
+#include "options.h"
+
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <cmath>
+
+// no pixel gets more than this many times --spp. a small bright spot in a dark mask would
+// otherwise take almost the whole budget (a 1 pixel spot on a black 400x225 mask asks for
+// over a million samples)
+constexpr int kMaxSampleFactor = 8;
+
+// per pixel sample counts from an importance mask, for the pixels of window (the rest get
+// none). the total stays what a uniform render of the window would spend (samples_per_pixel
+// for every pixel); every pixel gets minimum_samples, and the rest of the total is handed out
+// in proportion to the mask, up to kMaxSampleFactor * samples_per_pixel a pixel.
+//
+// importance holds one value in [0, 1] per mask pixel (mask_width x mask_height, top down).
+// the mask does not need to match the image: every image pixel reads the nearest mask pixel.
+inline std::vector<int> allocate_samples(const std::vector<double>& importance, int mask_width, int mask_height, int image_width, int image_height, const Crop& window, int samples_per_pixel, int minimum_samples) {
+	if (minimum_samples < 1 || minimum_samples > samples_per_pixel)
+		throw std::runtime_error("The minimum samples per pixel must be between 1 and " + std::to_string(samples_per_pixel) + ".");
+
+	std::vector<size_t> window_pixels;
+	std::vector<double> weight;
+	for (int y = window.y0; y < window.y1; ++y) {
+		int my = std::min(mask_height - 1, static_cast<int>((y + 0.5) * mask_height / image_height));
+		for (int x = window.x0; x < window.x1; ++x) {
+			int mx = std::min(mask_width - 1, static_cast<int>((x + 0.5) * mask_width / image_width));
+			double w = std::max(0.0, importance[my * mask_width + mx]);
+			window_pixels.push_back(static_cast<size_t>(y) * image_width + x);
+			weight.push_back(w);
+		}
+	}
+	const size_t pixels = window_pixels.size();
+	double weight_sum = 0;
+
+	// pixels whose share is over the cap take the cap, and what they leave is shared out again
+	// among the others, until no share is over it. an all black mask, or one whose bright
+	// pixels are all capped, says nothing more: the rest is spread evenly. the uniform total
+	// always fits, since the cap is above samples_per_pixel
+	const double cap = static_cast<double>(kMaxSampleFactor) * samples_per_pixel - minimum_samples;
+	double extra = static_cast<double>(samples_per_pixel - minimum_samples) * pixels;
+	std::vector<bool> capped(pixels, false);
+	for (bool changed = true; changed;) {
+		changed = false;
+		weight_sum = 0;
+		for (size_t i = 0; i < pixels; ++i)
+			weight_sum += capped[i] ? 0.0 : weight[i];
+		if (weight_sum <= 0) {
+			for (size_t i = 0; i < pixels; ++i)
+				weight[i] = capped[i] ? 0.0 : 1.0;
+			weight_sum = static_cast<double>(std::count(capped.begin(), capped.end(), false));
+		}
+		const double scale = extra / weight_sum;
+		for (size_t i = 0; i < pixels; ++i) {
+			if (!capped[i] && weight[i] * scale > cap) {
+				capped[i] = true;
+				extra -= cap;
+				changed = true;
+			}
+		}
+	}
+
+	// the fractional part each pixel cannot take is carried to the next one, so the counts
+	// add up to exactly the uniform total
+	std::vector<int> samples(static_cast<size_t>(image_width) * image_height, 0);
+	double carry = 0;
+	for (size_t i = 0; i < pixels; ++i) {
+		double share = capped[i] ? cap : extra * weight[i] / weight_sum;
+		double wanted = share + carry;
+		int whole = static_cast<int>(std::min(std::floor(wanted + 0.5), cap));
+		carry = wanted - whole;
+		samples[window_pixels[i]] = minimum_samples + whole;
+	}
+	return samples;
+}
+
+#endif
@@ -0,0 +1,130 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include "options.h"
+#include <vector>
+#include <map>
+#include <mutex>
+
+// hands out the tiles of several jobs (whatever rectangles each job is cut into) to the
+// workers one at a time, always from the most important job: highest priority first, then the
+// one that came first. there are no batches and no barrier. a job that a more important one
+// overtakes just gets no further tiles until it is the most important again, so a new job waits
+// for at most one tile per worker, and no worker idles while any job has tiles left.
+//
+// a job starts out waiting for its setup (building a scene can take a while). the first worker
+// to find it the most important job with something to do gets a setup task, and hands the
+// tiles over with ready() (or gives up with drop()). the other workers keep rendering the
+// less important jobs meanwhile.
+class TileScheduler {
+public:
+	struct Task {
+		int job = -1;
+		// set the job up, rather than render `tile`
+		bool setup = false;
+		Crop tile;
+		// the tile's position in the list the job gave ready()
+		size_t index = 0;
+	};
+
+	// the job's number, which tasks refer to it by
+	int add(int priority) {
+		std::lock_guard<std::mutex> lock(mutex);
+		entries[numbered].priority = priority;
+		return numbered++;
+	}
+
+	void ready(int job, std::vector<Crop> tiles) {
+		std::lock_guard<std::mutex> lock(mutex);
+		Entry& entry = entries.at(job);
+		entry.tiles = std::move(tiles);
+		entry.state = Entry::Ready;
+		if (entry.tiles.empty())
+			entries.erase(job);
+	}
+
+	void drop(int job) {
+		std::lock_guard<std::mutex> lock(mutex);
+		entries.erase(job);
+	}
+
+	// the next task for the calling worker, false if there is none right now
+	bool next(Task& task) {
+		std::lock_guard<std::mutex> lock(mutex);
+		auto best = entries.end();
+		for (auto it = entries.begin(); it != entries.end(); ++it) {
+			const Entry& entry = it->second;
+			bool has_work = entry.state == Entry::Waiting || (entry.state == Entry::Ready && entry.next < entry.tiles.size());
+			// entries are in arrival order, so the first of a priority wins
+			if (has_work && (best == entries.end() || entry.priority > best->second.priority))
+				best = it;
+		}
+		if (best == entries.end())
+			return false;
+
+		Entry& entry = best->second;
+		task.job = best->first;
+		task.setup = entry.state == Entry::Waiting;
+		if (task.setup) {
+			entry.state = Entry::SettingUp;
+			return true;
+		}
+		// the job that had the workers until now still has tiles left: it was overtaken
+		auto previous = entries.find(last_job);
+		if (previous != entries.end() && previous != best && previous->second.next < previous->second.tiles.size()
+			&& previous->second.priority < entry.priority)
+			++previous->second.preemptions;
+		last_job = task.job;
+		task.index = entry.next;
+		task.tile = entry.tiles[entry.next++];
+		++entry.in_flight;
+		return true;
+	}
+
+	// true when that was the job's last tile: the job is finished and forgotten. preemptions
+	// gets how often it lost the workers to a more important one so far
+	bool finish(const Task& task, int& preemptions) {
+		std::lock_guard<std::mutex> lock(mutex);
+		Entry& entry = entries.at(task.job);
+		preemptions = entry.preemptions;
+		--entry.in_flight;
+		if (entry.in_flight > 0 || entry.next < entry.tiles.size())
+			return false;
+		entries.erase(task.job);
+		return true;
+	}
+
+	// tiles not handed out yet, over every job that is ready
+	size_t queued_tiles() const {
+		std::lock_guard<std::mutex> lock(mutex);
+		size_t queued = 0;
+		for (const auto& [number, entry] : entries)
+			queued += entry.tiles.size() - entry.next;
+		return queued;
+	}
+
+	// jobs added and not finished or dropped yet
+	size_t jobs() const {
+		std::lock_guard<std::mutex> lock(mutex);
+		return entries.size();
+	}
+
+private:
+	struct Entry {
+		int priority = 0;
+		enum { Waiting, SettingUp, Ready } state = Waiting;
+		std::vector<Crop> tiles;
+		size_t next = 0;
+		int in_flight = 0;
+		int preemptions = 0;
+	};
+
+	mutable std::mutex mutex;
+	// by number, which is arrival order
+	std::map<int, Entry> entries;
+	int numbered = 0;
+	// the job the last tile went to
+	int last_job = -1;
+};
+
+#endif
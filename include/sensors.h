@@ -0,0 +1,208 @@
+#ifndef SENSORS_H
+#define SENSORS_H
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <filesystem>
+#include <algorithm>
+#include <cmath>
+#include <chrono>
+
+// temperature and energy counters the kernel exposes in sysfs. the roots are parameters, so a
+// directory laid out the same way can stand in for /sys (and a machine without the files
+// simply has no zones or domains).
+
+// root/thermal_zone*/temp, in millidegrees celsius
+class ThermalZones {
+public:
+	explicit ThermalZones(const std::string& root = "/sys/class/thermal") {
+		std::error_code error;
+		for (const auto& entry : std::filesystem::directory_iterator(root, error)) {
+			std::string name = entry.path().filename().string();
+			std::error_code missing;
+			if (name.rfind("thermal_zone", 0) == 0 && std::filesystem::exists(entry.path() / "temp", missing))
+				zones.push_back((entry.path() / "temp").string());
+		}
+		std::sort(zones.begin(), zones.end());
+	}
+
+	size_t size() const { return zones.size(); }
+
+	// the hottest zone in degrees celsius, NaN without a readable zone
+	double hottest() const {
+		double hottest = NAN;
+		for (const auto& zone : zones) {
+			std::ifstream in(zone);
+			long long millidegrees = 0;
+			if (in >> millidegrees && !(hottest >= millidegrees / 1000.0))
+				hottest = millidegrees / 1000.0;
+		}
+		return hottest;
+	}
+
+private:
+	std::vector<std::string> zones;
+};
+
+// the RAPL domains under root (intel-rapl:N at the top, intel-rapl:N:M for subdomains, named
+// in the domain's `name` file). only package-N domains count as packages: a top level domain
+// can also be psys, the whole platform, which already includes the packages. energy_uj counts microjoules and wraps
+// around at max_energy_range_uj; every call to update() folds the wraps since the last one
+// in, so call it more often than a counter can wrap (minutes at full load)
+class RaplDomains {
+public:
+	struct Domain {
+		// intel-rapl:0, intel-rapl:0:2, ...
+		std::string id;
+		std::string path;
+		std::string name;
+		bool package = false;
+		long long max_range = 0;
+		long long last = -1;
+		double joules = 0;
+	};
+
+	explicit RaplDomains(const std::string& root = "/sys/class/powercap") {
+		// sysfs lists the subdomains both at the top and inside their package; a stand-in
+		// directory may do either
+		std::error_code error;
+		for (const auto& entry : std::filesystem::directory_iterator(root, error)) {
+			add(entry.path());
+			std::error_code inner_error;
+			if (is_domain(entry.path()))
+				for (const auto& child : std::filesystem::directory_iterator(entry.path(), inner_error))
+					add(child.path());
+		}
+		std::sort(domains.begin(), domains.end(), [](const Domain& a, const Domain& b) { return a.id < b.id; });
+		domains.erase(std::unique(domains.begin(), domains.end(), [](const Domain& a, const Domain& b) { return a.id == b.id; }), domains.end());
+		update();
+	}
+
+	bool empty() const { return domains.empty(); }
+
+	// reads every counter, adding what it moved since the last call
+	void update() {
+		for (auto& domain : domains) {
+			long long now = read_number(std::filesystem::path(domain.path) / "energy_uj");
+			if (now < 0)
+				continue;
+			if (domain.last >= 0) {
+				long long delta = now - domain.last;
+				if (delta < 0)
+					delta += domain.max_range;
+				domain.joules += std::max(0LL, delta) * 1e-6;
+			}
+			domain.last = now;
+		}
+	}
+
+	// joules since construction, as of the last update(), over all packages
+	double package_joules() const {
+		double total = 0;
+		for (const auto& domain : domains)
+			if (domain.package)
+				total += domain.joules;
+		return total;
+	}
+
+	// the same over the dram subdomains
+	double dram_joules() const {
+		double total = 0;
+		for (const auto& domain : domains)
+			if (!domain.package && domain.name == "dram")
+				total += domain.joules;
+		return total;
+	}
+
+	bool has_dram() const {
+		return std::any_of(domains.begin(), domains.end(), [](const Domain& d) { return !d.package && d.name == "dram"; });
+	}
+
+private:
+	std::vector<Domain> domains;
+
+	static bool is_domain(const std::filesystem::path& path) {
+		std::error_code missing;
+		return path.filename().string().rfind("intel-rapl:", 0) == 0 && std::filesystem::exists(path / "energy_uj", missing);
+	}
+
+	void add(const std::filesystem::path& path) {
+		if (!is_domain(path))
+			return;
+		Domain domain;
+		domain.id = path.filename().string();
+		domain.path = path.string();
+		domain.name = read_word(path / "name");
+		// the id does not say: intel-rapl:1 is the second package on one machine and psys on
+		// another
+		domain.package = domain.name.rfind("package-", 0) == 0;
+		domain.max_range = read_number(path / "max_energy_range_uj");
+		domains.push_back(domain);
+	}
+
+	static long long read_number(const std::filesystem::path& file) {
+		std::ifstream in(file);
+		long long value = -1;
+		in >> value;
+		return value;
+	}
+
+	static std::string read_word(const std::filesystem::path& file) {
+		std::ifstream in(file);
+		std::string word;
+		in >> word;
+		return word;
+	}
+};
+
+// energy drawn between consecutive mark() calls, split into named phases. RAPL counts the
+// whole package (and its memory), not this process: anything else running shows up too
+class EnergyMeter {
+public:
+	struct Phase {
+		std::string name;
+		double seconds = 0;
+		double package_joules = 0;
+		double dram_joules = 0;
+	};
+
+	explicit EnergyMeter(const std::string& root = "/sys/class/powercap")
+		: rapl(root), last(std::chrono::steady_clock::now()) {}
+
+	bool available() const { return !rapl.empty(); }
+	bool has_dram() const { return rapl.has_dram(); }
+
+	// closes the phase that started at the previous mark (or construction)
+	void mark(const std::string& name) {
+		rapl.update();
+		auto now = std::chrono::steady_clock::now();
+		Phase phase;
+		phase.name = name;
+		phase.seconds = std::chrono::duration<double>(now - last).count();
+		phase.package_joules = rapl.package_joules() - last_package;
+		phase.dram_joules = rapl.dram_joules() - last_dram;
+		phases_.push_back(phase);
+		last = now;
+		last_package = rapl.package_joules();
+		last_dram = rapl.dram_joules();
+	}
+
+	const std::vector<Phase>& phases() const { return phases_; }
+
+	const Phase* find(const std::string& name) const {
+		for (const auto& phase : phases_)
+			if (phase.name == name)
+				return &phase;
+		return nullptr;
+	}
+
+private:
+	RaplDomains rapl;
+	std::chrono::steady_clock::time_point last;
+	double last_package = 0;
+	double last_dram = 0;
+	std::vector<Phase> phases_;
+};
+
+#endif
@@ -11,6 +11,8 @@ public:
 	Vec3 center;
 	double radius;
 	std::shared_ptr<Material> material;
+	// index in the scene, copied into HitRecord::primitive (render footprints, footprint.h)
+	int id = -1;
 	
 	Sphere(const Vec3& center, double radius, std::shared_ptr<Material> material)
 		: center(center), radius(radius), material(material) {}
@@ -70,10 +72,20 @@ public:
 		// i have been hit, here is the material the user gave me when i was created
 		// the hitrecord now carries a pointer to that material
 		record.material = material;
+		record.primitive = id;
 		
 		return true;
 	}
 
+	bool occluded(const Ray& ray, double t_min, double t_max, Occluder& occluder) const override {
+		HitRecord record;
+		if (!hit(ray, t_min, t_max, record))
+			return false;
+		occluder.center = center;
+		occluder.radius = radius;
+		return true;
+	}
+
 	bool bounding_box(AABB& output_box) const override {
 		output_box = AABB(
 			center - Vec3(radius, radius, radius),
@@ -81,6 +93,11 @@ public:
 		);
 		return true;
 	}
+
+	void refresh_materials(const std::vector<std::shared_ptr<Material>>& by_id) override {
+		if (id >= 0)
+			material = by_id[id];
+	}
 };
 
 #endif
\ No newline at end of file
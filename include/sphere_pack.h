@@ -0,0 +1,127 @@
+#ifndef SPHERE_PACK_H
+#define SPHERE_PACK_H
+
+#include "hittable.h"
+#include "sphere.h"
+#include "kernels.h"
+#include <vector>
+#include <memory>
+
+// a BVH leaf holding a handful of spheres in SoA layout (all x centers together, all
+// y centers together, ...). instead of one virtual Sphere::hit per sphere, the leaf runs
+// a single hit_spheres kernel over every lane and only builds a HitRecord for the winner.
+class SpherePack : public Hittable {
+public:
+	static constexpr int kCapacity = kMaxKernelLanes;
+
+	SpherePack() : count(0) {}
+
+	explicit SpherePack(const std::vector<std::shared_ptr<Sphere>>& spheres) : count(0) {
+		if (spheres.empty() || spheres.size() > static_cast<size_t>(kCapacity))
+			throw std::runtime_error("SpherePack needs between 1 and 16 spheres.");
+
+		for (const auto& sphere : spheres)
+			add(*sphere);
+	}
+
+	// appends one more sphere, returns false (and does nothing) once the pack is full
+	bool add(const Sphere& sphere) {
+		if (count == kCapacity)
+			return false;
+
+		lanes[count] = sphere.center.x;
+		lanes[kCapacity + count] = sphere.center.y;
+		lanes[2 * kCapacity + count] = sphere.center.z;
+		lanes[3 * kCapacity + count] = sphere.radius;
+		materials.push_back(sphere.material);
+		ids[count] = sphere.id;
+
+		AABB sphere_box;
+		sphere.bounding_box(sphere_box);
+		box = (count == 0) ? sphere_box : AABB::surrounding_box(box, sphere_box);
+		++count;
+		return true;
+	}
+
+	int size() const { return count; }
+
+	// packs objects[start, end) if every one of them is a Sphere, otherwise returns nullptr
+	static std::shared_ptr<SpherePack> try_pack(const std::vector<std::shared_ptr<Hittable>>& objects, size_t start, size_t end) {
+		if (end - start > static_cast<size_t>(kCapacity))
+			return nullptr;
+
+		std::vector<std::shared_ptr<Sphere>> spheres;
+		for (size_t i = start; i < end; ++i) {
+			auto sphere = std::dynamic_pointer_cast<Sphere>(objects[i]);
+			if (!sphere)
+				return nullptr;
+			spheres.push_back(sphere);
+		}
+		return std::make_shared<SpherePack>(spheres);
+	}
+
+	bool hit(const Ray& ray, double t_min, double t_max, HitRecord& record) const override {
+		const double origin[3] = { ray.origin.x, ray.origin.y, ray.origin.z };
+		const double direction[3] = { ray.direction.x, ray.direction.y, ray.direction.z };
+
+		double t;
+		int index = kernels().hit_spheres(lanes, kCapacity, count, origin, direction, t_min, t_max, &t);
+		if (index < 0)
+			return false;
+
+		Vec3 center(lanes[index], lanes[kCapacity + index], lanes[2 * kCapacity + index]);
+		double radius = lanes[3 * kCapacity + index];
+
+		record.t = t;
+		record.point = ray.at(t);
+		record.set_face_normal(ray, (record.point - center) / radius);
+		record.material = materials[index];
+		record.primitive = ids[index];
+		return true;
+	}
+
+	bool occluded(const Ray& ray, double t_min, double t_max, Occluder& occluder) const override {
+		const double origin[3] = { ray.origin.x, ray.origin.y, ray.origin.z };
+		const double direction[3] = { ray.direction.x, ray.direction.y, ray.direction.z };
+
+		++occlusion_visits();
+		double t;
+		int index = kernels().hit_spheres(lanes, kCapacity, count, origin, direction, t_min, t_max, &t);
+		if (index < 0)
+			return false;
+		occluder.center = Vec3(lanes[index], lanes[kCapacity + index], lanes[2 * kCapacity + index]);
+		occluder.radius = lanes[3 * kCapacity + index];
+		return true;
+	}
+
+	bool bounding_box(AABB& output_box) const override {
+		output_box = box;
+		return true;
+	}
+
+	// as a BVH leaf, made with make_shared
+	size_t memory_bytes() const override {
+		return sizeof(SpherePack) + kSharedControlBytes + heap_bytes();
+	}
+
+	void refresh_materials(const std::vector<std::shared_ptr<Material>>& by_id) override {
+		for (int i = 0; i < count; ++i)
+			if (ids[i] >= 0)
+				materials[i] = by_id[ids[i]];
+	}
+
+	// what the pack allocates besides itself
+	size_t heap_bytes() const {
+		return materials.capacity() * sizeof(std::shared_ptr<Material>);
+	}
+
+private:
+	// rows: center x | center y | center z | radius, each kCapacity long
+	alignas(64) double lanes[4 * kCapacity];
+	int count;
+	int ids[kCapacity];
+	std::vector<std::shared_ptr<Material>> materials;
+	AABB box;
+};
+
+#endif
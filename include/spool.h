@@ -0,0 +1,153 @@
+#ifndef SPOOL_H
+#define SPOOL_H
+
+#include <string>
+#include <vector>
+#include <set>
+#include <fstream>
+#include <sstream>
+#include <filesystem>
+#include <algorithm>
+#include <stdexcept>
+#include <cstdio>
+#include <chrono>
+#include <thread>
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <poll.h>
+#include <unistd.h>
+#endif
+
+// the spool directory of --daemon: job files (name.job) appear in it, their status files
+// (name.status) and, unless the job says otherwise, their images (name.ppm) are written next
+// to them. a finished job's file is renamed to name.job.done, a rejected one to
+// name.job.failed, so a restarted daemon only picks up what is left.
+//
+// a job file has one option per line, the command line's --name=value without the dashes,
+// plus priority=N (higher runs first, default 0). blank lines and lines starting with # are
+// skipped:
+//
+//     # preview of the grid
+//     scene=grid
+//     spp=16
+//     priority=10
+
+// writes text to path through a temporary file and a rename, so a reader sees the old or the
+// new contents and never half of either
+inline void write_file_atomic(const std::string& path, const std::string& text) {
+	const std::string temporary = path + ".partial";
+	{
+		std::ofstream out(temporary);
+		out << text;
+		if (!out)
+			throw std::runtime_error("Could not write " + temporary + ".");
+	}
+	if (std::rename(temporary.c_str(), path.c_str()) != 0)
+		throw std::runtime_error("Could not move " + temporary + " to " + path + ".");
+}
+
+struct JobDescription {
+	// file name without .job
+	std::string name;
+	std::string path;
+	int priority = 0;
+	// "--name=value" for every other line, for parse_options
+	std::vector<std::string> arguments;
+};
+
+// the errors do not name the file, the daemon reports them next to its path
+inline JobDescription read_job(const std::filesystem::path& path) {
+	JobDescription job;
+	job.name = path.stem().string();
+	job.path = path.string();
+	std::ifstream in(path);
+	if (!in)
+		throw std::runtime_error("Could not read the job file.");
+	std::string line;
+	while (std::getline(in, line)) {
+		line.erase(0, line.find_first_not_of(" \t"));
+		line.erase(line.find_last_not_of(" \t\r") + 1);
+		if (line.empty() || line[0] == '#')
+			continue;
+		if (line.find('=') == std::string::npos)
+			throw std::runtime_error("Expected name=value, got '" + line + "'.");
+		if (line.rfind("priority=", 0) == 0) {
+			try {
+				job.priority = std::stoi(line.substr(9));
+			} catch (const std::exception&) {
+				throw std::runtime_error("priority expects an integer, got '" + line.substr(9) + "'.");
+			}
+		} else {
+			job.arguments.push_back("--" + line);
+		}
+	}
+	return job;
+}
+
+// new job files in the spool directory. inotify (on linux) only wakes the daemon up early,
+// the directory listing is what counts, so a file that arrived while the daemon was busy, or
+// before it started, is found all the same
+class SpoolWatcher {
+public:
+	explicit SpoolWatcher(const std::string& directory) : directory(directory) {
+		std::error_code error;
+		std::filesystem::create_directories(directory, error);
+		if (!std::filesystem::is_directory(directory))
+			throw std::runtime_error("Could not create the spool directory " + directory + ".");
+#ifdef __linux__
+		descriptor = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (descriptor >= 0 && inotify_add_watch(descriptor, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+			close(descriptor);
+			descriptor = -1;
+		}
+#endif
+	}
+
+	~SpoolWatcher() {
+#ifdef __linux__
+		if (descriptor >= 0)
+			close(descriptor);
+#endif
+	}
+
+	SpoolWatcher(const SpoolWatcher&) = delete;
+	SpoolWatcher& operator=(const SpoolWatcher&) = delete;
+
+	bool notified() const { return descriptor >= 0; }
+
+	// .job files not returned before, oldest name first
+	std::vector<std::filesystem::path> scan() {
+		std::vector<std::filesystem::path> found;
+		std::error_code error;
+		for (const auto& entry : std::filesystem::directory_iterator(directory, error))
+			if (entry.path().extension() == ".job" && seen.insert(entry.path().filename().string()).second)
+				found.push_back(entry.path());
+		std::sort(found.begin(), found.end());
+		return found;
+	}
+
+	// true if something arrived since the last call. waits up to `seconds` for it (0: just
+	// looks). without inotify it cannot tell and says yes after the wait
+	bool wait(double seconds) {
+#ifdef __linux__
+		if (descriptor >= 0) {
+			pollfd request = { descriptor, POLLIN, 0 };
+			if (poll(&request, 1, static_cast<int>(seconds * 1000)) <= 0)
+				return false;
+			// drain the events, the listing will say what they were about
+			char buffer[4096];
+			while (read(descriptor, buffer, sizeof(buffer)) > 0) {}
+			return true;
+		}
+#endif
+		std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+		return true;
+	}
+
+private:
+	std::string directory;
+	std::set<std::string> seen;
+	int descriptor = -1;
+};
+
+#endif
@@ -0,0 +1,97 @@
+#ifndef SWEEP_H
+#define SWEEP_H
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <stdexcept>
+
+// the plan of --sweep: many renders of one scene in one process. every line names an option
+// (the command line's --name=value without the dashes) and the values it takes, separated by
+// |. the sweep renders every combination of them, the first line varying slowest. a line of
+// --- starts another block, whose combinations follow the first block's, so a plain list of
+// settings is one block per setting. blank lines and lines starting with # are skipped:
+//
+//     # 2 x 3 renders, then one more
+//     spp=16 | 64
+//     depth=4 | 8 | 16
+//     ---
+//     spp=256
+//     lookfrom=0,1,1
+//
+// each variant starts from the command line's options, so what the plan does not vary stays
+// as given there.
+struct SweepVariant {
+	// "--name=value" for parse_options
+	std::vector<std::string> arguments;
+	// "name=value ..." for the summary
+	std::string label;
+};
+
+inline std::vector<SweepVariant> read_sweep(const std::string& path) {
+	std::ifstream in(path);
+	if (!in)
+		throw std::runtime_error("Could not read the sweep plan " + path + ".");
+
+	// a block is its lines, a line the option's name and its values
+	using Line = std::pair<std::string, std::vector<std::string>>;
+	std::vector<std::vector<Line>> blocks(1);
+	auto trim = [](std::string text) {
+		text.erase(0, text.find_first_not_of(" \t"));
+		text.erase(text.find_last_not_of(" \t\r") + 1);
+		return text;
+	};
+	std::string line;
+	while (std::getline(in, line)) {
+		line = trim(line);
+		if (line.empty() || line[0] == '#')
+			continue;
+		if (line == "---") {
+			blocks.emplace_back();
+			continue;
+		}
+		size_t eq = line.find('=');
+		if (eq == std::string::npos || eq == 0)
+			throw std::runtime_error(path + ": expected name=value | value ..., got '" + line + "'.");
+		Line option{ trim(line.substr(0, eq)), {} };
+		size_t begin = eq + 1;
+		while (true) {
+			size_t end = line.find('|', begin);
+			std::string value = trim(line.substr(begin, end == std::string::npos ? std::string::npos : end - begin));
+			if (value.empty())
+				throw std::runtime_error(path + ": empty value for " + option.first + ".");
+			option.second.push_back(value);
+			if (end == std::string::npos)
+				break;
+			begin = end + 1;
+		}
+		blocks.back().push_back(option);
+	}
+
+	std::vector<SweepVariant> variants;
+	for (const auto& block : blocks) {
+		if (block.empty())
+			continue;
+		// an odometer over the lines' values, the last line turning fastest
+		std::vector<size_t> digits(block.size(), 0);
+		while (true) {
+			SweepVariant variant;
+			for (size_t l = 0; l < block.size(); ++l) {
+				const std::string setting = block[l].first + "=" + block[l].second[digits[l]];
+				variant.arguments.push_back("--" + setting);
+				variant.label += (l ? " " : "") + setting;
+			}
+			variants.push_back(variant);
+			size_t l = block.size();
+			while (l > 0 && ++digits[l - 1] == block[l - 1].second.size())
+				digits[--l] = 0;
+			if (l == 0)
+				break;
+		}
+	}
+	if (variants.empty())
+		throw std::runtime_error("The sweep plan " + path + " has no settings.");
+	return variants;
+}
+
+#endif
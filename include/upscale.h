@@ -0,0 +1,163 @@
+#ifndef UPSCALE_H
+#define UPSCALE_H
+
+#include "vec3.h"
+#include "ray.h"
+#include "hittable.h"
+#include "material.h"
+#include "camera.h"
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <omp.h>
+
+// draft renders: paths are traced at 1/factor of the resolution in each direction, and a
+// joint bilateral upsampler rebuilds the full size image, guided by what one primary ray per
+// full size pixel sees (depth, normal, albedo). those guides cost one hit() per pixel, the
+// paths they replace cost samples_per_pixel * depth.
+//
+// the upsampler works on demodulated radiance (pixel colour / albedo), which is smooth over a
+// surface, and multiplies the albedo back in at full resolution. colour edges between
+// materials therefore come out sharp even though no path was traced at that resolution.
+
+// per pixel first hit data. depth 0 means the primary ray escaped into the sky
+struct GuideBuffers {
+	int width = 0;
+	int height = 0;
+	std::vector<double> depth;
+	std::vector<Vec3> normal;
+	std::vector<Color> albedo;
+};
+
+// one ray through the centre of every pixel, stored top down like the framebuffer
+inline GuideBuffers render_guides(int image_width, int image_height, const Camera& camera, const Hittable& world, long long& rays_traced) {
+	GuideBuffers guides;
+	guides.width = image_width;
+	guides.height = image_height;
+	guides.depth.assign(image_width * image_height, 0.0);
+	guides.normal.assign(image_width * image_height, Vec3(0, 0, 0));
+	guides.albedo.assign(image_width * image_height, Color(0, 0, 0));
+
+	long long rays = 0;
+	#pragma omp parallel for schedule(dynamic) reduction(+:rays)
+	for (int y = 0; y < image_height; ++y) {
+		int j = image_height - 1 - y;
+		for (int i = 0; i < image_width; ++i) {
+			Ray ray = camera.get_ray((i + 0.5) / (image_width - 1), (j + 0.5) / (image_height - 1));
+			HitRecord record;
+			int index = y * image_width + i;
+			++rays;
+			if (world.hit(ray, 0.001, INFINITY, record)) {
+				guides.depth[index] = record.t * ray.direction.length();
+				guides.normal[index] = record.normal;
+				guides.albedo[index] = record.material->guide_albedo();
+			} else {
+				guides.albedo[index] = sky_color(ray);
+			}
+		}
+	}
+	rays_traced += rays;
+	return guides;
+}
+
+struct UpsampleOptions {
+	// spatial falloff, in low resolution pixels
+	double sigma_spatial = 1.0;
+	// relative depth difference at which a sample's weight drops to 1/e
+	double sigma_depth = 0.05;
+	// the cosine between the normals is squared this many times (5: cosine^32)
+	int normal_squarings = 5;
+};
+
+// low holds pixel averages at low_width x low_height, the result pixel averages at the guides'
+// size. every output pixel blends the 5 x 5 low resolution pixels around its position.
+inline std::vector<Color> guided_upsample(const std::vector<Color>& low, int low_width, int low_height, const GuideBuffers& guides, UpsampleOptions options = UpsampleOptions()) {
+	const int width = guides.width;
+	const int height = guides.height;
+	// the centre of full size pixel x sits at low resolution (x + 0.5) * scale_x - 0.5
+	const double scale_x = double(low_width) / width;
+	const double scale_y = double(low_height) / height;
+
+	// guide values of the low resolution pixels: depth and normal from the full size pixel
+	// under the centre, albedo averaged over the whole footprint (the path samples were spread
+	// over all of it). the radiance is divided by that albedo once here
+	std::vector<double> low_depth(low.size());
+	std::vector<Vec3> low_normal(low.size());
+	std::vector<Color> low_irradiance(low.size());
+	#pragma omp parallel for schedule(static)
+	for (int ly = 0; ly < low_height; ++ly) {
+		int y0 = ly * height / low_height;
+		int y1 = std::max(y0 + 1, (ly + 1) * height / low_height);
+		for (int lx = 0; lx < low_width; ++lx) {
+			int x0 = lx * width / low_width;
+			int x1 = std::max(x0 + 1, (lx + 1) * width / low_width);
+			Color albedo(0, 0, 0);
+			for (int y = y0; y < y1; ++y)
+				for (int x = x0; x < x1; ++x)
+					albedo += guides.albedo[y * width + x];
+			albedo = albedo / double((y1 - y0) * (x1 - x0));
+
+			int centre = ((y0 + y1) / 2) * width + (x0 + x1) / 2;
+			int index = ly * low_width + lx;
+			low_depth[index] = guides.depth[centre];
+			low_normal[index] = guides.normal[centre];
+			low_irradiance[index] = Color(low[index].x / std::max(albedo.x, 1e-3),
+										  low[index].y / std::max(albedo.y, 1e-3),
+										  low[index].z / std::max(albedo.z, 1e-3));
+		}
+	}
+
+	std::vector<Color> result(width * height);
+	const double spatial_falloff = 1.0 / (2.0 * options.sigma_spatial * options.sigma_spatial);
+	#pragma omp parallel for schedule(static)
+	for (int y = 0; y < height; ++y) {
+		double fy = (y + 0.5) * scale_y - 0.5;
+		int cy = static_cast<int>(std::floor(fy + 0.5));
+		for (int x = 0; x < width; ++x) {
+			double fx = (x + 0.5) * scale_x - 0.5;
+			int cx = static_cast<int>(std::floor(fx + 0.5));
+			const int index = y * width + x;
+			const double depth = guides.depth[index];
+			const Vec3& normal = guides.normal[index];
+			const double depth_falloff = depth > 0 ? 1.0 / (options.sigma_depth * depth) : 0.0;
+
+			Color sum(0, 0, 0);
+			double weight_sum = 0;
+			// fallback when no neighbour resembles this pixel (a feature smaller than a low
+			// resolution pixel): the purely spatial blend
+			Color spatial_sum(0, 0, 0);
+			double spatial_weight_sum = 0;
+			for (int ly = std::max(0, cy - 2); ly <= std::min(low_height - 1, cy + 2); ++ly) {
+				for (int lx = std::max(0, cx - 2); lx <= std::min(low_width - 1, cx + 2); ++lx) {
+					int sample = ly * low_width + lx;
+					double dx = lx - fx;
+					double dy = ly - fy;
+					double spatial = (dx * dx + dy * dy) * spatial_falloff;
+					double w = std::exp(-spatial);
+					spatial_sum += w * low_irradiance[sample];
+					spatial_weight_sum += w;
+
+					double sample_depth = low_depth[sample];
+					if ((depth > 0) != (sample_depth > 0))
+						continue; // one sees the sky, the other does not
+					if (depth > 0) {
+						double relative = (depth - sample_depth) * depth_falloff;
+						w = std::exp(-spatial - relative * relative);
+						double cosine = std::max(0.0, normal.dot(low_normal[sample]));
+						for (int k = 0; k < options.normal_squarings; ++k)
+							cosine *= cosine;
+						w *= cosine;
+					}
+					sum += w * low_irradiance[sample];
+					weight_sum += w;
+				}
+			}
+			Color irradiance = weight_sum > 1e-8 ? sum / weight_sum : spatial_sum / spatial_weight_sum;
+			const Color& albedo = guides.albedo[index];
+			result[index] = irradiance * albedo;
+		}
+	}
+	return result;
+}
+
+#endif
@@ -0,0 +1,790 @@
+#ifndef WIDE_BVH_H
+#define WIDE_BVH_H
+
+#include "hittable.h"
+#include "hittable_list.h"
+#include "sphere.h"
+#include "kernels.h"
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <stdexcept>
+#include <cstdint>
+#include <cmath>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+// a 16-wide BVH over spheres, laid out for AVX-512.
+//
+// BVHNode is a binary tree of shared_ptrs: every level costs a pointer chase and a virtual
+// call, and a box test only ever looks at one box. here every node holds the boxes of up to
+// 16 children side by side (float SoA), so one slab test over a full zmm register decides
+// which of the 16 children the ray enters, and each leaf holds up to 16 spheres (double SoA)
+// tested in two 8-lane halves. active lanes are tracked in mask registers (__mmask16 /
+// __mmask8) rather than with branches. nodes and leaves live in flat vectors and refer to
+// each other by index.
+//
+// on cpus without AVX-512 the same tree is walked with plain loops (boxes) and the
+// dispatched hit_spheres kernel (leaves), so the structure is always usable.
+class WideBVH : public Hittable {
+public:
+	static constexpr int kWidth = 16;
+
+	explicit WideBVH(const HittableList& list) {
+		std::vector<Primitive> prims;
+		for (const auto& object : list.objects) {
+			auto sphere = std::dynamic_pointer_cast<Sphere>(object);
+			if (!sphere)
+				throw std::runtime_error("WideBVH only supports spheres.");
+
+			Primitive prim;
+			prim.id = static_cast<int>(centers.size());
+			sphere->bounding_box(prim.box);
+			prim.centroid = sphere->center;
+			prims.push_back(prim);
+
+			centers.push_back(sphere->center);
+			radii.push_back(sphere->radius);
+			materials.push_back(sphere->material);
+			ids.push_back(sphere->id);
+		}
+		if (prims.empty())
+			throw std::runtime_error("WideBVH needs at least one sphere.");
+
+		if (prims.size() <= static_cast<size_t>(kWidth)) {
+			// a single leaf still gets a root node so traversal always starts at nodes[0]
+			nodes.emplace_back();
+			nodes[0].count = 1;
+			set_child(nodes[0], 0, make_leaf(prims, 0, prims.size()), bounds_of(prims, 0, prims.size()));
+		} else {
+			build_node(prims, 0, prims.size());
+		}
+		box = bounds_of(prims, 0, prims.size());
+	}
+
+	bool hit(const Ray& ray, double t_min, double t_max, HitRecord& record) const override {
+		double t;
+		int primitive = find<false>(ray, t_min, t_max, t);
+		return finish_hit(ray, primitive, t, record);
+	}
+
+	// the closest hit as a bare (primitive, distance) pair, no HitRecord and no material.
+	// primitive is the sphere's index in the list the tree was built from, -1 on a miss.
+	int closest_hit(const Ray& ray, double t_min, double t_max, double& t) const {
+		return find<false>(ray, t_min, t_max, t);
+	}
+
+	// true if anything at all lies within [t_min, t_max]. the walk stops at the first hit
+	// instead of looking for the closest one, which is all shadow and line of sight rays need.
+	bool occluded(const Ray& ray, double t_min, double t_max) const {
+		double t;
+		return find<true>(ray, t_min, t_max, t) >= 0;
+	}
+
+	bool occluded(const Ray& ray, double t_min, double t_max, Occluder& occluder) const override {
+		double t;
+		int primitive = find<true>(ray, t_min, t_max, t);
+		if (primitive < 0)
+			return false;
+		occluder.center = centers[primitive];
+		occluder.radius = radii[primitive];
+		return true;
+	}
+
+	// outward unit normal of `primitive` at a point on its surface (not flipped towards the ray)
+	Vec3 outward_normal(int primitive, const Vec3& point) const {
+		return (point - centers[primitive]) / radii[primitive];
+	}
+
+	size_t primitive_count() const { return centers.size(); }
+
+	bool bounding_box(AABB& output_box) const override {
+		output_box = box;
+		return true;
+	}
+
+	// node and leaf arrays plus the packed copy of every primitive
+	size_t memory_bytes() const override {
+		return sizeof(WideBVH) + kSharedControlBytes + nodes.capacity() * sizeof(Node) + leaves.capacity() * sizeof(Leaf)
+			+ centers.capacity() * sizeof(Vec3) + radii.capacity() * sizeof(double)
+			+ materials.capacity() * sizeof(std::shared_ptr<Material>) + ids.capacity() * sizeof(int);
+	}
+
+	void refresh_materials(const std::vector<std::shared_ptr<Material>>& by_id) override {
+		for (size_t i = 0; i < materials.size(); ++i)
+			if (ids[i] >= 0)
+				materials[i] = by_id[ids[i]];
+	}
+
+	// upper bound on how many rays hit_batch keeps in flight per thread
+	static constexpr int kMaxGroup = 32;
+
+	// closest hits for rays[0, count), traced with `group_size` of them in flight at once.
+	//
+	// one ray walking the tree spends most of its time waiting for the next node to arrive
+	// from memory once the scene no longer fits in cache. here every ray is a small hand
+	// rolled state machine (its stack, its closest hit) and the group is visited round robin:
+	// a ray does one step, prefetches the node or leaf it will pop next and yields to the next
+	// ray, so by the time its turn comes back the data is (hopefully) in L1. with 8-16 rays in
+	// flight the cache misses overlap instead of being paid one after another (AMAC).
+	void hit_batch(const Ray* rays, int count, double t_min, double t_max, HitRecord* records, bool* hits, int group_size) const {
+		static thread_local std::vector<int32_t> primitive;
+		static thread_local std::vector<double> t;
+		primitive.resize(count);
+		t.resize(count);
+		find_batch<false>(rays, &t_min, &t_max, 0, count, primitive.data(), t.data(), group_size);
+		for (int i = 0; i < count; ++i)
+			hits[i] = finish_hit(rays[i], primitive[i], t[i], records[i]);
+	}
+
+	// the interleaved walk without HitRecords, for closest_hit / occluded style queries.
+	// ray i is limited to [t_min[i * t_stride], t_max[i * t_stride]] (stride 0 shares one range).
+	// primitive[i] gets the closest primitive (-1 on a miss) and t[i] its distance; with
+	// any_hit the walk stops at the first hit, so primitive[i] >= 0 just means "occluded".
+	void closest_hit_batch(const Ray* rays, const double* t_min, const double* t_max, int t_stride, int count,
+						   int32_t* primitive, double* t, int group_size, bool any_hit = false) const {
+		if (any_hit)
+			find_batch<true>(rays, t_min, t_max, t_stride, count, primitive, t, group_size);
+		else
+			find_batch<false>(rays, t_min, t_max, t_stride, count, primitive, t, group_size);
+	}
+
+	size_t node_count() const { return nodes.size(); }
+	size_t leaf_count() const { return leaves.size(); }
+
+	// the node and leaf layouts, for the memory estimate before a tree is built
+	static constexpr size_t node_bytes() { return sizeof(Node); }
+	static constexpr size_t leaf_bytes() { return sizeof(Leaf); }
+
+	// the up to k primitives whose surface is nearest to `point` (and no further than
+	// max_distance), nearest first. distance is unsigned: a point inside a sphere is
+	// radius - |point - center| away from it. returns how many were found; the rest of
+	// primitive / distance is left untouched.
+	//
+	// branch and bound: children are visited nearest box first, and a child whose box is
+	// further away than the current k-th best is never opened. the box distance is a lower
+	// bound for the distance to anything inside it, so nothing that could win is skipped.
+	int k_nearest(const Vec3& point, int k, double max_distance, int32_t* primitive, double* distance) const {
+		if (k <= 0)
+			return 0;
+		const double p[3] = { point.x, point.y, point.z };
+		int found = 0;
+		// only the k-th best (once there are k) limits the search
+		auto bound = [&]() { return found == k ? distance[k - 1] : max_distance; };
+
+		struct Entry {
+			int32_t child;
+			double distance;
+		};
+		Entry stack[kStackSize];
+		int sp = 0;
+		stack[sp++] = { 0, 0.0 };
+
+		while (sp > 0) {
+			Entry entry = stack[--sp];
+			if (entry.distance > bound())
+				continue;
+
+			if (entry.child < 0) {
+				const Leaf& leaf = leaves[~entry.child];
+				double d[kWidth];
+				leaf_distances(leaf, p, d);
+				for (int i = 0; i < leaf.count; ++i) {
+					if (d[i] > bound())
+						continue;
+					// insertion into the sorted top k, dropping the k-th if full
+					int j = (found < k) ? found++ : k - 1;
+					while (j > 0 && distance[j - 1] > d[i]) {
+						distance[j] = distance[j - 1];
+						primitive[j] = primitive[j - 1];
+						--j;
+					}
+					distance[j] = d[i];
+					primitive[j] = leaf.primitive[i];
+				}
+				continue;
+			}
+
+			const Node& node = nodes[entry.child];
+			double d[kWidth];
+			box_distances(node, p, d);
+			// push the far children first so the nearest one is popped next
+			int order[kWidth];
+			int count = 0;
+			for (int i = 0; i < node.count; ++i) {
+				if (d[i] > bound())
+					continue;
+				int j = count++;
+				while (j > 0 && d[order[j - 1]] < d[i]) {
+					order[j] = order[j - 1];
+					--j;
+				}
+				order[j] = i;
+			}
+			for (int i = 0; i < count; ++i)
+				stack[sp++] = { node.child[order[i]], d[order[i]] };
+		}
+		return found;
+	}
+
+	// the primitive whose surface is nearest to `point`, or -1 if none is within max_distance
+	int nearest(const Vec3& point, double max_distance, double& distance) const {
+		int32_t primitive = -1;
+		return k_nearest(point, 1, max_distance, &primitive, &distance) ? primitive : -1;
+	}
+
+	// the point on `primitive`'s surface nearest to `point`
+	Vec3 closest_surface_point(int primitive, const Vec3& point) const {
+		Vec3 offset = point - centers[primitive];
+		double length = offset.length();
+		// the center itself is equally far from every surface point, any will do
+		Vec3 direction = (length > 0) ? offset / length : Vec3(1, 0, 0);
+		return centers[primitive] + radii[primitive] * direction;
+	}
+
+	// appends every primitive that overlaps (or touches) `query` to out
+	void overlap_box(const AABB& query, std::vector<int32_t>& out) const {
+		const double lo[3] = { query.minimum.x, query.minimum.y, query.minimum.z };
+		const double hi[3] = { query.maximum.x, query.maximum.y, query.maximum.z };
+		collect_overlaps(out,
+			[&](const Node& node, int i) {
+				for (int a = 0; a < 3; ++a) {
+					if (node.bounds[a][i] > hi[a] || node.bounds[a + 3][i] < lo[a])
+						return false;
+				}
+				return true;
+			},
+			[&](const Leaf& leaf, int i) {
+				double d2 = 0;
+				for (int a = 0; a < 3; ++a) {
+					double c = leaf.spheres[a * kWidth + i];
+					double gap = std::max(std::max(lo[a] - c, c - hi[a]), 0.0);
+					d2 += gap * gap;
+				}
+				double r = leaf.spheres[3 * kWidth + i];
+				return d2 <= r * r;
+			});
+	}
+
+	// appends every primitive that overlaps (or touches) the sphere (center, radius) to out
+	void overlap_sphere(const Vec3& center, double radius, std::vector<int32_t>& out) const {
+		const double p[3] = { center.x, center.y, center.z };
+		collect_overlaps(out,
+			[&](const Node& node, int i) {
+				return box_distance_squared(node, i, p) <= radius * radius;
+			},
+			[&](const Leaf& leaf, int i) {
+				double d2 = 0;
+				for (int a = 0; a < 3; ++a) {
+					double gap = leaf.spheres[a * kWidth + i] - p[a];
+					d2 += gap * gap;
+				}
+				double reach = radius + leaf.spheres[3 * kWidth + i];
+				return d2 <= reach * reach;
+			});
+	}
+
+private:
+	struct Primitive {
+		AABB box;
+		Vec3 centroid;
+		int id;
+	};
+
+	// child >= 0 is an index into nodes, child < 0 is ~index into leaves
+	struct alignas(64) Node {
+		float bounds[6][kWidth]; // min x, min y, min z, max x, max y, max z
+		int32_t child[kWidth];
+		int count = 0;
+	};
+
+	struct alignas(64) Leaf {
+		double spheres[4 * kWidth]; // rows: center x | center y | center z | radius
+		int32_t primitive[kWidth];
+		int count = 0;
+	};
+
+	struct StackEntry {
+		int32_t child;
+		float t_near;
+	};
+	// every level pushes at most kWidth - 1 entries more than it pops and the median
+	// build keeps the tree shallow (16^6 spheres is ~16M), so this never overflows in practice
+	static constexpr int kStackSize = 16 * kWidth;
+
+	std::vector<Node> nodes;
+	std::vector<Leaf> leaves;
+	std::vector<Vec3> centers;
+	std::vector<double> radii;
+	std::vector<std::shared_ptr<Material>> materials;
+	std::vector<int> ids;
+	AABB box;
+
+	static double axis_value(const Vec3& v, int axis) {
+		return (axis == 0) ? v.x : (axis == 1) ? v.y : v.z;
+	}
+
+	static AABB bounds_of(const std::vector<Primitive>& prims, size_t start, size_t end) {
+		AABB result = prims[start].box;
+		for (size_t i = start + 1; i < end; ++i)
+			result = AABB::surrounding_box(result, prims[i].box);
+		return result;
+	}
+
+	// float boxes are rounded outwards so the float slab test never misses what the
+	// double one would have hit
+	static void set_child(Node& node, int slot, int32_t child, const AABB& child_box) {
+		for (int a = 0; a < 3; ++a) {
+			node.bounds[a][slot] = std::nextafter(static_cast<float>(axis_value(child_box.minimum, a)), -INFINITY);
+			node.bounds[a + 3][slot] = std::nextafter(static_cast<float>(axis_value(child_box.maximum, a)), INFINITY);
+		}
+		node.child[slot] = child;
+	}
+
+	int32_t make_leaf(const std::vector<Primitive>& prims, size_t start, size_t end) {
+		Leaf leaf;
+		leaf.count = static_cast<int>(end - start);
+		// lanes follow list order rather than whatever order the median splits left behind,
+		// so a compiled scene (scene_compile.h) keeps its material grouping inside the leaf
+		int32_t leaf_ids[kWidth];
+		for (int i = 0; i < leaf.count; ++i)
+			leaf_ids[i] = prims[start + i].id;
+		std::sort(leaf_ids, leaf_ids + leaf.count);
+		for (int i = 0; i < leaf.count; ++i) {
+			int id = leaf_ids[i];
+			leaf.spheres[i] = centers[id].x;
+			leaf.spheres[kWidth + i] = centers[id].y;
+			leaf.spheres[2 * kWidth + i] = centers[id].z;
+			leaf.spheres[3 * kWidth + i] = radii[id];
+			leaf.primitive[i] = id;
+		}
+		leaves.push_back(leaf);
+		return ~static_cast<int32_t>(leaves.size() - 1);
+	}
+
+	// splits [start, end) into up to 16 clusters by repeatedly halving the biggest one at
+	// the median of its longest centroid axis, then turns every cluster into a leaf (if it
+	// fits) or a child node.
+	int32_t build_node(std::vector<Primitive>& prims, size_t start, size_t end) {
+		std::vector<std::pair<size_t, size_t>> clusters{ {start, end} };
+		while (clusters.size() < static_cast<size_t>(kWidth)) {
+			size_t biggest = 0;
+			for (size_t c = 1; c < clusters.size(); ++c) {
+				if (clusters[c].second - clusters[c].first > clusters[biggest].second - clusters[biggest].first)
+					biggest = c;
+			}
+			size_t lo = clusters[biggest].first;
+			size_t hi = clusters[biggest].second;
+			if (hi - lo <= static_cast<size_t>(kWidth))
+				break;
+
+			Vec3 cmin = prims[lo].centroid;
+			Vec3 cmax = prims[lo].centroid;
+			for (size_t i = lo + 1; i < hi; ++i) {
+				const Vec3& c = prims[i].centroid;
+				cmin = Vec3(std::min(cmin.x, c.x), std::min(cmin.y, c.y), std::min(cmin.z, c.z));
+				cmax = Vec3(std::max(cmax.x, c.x), std::max(cmax.y, c.y), std::max(cmax.z, c.z));
+			}
+			Vec3 extent = cmax - cmin;
+			int axis = (extent.x > extent.y && extent.x > extent.z) ? 0 : (extent.y > extent.z) ? 1 : 2;
+
+			size_t mid = lo + (hi - lo) / 2;
+			std::nth_element(prims.begin() + lo, prims.begin() + mid, prims.begin() + hi,
+				[axis](const Primitive& a, const Primitive& b) {
+					return axis_value(a.centroid, axis) < axis_value(b.centroid, axis);
+				});
+			clusters[biggest] = { lo, mid };
+			clusters.push_back({ mid, hi });
+		}
+
+		int32_t index = static_cast<int32_t>(nodes.size());
+		nodes.emplace_back();
+		nodes[index].count = static_cast<int>(clusters.size());
+
+		for (size_t c = 0; c < clusters.size(); ++c) {
+			size_t lo = clusters[c].first;
+			size_t hi = clusters[c].second;
+			int32_t child = (hi - lo <= static_cast<size_t>(kWidth)) ? make_leaf(prims, lo, hi)
+																	 : build_node(prims, lo, hi);
+			// nodes may have grown (and moved) while building the child
+			set_child(nodes[index], static_cast<int>(c), child, bounds_of(prims, lo, hi));
+		}
+		return index;
+	}
+
+	// squared distance from p to child i's box, 0 if p is inside it. the float boxes are
+	// rounded outwards, so this never overestimates the distance to the real box.
+	static double box_distance_squared(const Node& node, int i, const double* p) {
+		double d2 = 0;
+		for (int a = 0; a < 3; ++a) {
+			double gap = std::max(std::max(double(node.bounds[a][i]) - p[a], p[a] - double(node.bounds[a + 3][i])), 0.0);
+			d2 += gap * gap;
+		}
+		return d2;
+	}
+
+	static void box_distances(const Node& node, const double* p, double* d) {
+		#pragma omp simd
+		for (int i = 0; i < kWidth; ++i)
+			d[i] = std::sqrt(box_distance_squared(node, i, p));
+	}
+
+	// unsigned distance from p to every sphere surface in the leaf
+	static void leaf_distances(const Leaf& leaf, const double* p, double* d) {
+		#pragma omp simd
+		for (int i = 0; i < kWidth; ++i) {
+			double dx = p[0] - leaf.spheres[i];
+			double dy = p[1] - leaf.spheres[kWidth + i];
+			double dz = p[2] - leaf.spheres[2 * kWidth + i];
+			d[i] = std::abs(std::sqrt(dx * dx + dy * dy + dz * dz) - leaf.spheres[3 * kWidth + i]);
+		}
+	}
+
+	// plain depth first walk for the overlap queries: every child whose box passes
+	// enter(node, slot) is opened, every primitive passing keep(leaf, lane) is collected
+	template <class EnterFn, class KeepFn>
+	void collect_overlaps(std::vector<int32_t>& out, EnterFn enter, KeepFn keep) const {
+		int32_t stack[kStackSize];
+		int sp = 0;
+		stack[sp++] = 0;
+		while (sp > 0) {
+			int32_t child = stack[--sp];
+			if (child < 0) {
+				const Leaf& leaf = leaves[~child];
+				for (int i = 0; i < leaf.count; ++i) {
+					if (keep(leaf, i))
+						out.push_back(leaf.primitive[i]);
+				}
+				continue;
+			}
+			const Node& node = nodes[child];
+			for (int i = 0; i < node.count; ++i) {
+				if (enter(node, i))
+					stack[sp++] = node.child[i];
+			}
+		}
+	}
+
+	// everything about a ray the traversal needs, converted once up front
+	struct RayData {
+		double origin[3];
+		double direction[3];
+		double a; // |direction|^2, shared by every sphere test
+		double t_min;
+		float o[3];
+		float inv[3];
+
+		RayData() {}
+		RayData(const Ray& ray, double t_min) : t_min(t_min) {
+			origin[0] = ray.origin.x; origin[1] = ray.origin.y; origin[2] = ray.origin.z;
+			direction[0] = ray.direction.x; direction[1] = ray.direction.y; direction[2] = ray.direction.z;
+			a = ray.direction.length_squared();
+			for (int i = 0; i < 3; ++i) {
+				o[i] = float(origin[i]);
+				inv[i] = float(1.0 / direction[i]);
+			}
+		}
+	};
+
+	// the two ways of testing a node's 16 boxes and a leaf's 16 spheres. the traversal loops
+	// below are templates over these, instantiated once inside a target("avx512f") wrapper
+	// and once for the baseline. the ops are deliberately not always_inline: gcc only
+	// inlines the AVX-512 ones after the loop itself has landed in the AVX-512 wrapper.
+	//
+	// enter() writes the children the ray enters (and their entry distances) and returns
+	// how many there are; hit_leaf() returns the closest primitive nearer than `closest`
+	// (updating it) or -1.
+	struct PortableOps {
+		static inline int enter(const Node& node, const RayData& ray, double closest, int32_t* children, float* t_near) {
+			const float hi_limit = float(closest) * 1.0001f;
+			int hits = 0;
+			for (int i = 0; i < node.count; ++i) {
+				float lo = float(ray.t_min);
+				float hi = hi_limit;
+				for (int a = 0; a < 3; ++a) {
+					float t0 = (node.bounds[a][i] - ray.o[a]) * ray.inv[a];
+					float t1 = (node.bounds[a + 3][i] - ray.o[a]) * ray.inv[a];
+					lo = std::max(lo, std::min(t0, t1));
+					hi = std::min(hi, std::max(t0, t1));
+				}
+				if (lo <= hi) {
+					children[hits] = node.child[i];
+					t_near[hits] = lo;
+					++hits;
+				}
+			}
+			return hits;
+		}
+
+		static inline int hit_leaf(const Leaf& leaf, const RayData& ray, double& closest) {
+			double t;
+			int lane = kernels().hit_spheres(leaf.spheres, kWidth, leaf.count, ray.origin, ray.direction, ray.t_min, closest, &t);
+			if (lane < 0)
+				return -1;
+			closest = t;
+			return leaf.primitive[lane];
+		}
+	};
+
+#if defined(__x86_64__) || defined(__i386__)
+	struct Avx512Ops {
+		__attribute__((target("avx512f,avx512dq,avx512vl,avx2,fma")))
+		static inline int enter(const Node& node, const RayData& ray, double closest, int32_t* children, float* t_near_out) {
+			const __m512 lo_limit = _mm512_set1_ps(float(ray.t_min));
+			const __m512 hi_limit = _mm512_set1_ps(float(closest) * 1.0001f);
+
+			const __m512 ox = _mm512_set1_ps(ray.o[0]);
+			const __m512 ix = _mm512_set1_ps(ray.inv[0]);
+			__m512 t0 = _mm512_mul_ps(_mm512_sub_ps(_mm512_load_ps(node.bounds[0]), ox), ix);
+			__m512 t1 = _mm512_mul_ps(_mm512_sub_ps(_mm512_load_ps(node.bounds[3]), ox), ix);
+			__m512 t_near = _mm512_max_ps(lo_limit, _mm512_min_ps(t0, t1));
+			__m512 t_far = _mm512_min_ps(hi_limit, _mm512_max_ps(t0, t1));
+
+			const __m512 oy = _mm512_set1_ps(ray.o[1]);
+			const __m512 iy = _mm512_set1_ps(ray.inv[1]);
+			t0 = _mm512_mul_ps(_mm512_sub_ps(_mm512_load_ps(node.bounds[1]), oy), iy);
+			t1 = _mm512_mul_ps(_mm512_sub_ps(_mm512_load_ps(node.bounds[4]), oy), iy);
+			t_near = _mm512_max_ps(t_near, _mm512_min_ps(t0, t1));
+			t_far = _mm512_min_ps(t_far, _mm512_max_ps(t0, t1));
+
+			const __m512 oz = _mm512_set1_ps(ray.o[2]);
+			const __m512 iz = _mm512_set1_ps(ray.inv[2]);
+			t0 = _mm512_mul_ps(_mm512_sub_ps(_mm512_load_ps(node.bounds[2]), oz), iz);
+			t1 = _mm512_mul_ps(_mm512_sub_ps(_mm512_load_ps(node.bounds[5]), oz), iz);
+			t_near = _mm512_max_ps(t_near, _mm512_min_ps(t0, t1));
+			t_far = _mm512_min_ps(t_far, _mm512_max_ps(t0, t1));
+
+			const __mmask16 active = static_cast<__mmask16>((1u << node.count) - 1);
+			__mmask16 entered = _mm512_mask_cmp_ps_mask(active, t_near, t_far, _CMP_LE_OQ);
+			_mm512_mask_compressstoreu_epi32(children, entered, _mm512_load_si512(node.child));
+			_mm512_mask_compressstoreu_ps(t_near_out, entered, t_near);
+			return __builtin_popcount(entered);
+		}
+
+		__attribute__((target("avx512f,avx512dq,avx512vl,avx2,fma")))
+		static inline int hit_leaf(const Leaf& leaf, const RayData& ray, double& closest) {
+			const __m512d ox = _mm512_set1_pd(ray.origin[0]);
+			const __m512d oy = _mm512_set1_pd(ray.origin[1]);
+			const __m512d oz = _mm512_set1_pd(ray.origin[2]);
+			const __m512d dx = _mm512_set1_pd(ray.direction[0]);
+			const __m512d dy = _mm512_set1_pd(ray.direction[1]);
+			const __m512d dz = _mm512_set1_pd(ray.direction[2]);
+			const __m512d a = _mm512_set1_pd(ray.a);
+			const __m512d tmin = _mm512_set1_pd(ray.t_min);
+			const __m512d zero = _mm512_setzero_pd();
+
+			int primitive = -1;
+			for (int half = 0; half * 8 < leaf.count; ++half) {
+				const int base = half * 8;
+				const __mmask8 lanes = static_cast<__mmask8>(leaf.count - base >= 8 ? 0xFF : (1u << (leaf.count - base)) - 1);
+				// re-read every half: a hit in the first half shrinks the range for the second
+				const __m512d tmax = _mm512_set1_pd(closest);
+
+				__m512d ocx = _mm512_sub_pd(ox, _mm512_load_pd(leaf.spheres + base));
+				__m512d ocy = _mm512_sub_pd(oy, _mm512_load_pd(leaf.spheres + kWidth + base));
+				__m512d ocz = _mm512_sub_pd(oz, _mm512_load_pd(leaf.spheres + 2 * kWidth + base));
+				__m512d r = _mm512_load_pd(leaf.spheres + 3 * kWidth + base);
+
+				__m512d half_b = _mm512_fmadd_pd(ocx, dx, _mm512_fmadd_pd(ocy, dy, _mm512_mul_pd(ocz, dz)));
+				__m512d c = _mm512_fmadd_pd(ocx, ocx, _mm512_fmadd_pd(ocy, ocy, _mm512_fmsub_pd(ocz, ocz, _mm512_mul_pd(r, r))));
+				__m512d discriminant = _mm512_fmsub_pd(half_b, half_b, _mm512_mul_pd(a, c));
+				__mmask8 valid = _mm512_mask_cmp_pd_mask(lanes, discriminant, zero, _CMP_GE_OQ);
+				if (!valid)
+					continue;
+
+				__m512d sqrtd = _mm512_sqrt_pd(_mm512_max_pd(discriminant, zero));
+				__m512d near_root = _mm512_div_pd(_mm512_sub_pd(_mm512_sub_pd(zero, half_b), sqrtd), a);
+				__m512d far_root = _mm512_div_pd(_mm512_sub_pd(sqrtd, half_b), a);
+				__mmask8 near_ok = _mm512_cmp_pd_mask(near_root, tmin, _CMP_GE_OQ)
+					& _mm512_cmp_pd_mask(near_root, tmax, _CMP_LE_OQ);
+				__m512d root = _mm512_mask_blend_pd(near_ok, far_root, near_root);
+				valid &= _mm512_cmp_pd_mask(root, tmin, _CMP_GE_OQ) & _mm512_cmp_pd_mask(root, tmax, _CMP_LE_OQ);
+				if (!valid)
+					continue;
+
+				double t = _mm512_mask_reduce_min_pd(valid, root);
+				__mmask8 winner = valid & _mm512_cmp_pd_mask(root, _mm512_set1_pd(t), _CMP_EQ_OQ);
+				closest = t;
+				primitive = leaf.primitive[base + __builtin_ctz(winner)];
+			}
+			return primitive;
+		}
+	};
+#endif
+
+	// pushes the entered children so that the nearest one is popped first
+	static inline void push_sorted(StackEntry* stack, int& sp, const int32_t* children, const float* t_near, int count) {
+		StackEntry sorted[kWidth];
+		for (int i = 0; i < count; ++i) {
+			int j = i;
+			while (j > 0 && sorted[j - 1].t_near < t_near[i]) {
+				sorted[j] = sorted[j - 1];
+				--j;
+			}
+			sorted[j] = { children[i], t_near[i] };
+		}
+		for (int i = 0; i < count; ++i)
+			stack[sp++] = sorted[i];
+	}
+
+	bool finish_hit(const Ray& ray, int primitive, double t, HitRecord& record) const {
+		if (primitive < 0)
+			return false;
+		record.t = t;
+		record.point = ray.at(t);
+		record.set_face_normal(ray, (record.point - centers[primitive]) / radii[primitive]);
+		record.material = materials[primitive];
+		record.primitive = ids[primitive];
+		return true;
+	}
+
+	// pops one stack entry and tests it. shared by the one-ray-at-a-time walk and the
+	// interleaved one, which is why the whole traversal state is passed in.
+	// with kAnyHit the first primitive hit empties the stack, ending the walk.
+	template <class Ops, bool kAnyHit>
+	RAYFLOAT_ALWAYS_INLINE void step(const RayData& ray, StackEntry* stack, int& sp, double& closest, int& closest_prim) const {
+		StackEntry entry = stack[--sp];
+		if (entry.t_near > closest)
+			return;
+
+		if (entry.child < 0) {
+			int primitive = Ops::hit_leaf(leaves[~entry.child], ray, closest);
+			if (primitive >= 0) {
+				closest_prim = primitive;
+				if (kAnyHit)
+					sp = 0;
+			}
+			return;
+		}
+
+		int32_t children[kWidth];
+		float t_near[kWidth];
+		int count = Ops::enter(nodes[entry.child], ray, closest, children, t_near);
+		push_sorted(stack, sp, children, t_near, count);
+	}
+
+	template <class Ops, bool kAnyHit>
+	RAYFLOAT_ALWAYS_INLINE int traverse(const Ray& ray, double t_min, double t_max, double& t) const {
+		RayData data(ray, t_min);
+		double closest = t_max;
+		int closest_prim = -1;
+		StackEntry stack[kStackSize];
+		int sp = 0;
+		stack[sp++] = { 0, float(t_min) };
+
+		int steps = 0;
+		while (sp > 0) {
+			step<Ops, kAnyHit>(data, stack, sp, closest, closest_prim);
+			++steps;
+		}
+		if (kAnyHit)
+			occlusion_visits() += steps;
+		t = closest;
+		return closest_prim;
+	}
+
+	// one ray's traversal, suspended between steps
+	struct Lane {
+		int index; // into the batch, -1 once the batch has run dry
+		RayData data;
+		StackEntry stack[kStackSize];
+		int sp;
+		double closest;
+		int closest_prim;
+	};
+
+	void prefetch(int32_t child) const {
+		const char* address = child < 0 ? reinterpret_cast<const char*>(&leaves[~child])
+										: reinterpret_cast<const char*>(&nodes[child]);
+		size_t size = child < 0 ? sizeof(Leaf) : sizeof(Node);
+		for (size_t offset = 0; offset < size; offset += 64)
+			__builtin_prefetch(address + offset);
+	}
+
+	template <class Ops, bool kAnyHit>
+	RAYFLOAT_ALWAYS_INLINE void interleave(const Ray* rays, const double* t_min, const double* t_max, int t_stride,
+										   int count, int32_t* primitive, double* t, int group_size) const {
+		// the lanes are a few KB each, so keep them off the stack and reuse them across calls
+		static thread_local std::vector<Lane> lanes;
+		lanes.resize(group_size);
+
+		int next = 0;
+		int active = 0;
+		auto start = [&](Lane& lane) {
+			if (next >= count) {
+				lane.index = -1;
+				return;
+			}
+			lane.index = next++;
+			const double lo = t_min[lane.index * t_stride];
+			lane.data = RayData(rays[lane.index], lo);
+			lane.closest = t_max[lane.index * t_stride];
+			lane.closest_prim = -1;
+			lane.sp = 0;
+			lane.stack[lane.sp++] = { 0, float(lo) };
+			++active;
+		};
+		for (Lane& lane : lanes)
+			start(lane);
+
+		while (active > 0) {
+			for (Lane& lane : lanes) {
+				if (lane.index < 0)
+					continue;
+
+				step<Ops, kAnyHit>(lane.data, lane.stack, lane.sp, lane.closest, lane.closest_prim);
+
+				if (lane.sp == 0) {
+					primitive[lane.index] = lane.closest_prim;
+					t[lane.index] = lane.closest;
+					--active;
+					start(lane);
+				} else {
+					prefetch(lane.stack[lane.sp - 1].child);
+				}
+			}
+		}
+	}
+
+	// picks the AVX-512 or the portable instantiation of the walks above
+	template <bool kAnyHit>
+	int find(const Ray& ray, double t_min, double t_max, double& t) const {
+#if defined(__x86_64__) || defined(__i386__)
+		if (kernels().isa == IsaLevel::AVX512)
+			return find_avx512<kAnyHit>(ray, t_min, t_max, t);
+#endif
+		return traverse<PortableOps, kAnyHit>(ray, t_min, t_max, t);
+	}
+
+	template <bool kAnyHit>
+	void find_batch(const Ray* rays, const double* t_min, const double* t_max, int t_stride, int count,
+					int32_t* primitive, double* t, int group_size) const {
+		group_size = std::max(1, std::min(group_size, kMaxGroup));
+#if defined(__x86_64__) || defined(__i386__)
+		if (kernels().isa == IsaLevel::AVX512) {
+			find_batch_avx512<kAnyHit>(rays, t_min, t_max, t_stride, count, primitive, t, group_size);
+			return;
+		}
+#endif
+		interleave<PortableOps, kAnyHit>(rays, t_min, t_max, t_stride, count, primitive, t, group_size);
+	}
+
+#if defined(__x86_64__) || defined(__i386__)
+	template <bool kAnyHit>
+	__attribute__((target("avx512f,avx512dq,avx512vl,avx2,fma")))
+	int find_avx512(const Ray& ray, double t_min, double t_max, double& t) const {
+		return traverse<Avx512Ops, kAnyHit>(ray, t_min, t_max, t);
+	}
+
+	template <bool kAnyHit>
+	__attribute__((target("avx512f,avx512dq,avx512vl,avx2,fma")))
+	void find_batch_avx512(const Ray* rays, const double* t_min, const double* t_max, int t_stride, int count,
+						   int32_t* primitive, double* t, int group_size) const {
+		interleave<Avx512Ops, kAnyHit>(rays, t_min, t_max, t_stride, count, primitive, t, group_size);
+	}
+#endif
+};
+
+#endif
@@ -3,46 +3,49 @@
 #include "sphere.h"
 #include "hittable_list.h"
 #include "bvh.h"
+#include "wide_bvh.h"
 #include "camera.h"
 #include "material.h"
+#include "kernels.h"
+#include "options.h"
+#include "ray_query.h"
+#include "proximity_query.h"
+#include "scene_compile.h"
+#include "upscale.h"
+#include "sample_budget.h"
+#include "roulette.h"
+#include "bdpt.h"
+#include "mlt.h"
+#include "governor.h"
+#include "progress.h"
+#include "memory_budget.h"
+#include "render_cache.h"
+#include "spool.h"
+#include "sweep.h"
+#include "scheduler.h"
+#include "daemon.h"
+#include "metrics.h"
 
 #include <iostream>
+#include <numeric>
+#include <array>
+#include <sstream>
 #include <algorithm>
 #include <fstream>
 #include <chrono>
+#include <atomic>
 #include <omp.h>
 
 
-void write_color(std::ostream& out, const Color& pixel_color, int samples_per_pixel) {
-	double r = pixel_color.x;
-	double g = pixel_color.y;
-	double b = pixel_color.z;
-	
-	double scale = 1.0 / samples_per_pixel;
-	r *= scale;
-	g *= scale;
-	b *= scale;
-	
-	r = std::sqrt(r);
-	g = std::sqrt(g);
-	b = std::sqrt(b);
-	
-	int ir = static_cast<int>(256 * std::clamp(r, 0.0, 0.999));
-	int ig = static_cast<int>(256 * std::clamp(g, 0.0, 0.999));
-	int ib = static_cast<int>(256 * std::clamp(b, 0.0, 0.999));
-	
-	out << ir << ' ' << ig << ' ' << ib << '\n';
-}
-
-Camera build_camera(double aspect_ratio) {
+Camera build_camera(double aspect_ratio, const Options& options) {
     // Vec3 lookfrom(1, 5.0, 1.0);
     // Vec3 lookat(0, 0.1, -2.5);
     // Vec3 vup(0, 1, 0);
     // double vfov = 30.0;
-	Vec3 lookfrom(0, 0, 0);
-    Vec3 lookat(0, 0, -1);
+	Vec3 lookfrom(options.lookfrom[0], options.lookfrom[1], options.lookfrom[2]);
+	Vec3 lookat(options.lookat[0], options.lookat[1], options.lookat[2]);
     Vec3 vup(0, 1, 0);
-    double vfov = 90.0;
+    double vfov = options.vfov;
     return Camera(lookfrom, lookat, vup, vfov, aspect_ratio);
 }
 
@@ -96,79 +99,1516 @@ HittableList build_scene() {
     return world;
 }
 
-inline Color render_pixel(int i, int j, int image_width, int image_height, int samples_per_pixel, const Camera& camera, const Hittable& world, int max_depth) {
+// the N x N x N sphere grid from the blog's scaling experiments (N = 40 is 64,000 spheres).
+// the grid always spans the same unit cube in front of the camera, the spheres just get smaller.
+HittableList build_grid_scene(int grid_size) {
+	HittableList world;
+	auto material_ground = std::make_shared<Lambertian>(Color(0.1, 0.1, 0.1));
+	auto material_glass = std::make_shared<Dielectric>(1.5);
+	auto material_gold = std::make_shared<Metal>(Color(0.8, 0.6, 0.2), 0.05);
+	auto material_red = std::make_shared<Lambertian>(Color(0.9, 0.1, 0.1));
+	auto material_emission = std::make_shared<DiffuseLight>(Color(4.0, 4.0, 2.0), 1.3);
+
+	world.add(std::make_shared<Sphere>(Vec3(0.0, -100.5, -1.0), 100.0, material_ground));
+
+	const double spacing = 1.0 / grid_size;
+	const double sphere_radius = 0.38 * spacing;
+	const Vec3 center_offset(-0.5, -0.3, -2.5);
+
+	// random_double()'s xorshift with the main thread's seed, but a state of its own: the same
+	// grid as before, and the same grid every time (the daemon builds more than one)
+	uint32_t state = 123456789;
+	auto random_choice = [&state]() {
+		state ^= state << 13;
+		state ^= state >> 17;
+		state ^= state << 5;
+		return state / 4294967296.0;
+	};
+
+	for (int i = 0; i < grid_size; i++) {
+		for (int j = 0; j < grid_size; j++) {
+			for (int k = 0; k < grid_size; k++) {
+				Vec3 pos = center_offset + Vec3(i * spacing, j * spacing, k * spacing);
+
+				std::shared_ptr<Material> mat;
+				double choose = random_choice();
+				if (choose < 0.2) mat = material_gold;
+				else if (choose < 0.5) mat = material_red;
+				else if (choose < 0.55) mat = material_emission;
+				else mat = material_glass;
+
+				world.add(std::make_shared<Sphere>(pos, sphere_radius, mat));
+			}
+		}
+	}
+	return world;
+}
+
+inline Color render_pixel(int i, int j, int image_width, int image_height, int samples_per_pixel, const Camera& camera, const Hittable& world, int max_depth, const LightSet* lights, long long& rays_traced) {
 	Color pixel_color(0,0,0);
 
+	// all of this pixel's jitter offsets in one vectorized batch
+	static thread_local std::vector<double> jitter;
+	jitter.resize(2 * samples_per_pixel);
+	fill_random_doubles(jitter.data(), static_cast<int>(jitter.size()));
+
 	for (int s = 0; s < samples_per_pixel; ++s) {
-		double u = (i + random_double()) / (image_width - 1);
-		double v = (j + random_double()) / (image_height - 1);
+		double u = (i + jitter[2 * s]) / (image_width - 1);
+		double v = (j + jitter[2 * s + 1]) / (image_height - 1);
 		Ray ray = camera.get_ray(u, v);
-		pixel_color += ray_color(ray, world, max_depth);
+		pixel_color += ray_color(ray, world, max_depth, rays_traced, lights);
 	}
 	return pixel_color;
 }
 
-void render_image(std::vector<Color>& framebuffer, int image_width, int image_height, int samples_per_pixel, const Camera& camera, const Hittable& world, int max_depth) {
-	#pragma omp parallel for schedule(dynamic)
-	for (int j = 0; j < image_height; ++j) {
-		for (int i = 0; i < image_width; ++i) {
-			Color c = render_pixel(
-				i, j,
-				image_width, image_height,
-				samples_per_pixel,
-				camera, world, max_depth
-			);
+// same result as render_pixel, but the pixel's samples are traced side by side instead of
+// one path after the other: every bounce, all paths still alive hand their rays to
+// WideBVH::hit_batch, which keeps group_size of them in flight to overlap their cache misses.
+// the shading below is ray_color's loop body, applied to each path in turn.
+inline Color render_pixel_interleaved(int i, int j, int image_width, int image_height, int samples_per_pixel, const Camera& camera, const WideBVH& world, int max_depth, const LightSet* lights, int group_size, long long& rays_traced) {
+	struct Path {
+		Color attenuation;
+		Color emitted;
+		bool skip_emission;
+	};
+
+	static thread_local std::vector<double> jitter;
+	static thread_local std::vector<Ray> rays;
+	static thread_local std::vector<Path> paths;
+	static thread_local std::vector<HitRecord> records;
+	static thread_local std::vector<char> hits;
+	jitter.resize(2 * samples_per_pixel);
+	rays.resize(samples_per_pixel);
+	paths.resize(samples_per_pixel);
+	records.resize(samples_per_pixel);
+	hits.resize(samples_per_pixel);
+	fill_random_doubles(jitter.data(), static_cast<int>(jitter.size()));
+
+	for (int s = 0; s < samples_per_pixel; ++s) {
+		double u = (i + jitter[2 * s]) / (image_width - 1);
+		double v = (j + jitter[2 * s + 1]) / (image_height - 1);
+		rays[s] = camera.get_ray(u, v);
+		paths[s] = { Color(1.0, 1.0, 1.0), Color(0.0, 0.0, 0.0), false };
+	}
 
-			int flipped_j = image_height - 1 - j;
-			framebuffer[flipped_j * image_width + i] = c;
+	Color pixel_color(0,0,0);
+	int alive = samples_per_pixel;
+	for (int bounce = 0; bounce < max_depth && alive > 0; ++bounce) {
+		world.hit_batch(rays.data(), alive, 0.001, INFINITY, records.data(), reinterpret_cast<bool*>(hits.data()), group_size);
+		rays_traced += alive;
+
+		// paths that terminate are accumulated; the rest are compacted to the front
+		int kept = 0;
+		for (int p = 0; p < alive; ++p) {
+			Path path = paths[p];
+			if (!hits[p]) {
+				pixel_color += path.emitted + path.attenuation * sky_color(rays[p]);
+				continue;
+			}
+
+			const HitRecord& record = records[p];
+			if (FootprintRecorder* recorder = footprint_recorder())
+				recorder->touch(record.primitive);
+			if (!path.skip_emission)
+				path.emitted += path.attenuation * record.material->emitted();
+
+			Ray scattered;
+			Color attenuation;
+			if (!record.material->scatter(rays[p], record, attenuation, scattered)) {
+				pixel_color += path.emitted;
+				continue;
+			}
+			path.skip_emission = lights && record.material->is_diffuse();
+			if (path.skip_emission)
+				path.emitted += path.attenuation * attenuation * lights->sample(world, record, rays_traced);
+			path.attenuation = path.attenuation * attenuation;
+			rays[kept] = scattered;
+			paths[kept] = path;
+			++kept;
 		}
+		alive = kept;
 	}
+	// like ray_color, paths still bouncing after max_depth contribute nothing
+	return pixel_color;
+}
+
+struct RenderStats {
+	long long rays_traced = 0;
+	// seconds from the start of render_image until the first pixel was finished
+	double first_pixel_seconds = 0;
+};
+
+// the optional parts of a plain render, all off (null) by default
+struct RenderHooks {
+	// per pixel sample counts (sample_budget.h) instead of samples_per_pixel. those pixels are
+	// scaled so write_image's division by samples_per_pixel still gives their average
+	const std::vector<int>* pixel_samples = nullptr;
+	// gets to pace every worker between rows
+	RenderGovernor* governor = nullptr;
+	// hears about every finished row
+	ProgressReporter* progress = nullptr;
+	// rendered instead of the crop, and footprints (one per tile) of what their paths touched
+	const std::vector<Crop>* tiles = nullptr;
+	FootprintSet* footprints = nullptr;
+};
+
+// renders the crop window (already clamped to the image) into framebuffer.
+// interleave > 0 traces with render_pixel_interleaved (world must then be a WideBVH).
+// lights (may be null) turns on direct light sampling at diffuse hits, hooks (RenderHooks)
+// add what the run asks for beyond that. the live metrics, when they are exported, hear about
+// every row and tile
+RenderStats render_image(std::vector<Color>& framebuffer, int image_width, int image_height, int samples_per_pixel, const Camera& camera, const Hittable& world, int max_depth, const LightSet* lights, int interleave, const Crop& crop, const RenderHooks& hooks = RenderHooks()) {
+	const WideBVH* wide = dynamic_cast<const WideBVH*>(&world);
+	if (interleave > 0 && !wide)
+		throw std::runtime_error("Interleaved traversal needs --accel=wide.");
+
+	auto start = std::chrono::high_resolution_clock::now();
+	std::atomic<bool> first_pixel_done{false};
+	RenderStats stats;
+
+	// the work as rows of pixels: the crop's rows, or every row of every tile
+	struct Span {
+		int y, x0, x1, tile;
+	};
+	std::vector<Span> spans;
+	const std::vector<Crop> rects = hooks.tiles ? *hooks.tiles : std::vector<Crop>{ crop };
+	for (size_t t = 0; t < rects.size(); ++t)
+		for (int y = rects[t].y0; y < rects[t].y1; ++y)
+			spans.push_back({ y, rects[t].x0, rects[t].x1, static_cast<int>(t) });
+
+	// with a progress reporter the rows are taken in a scattered order (a stride coprime to the
+	// row count, near the golden ratio), so the rows done at any moment are a fair sample of
+	// the image and their cost predicts the rest. top down, the cheap sky rows come first
+	const int rows = static_cast<int>(spans.size());
+	int stride = 1;
+	if (hooks.progress && rows > 2) {
+		stride = std::max(1, static_cast<int>(rows * 0.6180339887));
+		while (std::gcd(stride, rows) != 1)
+			++stride;
+	}
+
+	// with metrics, the rows each tile has left, so the last of them counts the tile
+	LiveMetrics* metrics = live_metrics();
+	std::unique_ptr<std::atomic<int>[]> tile_rows_left;
+	if (metrics) {
+		metrics->rows_planned(rows);
+		if (hooks.tiles) {
+			tile_rows_left = std::make_unique<std::atomic<int>[]>(rects.size());
+			for (size_t t = 0; t < rects.size(); ++t)
+				tile_rows_left[t] = rects[t].y1 - rects[t].y0;
+		}
+	}
+
+	long long rays_traced = 0;
+	#pragma omp parallel reduction(+:rays_traced)
+	{
+	// a row's touches go to a footprint of this thread's own, merged into its tile's after the row
+	TileFootprint row_footprint;
+	FootprintRecorder recorder;
+	if (hooks.footprints) {
+		recorder.primitive_keys = &hooks.footprints->primitive_keys;
+		recorder.tile = &row_footprint;
+		footprint_recorder() = &recorder;
+	}
+	#pragma omp for schedule(dynamic) nowait
+	for (int row = 0; row < rows; ++row) {
+		const Span& span = spans[static_cast<long long>(row) * stride % rows];
+		const int y = span.y;
+		// rows are rendered bottom up (v grows upwards), the framebuffer is stored top down
+		int j = image_height - 1 - y;
+		const long long rays_before_row = rays_traced;
+		const bool timed = hooks.progress || metrics;
+		const auto row_start = timed ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+		for (int i = span.x0; i < span.x1; ++i) {
+			const int samples = hooks.pixel_samples ? (*hooks.pixel_samples)[y * image_width + i] : samples_per_pixel;
+			Color c = (interleave > 0)
+				? render_pixel_interleaved(
+					i, j,
+					image_width, image_height,
+					samples,
+					camera, *wide, max_depth, lights, interleave, rays_traced
+				)
+				: render_pixel(
+					i, j,
+					image_width, image_height,
+					samples,
+					camera, world, max_depth, lights, rays_traced
+				);
+
+			framebuffer[y * image_width + i] = (samples == samples_per_pixel) ? c : c * (double(samples_per_pixel) / samples);
+
+			if (!first_pixel_done.load(std::memory_order_relaxed) && !first_pixel_done.exchange(true)) {
+				std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start;
+				stats.first_pixel_seconds = elapsed.count();
+			}
+		}
+		if (hooks.footprints) {
+			#pragma omp critical(footprints)
+			hooks.footprints->tiles[span.tile].merge(row_footprint);
+			row_footprint.clear();
+		}
+		if (timed) {
+			const double row_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - row_start).count();
+			if (hooks.progress)
+				hooks.progress->row_done(row_seconds);
+			if (metrics) {
+				metrics->row_done(rays_traced - rays_before_row, row_seconds);
+				if (tile_rows_left && --tile_rows_left[span.tile] == 0)
+					metrics->tile_done();
+			}
+		}
+		if (hooks.governor)
+			hooks.governor->pace(rays_traced - rays_before_row);
+	}
+	// every row is taken: workers the governor parked would wait for rows that never come
+	if (hooks.governor)
+		hooks.governor->finish();
+	footprint_recorder() = nullptr;
+	}
+	stats.rays_traced = rays_traced;
+	return stats;
 }
 
 void write_image(const std::string& filename, const std::vector<Color>& framebuffer, int image_width, int image_height, int samples_per_pixel) {
 	std::ofstream out(filename);
 	out << "P3\n" << image_width << ' ' << image_height << "\n255\n";
 
-	for (const auto& pixel : framebuffer)
-		write_color(out, pixel, samples_per_pixel);
-} 
+	// Color is three packed doubles, so the framebuffer is one flat rgb array for the kernel
+	static_assert(sizeof(Color) == 3 * sizeof(double), "Color must be tightly packed");
+	std::vector<unsigned char> pixels(framebuffer.size() * 3);
+	MemoryCharge pixels_memory(MemoryCategory::Framebuffers, static_cast<long long>(pixels.size()));
+	kernels().tone_map(&framebuffer[0].x, static_cast<int>(pixels.size()), 1.0 / samples_per_pixel, pixels.data());
+
+	for (size_t p = 0; p < pixels.size(); p += 3)
+		out << int(pixels[p]) << ' ' << int(pixels[p + 1]) << ' ' << int(pixels[p + 2]) << '\n';
+}
+
+// writes to a temporary file next to `filename` and renames it into place, so a viewer
+// watching the file never picks up half an image
+void write_image_atomic(const std::string& filename, const std::vector<Color>& framebuffer, int image_width, int image_height, int samples_per_pixel) {
+	std::string temporary = filename + ".partial";
+	write_image(temporary, framebuffer, image_width, image_height, samples_per_pixel);
+	if (std::rename(temporary.c_str(), filename.c_str()) != 0)
+		throw std::runtime_error("Could not move " + temporary + " to " + filename + ".");
+}
+
+// reads back a P3 file as written by write_image (8 bit values in file order), or a P2
+// grayscale one, whose single channel is then repeated three times
+std::vector<int> read_image(const std::string& filename, int& image_width, int& image_height) {
+	std::ifstream in(filename);
+	std::string magic;
+	int max_value = 0;
+	if (!(in >> magic >> image_width >> image_height >> max_value) || (magic != "P3" && magic != "P2") || image_width <= 0 || image_height <= 0 || max_value <= 0)
+		throw std::runtime_error("Could not read " + filename + " as a P2 or P3 image.");
+	const int channels = (magic == "P3") ? 3 : 1;
+	std::vector<int> values(static_cast<size_t>(image_width) * image_height * 3);
+	for (size_t p = 0; p < values.size(); p += 3) {
+		for (int c = 0; c < channels; ++c) {
+			int v = 0;
+			if (!(in >> v))
+				throw std::runtime_error(filename + " ends early.");
+			values[p + c] = v * 255 / max_value;
+		}
+		if (channels == 1)
+			values[p + 1] = values[p + 2] = values[p];
+	}
+	return values;
+}
+
+// --reference: how far the written image is from a reference render of the same view.
+// rmse over the 8 bit channel values, psnr in dB relative to 255
+void compare_to_reference(const std::string& output, const std::string& reference) {
+	int width = 0, height = 0, reference_width = 0, reference_height = 0;
+	std::vector<int> image = read_image(output, width, height);
+	std::vector<int> expected = read_image(reference, reference_width, reference_height);
+	if (width != reference_width || height != reference_height)
+		throw std::runtime_error("Reference " + reference + " is " + std::to_string(reference_width) + "x" + std::to_string(reference_height) + ", the render is " + std::to_string(width) + "x" + std::to_string(height) + ".");
+	double squared = 0;
+	for (size_t v = 0; v < image.size(); ++v) {
+		double d = image[v] - expected[v];
+		squared += d * d;
+	}
+	double rmse = std::sqrt(squared / image.size());
+	std::cout << "Reference " << reference << ": rmse " << rmse << ", psnr "
+			  << (rmse > 0 ? 20.0 * std::log10(255.0 / rmse) : INFINITY) << " dB\n";
+}
+
+// --progressive: coarse to fine previews for interactive viewers.
+//
+// level 0 traces one sample for the top left pixel of every 16x16 block of the crop, the next
+// levels trace the pixels that complete the 8x8, 4x4, 2x2 and finally 1x1 grids (a pixel an
+// earlier level traced keeps its sample and is not traced again). once every pixel has its
+// first sample, each pass adds one more everywhere until samples_per_pixel is reached, so the
+// final framebuffer holds exactly what render_image would have produced.
+//
+// after each level, and after passes 2, 4, 8, ..., a preview goes to preview_path: every pixel
+// shows its own average, or the average of the nearest traced pixel if it has none yet.
+RenderStats render_progressive(std::vector<Color>& framebuffer, int image_width, int image_height, int samples_per_pixel, const Camera& camera, const Hittable& world, int max_depth, const LightSet* lights, const Crop& crop, const std::string& preview_path) {
+	constexpr int kCoarsestBlock = 16;
+	auto start = std::chrono::high_resolution_clock::now();
+	auto seconds_since_start = [&]() {
+		std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start;
+		return elapsed.count();
+	};
 
-int main() {
+	const int crop_width = crop.x1 - crop.x0;
+	const int crop_height = crop.y1 - crop.y0;
+	std::vector<int> samples(framebuffer.size(), 0);
+	std::vector<Color> preview(framebuffer.size(), Color(0, 0, 0));
+	MemoryCharge buffers_memory(MemoryCategory::Framebuffers, static_cast<long long>(framebuffer.size() * (sizeof(int) + sizeof(Color))));
+	RenderStats stats;
+
+	// one more sample for every pixel of the crop that `wanted` selects (by crop relative x, y)
+	auto trace = [&](auto wanted) {
+		long long rays_traced = 0;
+		#pragma omp parallel for schedule(dynamic) reduction(+:rays_traced)
+		for (int y = crop.y0; y < crop.y1; ++y) {
+			int j = image_height - 1 - y;
+			for (int i = crop.x0; i < crop.x1; ++i) {
+				if (!wanted(i - crop.x0, y - crop.y0))
+					continue;
+				framebuffer[y * image_width + i] += render_pixel(i, j, image_width, image_height, 1, camera, world, max_depth, lights, rays_traced);
+				++samples[y * image_width + i];
+			}
+		}
+		stats.rays_traced += rays_traced;
+	};
+
+	// with block size `block` every crop relative multiple of it has a sample; everything
+	// else copies the nearest of those (rounding to the nearest multiple, clamped to the crop)
+	auto write_preview = [&](int block, const std::string& label) {
+		double traced_at = seconds_since_start();
+		#pragma omp parallel for schedule(static)
+		for (int y = crop.y0; y < crop.y1; ++y) {
+			int sy = (y - crop.y0 + block / 2) / block * block;
+			sy = crop.y0 + std::min(sy, (crop_height - 1) / block * block);
+			for (int i = crop.x0; i < crop.x1; ++i) {
+				int index = y * image_width + i;
+				if (samples[index] == 0) {
+					int sx = (i - crop.x0 + block / 2) / block * block;
+					sx = crop.x0 + std::min(sx, (crop_width - 1) / block * block);
+					index = sy * image_width + sx;
+				}
+				preview[y * image_width + i] = framebuffer[index] / samples[index];
+			}
+		}
+		write_image_atomic(preview_path, preview, image_width, image_height, 1);
+		std::cout << "  preview " << label << ": traced after " << traced_at << " s, written after " << seconds_since_start() << " s\n";
+	};
+
+	std::cout << "Progressive render, previews go to " << preview_path << "\n";
+	for (int block = kCoarsestBlock; block >= 1; block /= 2) {
+		const bool first = (block == kCoarsestBlock);
+		trace([block, first](int x, int y) {
+			bool on_grid = (x % block == 0) && (y % block == 0);
+			bool on_coarser_grid = (x % (2 * block) == 0) && (y % (2 * block) == 0);
+			return on_grid && (first || !on_coarser_grid);
+		});
+		if (first)
+			stats.first_pixel_seconds = seconds_since_start();
+		write_preview(block, std::to_string(block) + "x" + std::to_string(block) + " blocks");
+	}
+
+	for (int pass = 2; pass <= samples_per_pixel; ++pass) {
+		trace([](int, int) { return true; });
+		if ((pass & (pass - 1)) == 0 && pass < samples_per_pixel)
+			write_preview(1, std::to_string(pass) + " spp");
+	}
+	return stats;
+}
+
+// --upscale=N: draft mode. paths are traced for a (width / N) x (height / N) image, then
+// guided_upsample (upscale.h) brings that up to full size with one primary ray per full size
+// pixel as its guide. about N^2 times less path tracing for the price of one ray per pixel.
+RenderStats render_upscaled(std::vector<Color>& framebuffer, int image_width, int image_height, int samples_per_pixel, const Camera& camera, const Hittable& world, int max_depth, const LightSet* lights, int interleave, int factor, RenderGovernor* governor = nullptr) {
+	const int low_width = std::max(2, image_width / factor);
+	const int low_height = std::max(2, image_height / factor);
+	std::vector<Color> low(low_width * low_height);
+	// the low resolution image with its guide values, and the full size guides and result
+	MemoryCharge buffers_memory(MemoryCategory::Framebuffers,
+		static_cast<long long>(low.size()) * (2 * sizeof(Color) + sizeof(double) + sizeof(Vec3))
+		+ static_cast<long long>(image_width) * image_height * (sizeof(double) + sizeof(Vec3) + 2 * sizeof(Color)));
+	Crop whole;
+	whole.x1 = low_width;
+	whole.y1 = low_height;
+
+	auto start = std::chrono::high_resolution_clock::now();
+	RenderHooks hooks;
+	hooks.governor = governor;
+	RenderStats stats = render_image(low, low_width, low_height, samples_per_pixel, camera, world, max_depth, lights, interleave, whole, hooks);
+	std::chrono::duration<double> path_seconds = std::chrono::high_resolution_clock::now() - start;
+
+	for (Color& c : low)
+		c = c / samples_per_pixel;
+	start = std::chrono::high_resolution_clock::now();
+	GuideBuffers guides = render_guides(image_width, image_height, camera, world, stats.rays_traced);
+	std::chrono::duration<double> guide_seconds = std::chrono::high_resolution_clock::now() - start;
+
+	start = std::chrono::high_resolution_clock::now();
+	std::vector<Color> upsampled = guided_upsample(low, low_width, low_height, guides);
+	// write_image divides by the sample count again
+	for (size_t p = 0; p < framebuffer.size(); ++p)
+		framebuffer[p] = upsampled[p] * samples_per_pixel;
+	std::chrono::duration<double> upsample_seconds = std::chrono::high_resolution_clock::now() - start;
+
+	std::cout << "Upscaled " << low_width << "x" << low_height << " -> " << image_width << "x" << image_height
+			  << ": paths " << path_seconds.count() << " s, guides " << guide_seconds.count()
+			  << " s, upsampling " << upsample_seconds.count() << " s\n";
+	return stats;
+}
+
+// --roulette: ray_color_roulette (roulette.h) in passes of 1, 1, 2, 4, ... samples per pixel.
+// the first pass traces plain paths; after every pass the cache takes in what the
+// continuations brought back, and the pixel values, image variance and rays per sample are
+// re-estimated from all samples so far. every pass counts towards the image.
+RenderStats render_roulette(std::vector<Color>& framebuffer, int image_width, int image_height, int samples_per_pixel, const Camera& camera, const Hittable& world, int max_depth, const LightSet* lights, const Crop& crop, RouletteCache& cache) {
+	auto start = std::chrono::high_resolution_clock::now();
+	RenderStats stats;
+	const size_t pixels = framebuffer.size();
+	// per pixel luminance sums over all samples so far, for the variance estimate
+	std::vector<double> sum(pixels, 0.0);
+	std::vector<double> sum_squared(pixels, 0.0);
+	std::vector<double> estimate(pixels, 0.0);
+	MemoryCharge buffers_memory(MemoryCategory::Framebuffers, static_cast<long long>(pixels) * 3 * sizeof(double));
+
+	int done = 0;
+	for (int pass = 0; done < samples_per_pixel; ++pass) {
+		const int samples = std::min(samples_per_pixel - done, pass < 2 ? 1 : 1 << (pass - 1));
+		long long rays_traced = 0;
+		#pragma omp parallel for schedule(dynamic) reduction(+:rays_traced)
+		for (int y = crop.y0; y < crop.y1; ++y) {
+			int j = image_height - 1 - y;
+			static thread_local std::vector<double> jitter;
+			jitter.resize(2 * samples);
+			for (int i = crop.x0; i < crop.x1; ++i) {
+				const int index = y * image_width + i;
+				fill_random_doubles(jitter.data(), static_cast<int>(jitter.size()));
+				for (int s = 0; s < samples; ++s) {
+					double u = (i + jitter[2 * s]) / (image_width - 1);
+					double v = (j + jitter[2 * s + 1]) / (image_height - 1);
+					double completes = 0;
+					Color c = ray_color_roulette(camera.get_ray(u, v), world, max_depth, rays_traced, lights, cache, completes, estimate[index]);
+					framebuffer[index] += c;
+					double l = luminance(c);
+					sum[index] += l;
+					sum_squared[index] += l * l;
+				}
+			}
+		}
+		stats.rays_traced += rays_traced;
+		done += samples;
+		if (pass == 0) {
+			std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start;
+			stats.first_pixel_seconds = elapsed.count();
+		}
+		if (done == samples_per_pixel)
+			break;
+
+		// variance of one sample over the pixel's value, averaged over the crop. dark pixels are
+		// taken to be at least a tenth of the image mean, so they do not blow the average up
+		double image_sum = 0;
+		long long counted = 0;
+		for (int y = crop.y0; y < crop.y1; ++y) {
+			for (int i = crop.x0; i < crop.x1; ++i) {
+				estimate[y * image_width + i] = sum[y * image_width + i] / done;
+				image_sum += estimate[y * image_width + i];
+				++counted;
+			}
+		}
+		const double floor = 0.1 * image_sum / std::max(1LL, counted);
+		double variance_per_value = 0;
+		for (int y = crop.y0; y < crop.y1; ++y) {
+			for (int i = crop.x0; i < crop.x1; ++i) {
+				const int index = y * image_width + i;
+				double mean = estimate[index];
+				double variance = std::max(0.0, sum_squared[index] / done - mean * mean);
+				estimate[index] = std::max(mean, floor);
+				variance_per_value += variance / estimate[index];
+			}
+		}
+		variance_per_value /= std::max(1LL, counted);
+		cache.update();
+		cache.set_image_estimates(variance_per_value, double(stats.rays_traced) / (double(counted) * done));
+	}
+	return stats;
+}
+
+// metropolis light transport: the bootstrap, then the chains with as many steps in total as
+// the crop window has samples (samples_per_pixel per pixel)
+RenderStats render_metropolis(std::vector<Color>& framebuffer, int samples_per_pixel, MetropolisIntegrator& integrator, const Hittable& world, const LightSet* lights, const Crop& crop) {
+	auto start = std::chrono::high_resolution_clock::now();
+	RenderStats stats;
+
+	long long rays_traced = 0;
+	if (!integrator.bootstrap(world, lights, rays_traced))
+		throw std::runtime_error("None of the bootstrap paths carried any light.");
+
+	const long long mutations = static_cast<long long>(samples_per_pixel) * (crop.x1 - crop.x0) * (crop.y1 - crop.y0);
+	const int chains = integrator.config().chains;
+	#pragma omp parallel for schedule(dynamic) reduction(+:rays_traced)
+	for (int chain = 0; chain < chains; ++chain) {
+		// the remainder goes to the first chains
+		long long steps = mutations / chains + (chain < mutations % chains ? 1 : 0);
+		integrator.run_chain(world, lights, chain, steps, rays_traced);
+	}
+	integrator.resolve(framebuffer, samples_per_pixel, mutations);
+
+	// every pixel is only known once all chains are done
+	std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start;
+	stats.first_pixel_seconds = elapsed.count();
+	stats.rays_traced = rays_traced;
+	return stats;
+}
+
+// --integrator=bdpt: every sample is one camera path and one light path, see bdpt.h
+RenderStats render_bidirectional(std::vector<Color>& framebuffer, int image_width, int image_height, int samples_per_pixel, BidirectionalIntegrator& integrator, const Hittable& world, const Crop& crop) {
+	auto start = std::chrono::high_resolution_clock::now();
+	std::atomic<bool> first_pixel_done{false};
+	RenderStats stats;
+
+	long long rays_traced = 0;
+	#pragma omp parallel for schedule(dynamic) reduction(+:rays_traced)
+	for (int y = crop.y0; y < crop.y1; ++y) {
+		int j = image_height - 1 - y;
+		static thread_local std::vector<double> jitter;
+		jitter.resize(2 * samples_per_pixel);
+		for (int i = crop.x0; i < crop.x1; ++i) {
+			fill_random_doubles(jitter.data(), static_cast<int>(jitter.size()));
+			Color pixel_color(0, 0, 0);
+			for (int s = 0; s < samples_per_pixel; ++s) {
+				double u = (i + jitter[2 * s]) / (image_width - 1);
+				double v = (j + jitter[2 * s + 1]) / (image_height - 1);
+				pixel_color += integrator.sample(world, u, v, rays_traced);
+			}
+			framebuffer[y * image_width + i] = pixel_color;
+
+			if (!first_pixel_done.load(std::memory_order_relaxed) && !first_pixel_done.exchange(true)) {
+				std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start;
+				stats.first_pixel_seconds = elapsed.count();
+			}
+		}
+	}
+	integrator.resolve_splats(framebuffer, crop);
+	stats.rays_traced = rays_traced;
+	return stats;
+}
+
+// --query=N: times N random rays through the batch query API. origins are spread over the
+// region the camera looks at (in front of it, around the spheres), directions are uniform.
+// the occlusion pass uses the same rays cut to segments of length 1, the proximity queries
+// use the ray origins as points.
+int run_query_benchmark(const HittableList& world, int count) {
+	std::vector<double> ox(count), oy(count), oz(count), dx(count), dy(count), dz(count);
+	std::vector<double> t_min(count, 0.001), t_max(count, INFINITY), segment_end(count, 1.0);
+	for (int i = 0; i < count; ++i) {
+		ox[i] = random_double(-2.0, 2.0);
+		oy[i] = random_double(-0.5, 1.0);
+		oz[i] = random_double(-3.5, -0.5);
+		Vec3 d = random_unit_vector();
+		dx[i] = d.x;
+		dy[i] = d.y;
+		dz[i] = d.z;
+	}
+
+	RayBatch rays;
+	rays.count = count;
+	rays.origin_x = ox.data(); rays.origin_y = oy.data(); rays.origin_z = oz.data();
+	rays.direction_x = dx.data(); rays.direction_y = dy.data(); rays.direction_z = dz.data();
+	rays.t_min = t_min.data();
+	rays.t_max = t_max.data();
+
+	std::vector<double> t(count), nx(count), ny(count), nz(count);
+	std::vector<int32_t> primitive(count);
+	HitBatch hits;
+	hits.t = t.data();
+	hits.primitive = primitive.data();
+	hits.normal_x = nx.data(); hits.normal_y = ny.data(); hits.normal_z = nz.data();
+
+	std::vector<uint8_t> occluded(count);
+
+	auto start_build = std::chrono::high_resolution_clock::now();
+	RayQuery query(world);
+	std::chrono::duration<double> build = std::chrono::high_resolution_clock::now() - start_build;
+
+	RayQueryOptions sorted_options;
+	sorted_options.sort = true;
+	RayQuery sorted_query(world, sorted_options);
+
+	// the baseline: what a caller without this API would do, one Ray and one hit() at a time
+	// (BVHNode reorders the list it is built from, so it gets a copy)
+	HittableList scratch = world;
+	BVHNode bvh(scratch);
+	auto start_single = std::chrono::high_resolution_clock::now();
+	#pragma omp parallel for schedule(dynamic, 4096)
+	for (int i = 0; i < count; ++i) {
+		HitRecord record;
+		Ray ray(Vec3(ox[i], oy[i], oz[i]), Vec3(dx[i], dy[i], dz[i]));
+		primitive[i] = bvh.hit(ray, t_min[i], t_max[i], record) ? 0 : -1;
+	}
+	std::chrono::duration<double> single = std::chrono::high_resolution_clock::now() - start_single;
+
+	QueryStats sorted = sorted_query.intersect(rays, hits);
+	QueryStats closest = query.intersect(rays, hits);
+	size_t hit_count = std::count_if(primitive.begin(), primitive.end(), [](int32_t p) { return p >= 0; });
+
+	rays.t_max = segment_end.data();
+	QueryStats occlusion = query.occluded(rays, occluded.data());
+	size_t occluded_count = std::count(occluded.begin(), occluded.end(), 1);
+
+	std::cout << "Ray queries against " << query.primitive_count() << " spheres (tree built in "
+			  << build.count() << " seconds, " << omp_get_max_threads() << " threads):\n"
+			  << "  BVHNode::hit loop:   " << count / single.count() / 1e6 << " Mrays/s\n"
+			  << "  closest hit:         " << closest.millions_per_second() << " Mrays/s (" << hit_count << " of " << count << " hit)\n"
+			  << "  closest hit, sorted: " << sorted.millions_per_second() << " Mrays/s\n"
+			  << "  occlusion:           " << occlusion.millions_per_second() << " Mrays/s (" << occluded_count << " of " << count << " occluded)\n";
+
+	// the same origins as query points for the proximity queries
+	ProximityQuery proximity(world);
+	PointBatch points;
+	points.count = count;
+	points.x = ox.data(); points.y = oy.data(); points.z = oz.data();
+	NearestBatch nearest;
+	nearest.primitive = primitive.data();
+	nearest.distance = t.data();
+	nearest.point_x = nx.data(); nearest.point_y = ny.data(); nearest.point_z = nz.data();
+	QueryStats closest_point = proximity.nearest(points, nearest);
+
+	const int k = 8;
+	std::vector<int32_t> k_primitive(size_t(count) * k);
+	std::vector<double> k_distance(size_t(count) * k);
+	QueryStats k_nearest = proximity.k_nearest(points, k, k_primitive.data(), k_distance.data());
+
+	std::vector<double> radius(count, 0.05);
+	SphereBatch spheres;
+	spheres.count = count;
+	spheres.center_x = ox.data(); spheres.center_y = oy.data(); spheres.center_z = oz.data();
+	spheres.radius = radius.data();
+	OverlapResult overlaps;
+	QueryStats overlap = proximity.overlap_spheres(spheres, overlaps);
+
+	// the O(n) scan over HittableList::objects this replaces, timed on a slice of the points
+	const int brute_count = std::min(count, 2000);
+	auto start_brute = std::chrono::high_resolution_clock::now();
+	#pragma omp parallel for schedule(dynamic, 64)
+	for (int i = 0; i < brute_count; ++i) {
+		Vec3 point(ox[i], oy[i], oz[i]);
+		double best = INFINITY;
+		for (const auto& object : world.objects) {
+			const Sphere& sphere = static_cast<const Sphere&>(*object);
+			best = std::min(best, std::abs((point - sphere.center).length() - sphere.radius));
+		}
+		t[i] = best;
+	}
+	std::chrono::duration<double> brute = std::chrono::high_resolution_clock::now() - start_brute;
+
+	std::cout << "Proximity queries:\n"
+			  << "  brute force nearest: " << brute_count / brute.count() / 1e6 << " M/s\n"
+			  << "  nearest surface:     " << closest_point.millions_per_second() << " M/s\n"
+			  << "  " << k << " nearest:           " << k_nearest.millions_per_second() << " M/s\n"
+			  << "  sphere overlap:      " << overlap.millions_per_second() << " M/s (" << overlaps.primitives.size() << " overlaps, radius " << radius[0] << ")\n";
+	return 0;
+}
+
+// blacks out everything outside the crop, as a render of only the crop would have left it
+void clear_outside_crop(std::vector<Color>& framebuffer, int image_width, int image_height, const Crop& crop) {
+	for (int y = 0; y < image_height; ++y)
+		for (int x = 0; x < image_width; ++x)
+			if (y < crop.y0 || y >= crop.y1 || x < crop.x0 || x >= crop.x1)
+				framebuffer[y * image_width + x] = Color(0, 0, 0);
+}
+
+// --cache-dir: every primitive by value, in list order (its Sphere::id). the scene's key sorts
+// them, so the compile pass's reordering does not change it
+std::vector<SceneEntry> describe_scene(const HittableList& world) {
+	std::vector<SceneEntry> scene;
+	scene.reserve(world.objects.size());
+	for (const auto& object : world.objects) {
+		auto sphere = std::dynamic_pointer_cast<Sphere>(object);
+		if (!sphere)
+			throw std::runtime_error("The render cache can only hash scenes made of spheres.");
+		SceneEntry entry;
+		entry.shape = InputHash().add(sphere->center).add(sphere->radius).value();
+		entry.object = InputHash().add(entry.shape).add(sphere->material->hash()).value();
+		entry.emitter = std::dynamic_pointer_cast<DiffuseLight>(sphere->material) != nullptr;
+		scene.push_back(entry);
+	}
+	return scene;
+}
+
+// the rest of what decides what a plain render shows: the camera as the rays through the image
+// corners, and importance as the samples every pixel gets. what only changes the speed (accel,
+// kernels, threads, interleave, the compile pass itself) stays out. there is no seed to add:
+// the random streams are seeded per thread, so every render of the same key is an equally good
+// estimate of the same image
+uint64_t settings_key(const Camera& camera, int image_width, int image_height, int samples_per_pixel, int max_depth, bool direct_lighting, const std::vector<int>& pixel_samples) {
+	InputHash hash;
+	hash.add(std::string("rayfloat render 2"));
+	for (double s : { 0.0, 1.0 })
+		for (double t : { 0.0, 1.0 }) {
+			Ray ray = camera.get_ray(s, t);
+			hash.add(ray.origin).add(ray.direction);
+		}
+	hash.add(image_width).add(image_height).add(samples_per_pixel).add(max_depth).add(direct_lighting);
+	hash.add(pixel_samples.size());
+	for (int samples : pixel_samples)
+		hash.add(samples);
+	return hash.value();
+}
+
+// --recolor=index:r,g,b, the primitive in build order and its new colour
+struct RecolorEdit {
+	int index = 0;
+	Color color;
+};
+
+RecolorEdit parse_recolor(const std::string& edit) {
+	size_t colon = edit.find(':');
+	if (colon == std::string::npos)
+		throw std::runtime_error("Option --recolor expects index:r,g,b, got '" + edit + "'.");
+	int index = parse_int_option("recolor", edit.substr(0, colon));
+	double rgb[3];
+	size_t begin = colon + 1;
+	for (int c = 0; c < 3; ++c) {
+		size_t end = edit.find(',', begin);
+		if ((c < 2) != (end != std::string::npos))
+			throw std::runtime_error("Option --recolor expects index:r,g,b, got '" + edit + "'.");
+		rgb[c] = parse_double_option("recolor", edit.substr(begin, end - begin));
+		begin = end + 1;
+	}
+	return { index, Color(rgb[0], rgb[1], rgb[2]) };
+}
+
+// the same kind of material as `material` in the edit's colour
+std::shared_ptr<Material> recolored_material(const std::shared_ptr<Material>& material, const RecolorEdit& edit) {
+	if (auto lambertian = std::dynamic_pointer_cast<Lambertian>(material))
+		return std::make_shared<Lambertian>(edit.color);
+	if (auto metal = std::dynamic_pointer_cast<Metal>(material))
+		return std::make_shared<Metal>(edit.color, metal->fuzziness);
+	if (auto light = std::dynamic_pointer_cast<DiffuseLight>(material))
+		return std::make_shared<DiffuseLight>(edit.color, light->brightness);
+	throw std::runtime_error("--recolor: primitive " + std::to_string(edit.index) + " is glass, which has no colour.");
+}
+
+void recolor_primitive(HittableList& world, const std::string& text) {
+	RecolorEdit edit = parse_recolor(text);
+	if (edit.index < 0 || edit.index >= static_cast<int>(world.objects.size()))
+		throw std::runtime_error("--recolor: the scene has no primitive " + std::to_string(edit.index) + ".");
+	auto sphere = std::dynamic_pointer_cast<Sphere>(world.objects[edit.index]);
+	sphere->material = recolored_material(sphere->material, edit);
+}
+
+// the scene the options describe, with their edits applied, compiled (compiled then says what
+// that did) and numbered: Sphere::id is the position in the final list, for HitRecord::primitive.
+// build_order (may be null) gets the final id of every primitive in the order --recolor counts them
+HittableList build_world(const Options& options, CompileStats& compiled, std::vector<int>* build_order = nullptr) {
+	HittableList world = (options.scene == "grid") ? build_grid_scene(options.grid_size) : build_scene();
+	for (const std::string& edit : options.recolor)
+		recolor_primitive(world, edit);
+	// numbered in build order first, which the compiler's copies keep
+	for (size_t i = 0; i < world.objects.size(); ++i)
+		if (auto sphere = std::dynamic_pointer_cast<Sphere>(world.objects[i]))
+			sphere->id = static_cast<int>(i);
+	if (options.compile_scene)
+		compiled = SceneCompiler::compile(world);
+	if (build_order)
+		build_order->assign(world.objects.size(), -1);
+	for (size_t i = 0; i < world.objects.size(); ++i) {
+		if (auto sphere = std::dynamic_pointer_cast<Sphere>(world.objects[i])) {
+			if (build_order)
+				(*build_order)[sphere->id] = static_cast<int>(i);
+			sphere->id = static_cast<int>(i);
+		}
+	}
+	// the packs copied the ids from before
+	world.repack();
+	return world;
+}
+
+// "auto" is "list" for tiny scenes, else "bvh"
+std::string resolve_accel(const std::string& accel, const HittableList& world) {
+	if (accel == "auto")
+		return world.prefers_brute_force() ? "list" : "bvh";
+	return accel;
+}
+
+// the binary tree sorts world.objects while it builds
+std::shared_ptr<Hittable> build_accel(HittableList& world, const std::string& accel, int lazy_levels) {
+	if (accel == "wide")
+		return std::make_shared<WideBVH>(world);
+	if (accel == "list")
+		return std::make_shared<HittableList>(world);
+	return std::make_shared<BVHNode>(world, lazy_levels);
+}
+
+// the render's memory at its peak, per subsystem, from the scene and the options alone, before
+// anything big is allocated. the sizes are the ones the ledger gets charged as things are made
+std::array<long long, kMemoryCategories> estimate_memory(const Options& options, const HittableList& world, const std::string& accel, int image_width, int image_height) {
+	std::array<long long, kMemoryCategories> bytes{};
+	auto at = [&bytes](MemoryCategory category) -> long long& { return bytes[static_cast<int>(category)]; };
+	const long long pixels = static_cast<long long>(image_width) * image_height;
+	const long long threads = omp_get_max_threads();
+
+	at(MemoryCategory::Primitives) = primitive_bytes(world);
+	at(MemoryCategory::Materials) = material_bytes(world);
+	at(MemoryCategory::Bvh) = estimate_accel_bytes(world.objects.size(), accel);
+
+	// the framebuffer and write_image's 8 bit copy, plus what the mode keeps next to them
+	long long frame = pixels * (sizeof(Color) + 3);
+	if (options.integrator != "path")
+		frame += pixels * sizeof(Color);
+	if (options.progressive)
+		frame += pixels * (sizeof(int) + sizeof(Color));
+	if (options.upscale > 1) {
+		long long low = std::max(2, image_width / options.upscale) * static_cast<long long>(std::max(2, image_height / options.upscale));
+		frame += low * (2 * sizeof(Color) + sizeof(double) + sizeof(Vec3)) + pixels * (sizeof(double) + sizeof(Vec3) + 2 * sizeof(Color));
+	}
+	if (!options.importance.empty())
+		frame += pixels * sizeof(int);
+	if (options.roulette)
+		frame += pixels * 3 * sizeof(double);
+	at(MemoryCategory::Framebuffers) = frame;
+
+	// every thread keeps the jitter of its largest pixel, plus what the integrator needs per
+	// thread
+	long long pixel_samples = options.samples_per_pixel;
+	if (!options.importance.empty())
+		pixel_samples *= kMaxSampleFactor;
+	long long scratch = threads * 2 * pixel_samples * sizeof(double);
+	if (options.roulette)
+		scratch += RouletteCache::table_bytes(static_cast<int>(threads));
+	if (options.integrator == "bdpt")
+		scratch += threads * (2 * options.max_depth + 3) * sizeof(PathVertex);
+	if (options.integrator == "mlt")
+		scratch += static_cast<long long>(options.mlt_bootstrap) * sizeof(double);
+	at(MemoryCategory::Scratch) = scratch;
+	return bytes;
+}
+
+std::string describe_memory(const std::array<long long, kMemoryCategories>& bytes) {
+	std::string text;
+	for (int c = 0; c < kMemoryCategories; ++c)
+		text += std::string(c ? ", " : "") + memory_category_name(static_cast<MemoryCategory>(c)) + " " + format_bytes(bytes[c]);
+	return text;
+}
+
+// one tile of a daemon job, traced on the calling worker alone
+long long render_job_tile(DaemonJob& job, const Crop& tile) {
+	const Options& o = job.options;
+	const WideBVH* wide = o.interleave > 0 ? static_cast<const WideBVH*>(job.scene->accel.get()) : nullptr;
+	long long rays = 0;
+	for (int y = tile.y0; y < tile.y1; ++y) {
+		// rows are rendered bottom up (v grows upwards), the framebuffer is stored top down
+		const int j = job.image_height - 1 - y;
+		for (int i = tile.x0; i < tile.x1; ++i) {
+			job.framebuffer[y * job.image_width + i] = wide
+				? render_pixel_interleaved(i, j, job.image_width, job.image_height, o.samples_per_pixel, *job.camera, *wide, o.max_depth, job.lights, o.interleave, rays)
+				: render_pixel(i, j, job.image_width, job.image_height, o.samples_per_pixel, *job.camera, *job.scene->accel, o.max_depth, job.lights, rays);
+		}
+	}
+	return rays;
+}
+
+// --daemon: how run_daemon (daemon.h) builds, traces and writes the jobs
+DaemonRenderer daemon_renderer() {
+	DaemonRenderer renderer;
+	renderer.build_scene = [](const Options& o) {
+		auto scene = std::make_shared<LoadedScene>();
+		CompileStats compiled;
+		scene->world = build_world(o, compiled);
+		scene->accel_name = resolve_accel(o.accel, scene->world);
+		const auto build_start = std::chrono::steady_clock::now();
+		scene->accel = build_accel(scene->world, scene->accel_name, o.lazy_levels);
+		if (LiveMetrics* metrics = live_metrics())
+			metrics->set_accel(describe_accel(*scene->accel, scene->accel_name, scene->world.objects.size(),
+											  std::chrono::duration<double>(std::chrono::steady_clock::now() - build_start).count()));
+		scene->lights = std::make_unique<LightSet>(scene->world, o.occluder_cache);
+		return scene;
+	};
+	renderer.build_camera = build_camera;
+	renderer.render_tile = render_job_tile;
+	renderer.write_image = [](DaemonJob& job) {
+		// tiles reach past the crop's edges; the image only shows the crop
+		clear_outside_crop(job.framebuffer, job.image_width, job.image_height, job.crop);
+		write_image_atomic(job.output(), job.framebuffer, job.image_width, job.image_height, job.options.samples_per_pixel);
+	};
+	return renderer;
+}
+
+
+// output/image.ppm -> output/image_007.ppm
+std::string numbered_output(const std::string& output, size_t number) {
+	std::filesystem::path path(output);
+	char suffix[16];
+	std::snprintf(suffix, sizeof(suffix), "_%03zu", number);
+	return (path.parent_path() / (path.stem().string() + suffix + path.extension().string())).string();
+}
+
+// --sweep=plan: renders every variant of the plan (sweep.h) in this process. the variants are
+// taken grouped by geometry, then by material edits. the scene and its acceleration structure
+// are built once per geometry, and a change of materials is written into the built structure
+// (Hittable::refresh_materials) instead of building it again. variants without an output of
+// their own are numbered after --output in plan order.
+//
+// --sweep-concurrent=on renders the variants that share geometry and materials one per
+// thread, each of them single threaded. that pays for many small renders, where a parallel
+// render of its own spends much of its time starting and joining the workers.
+int run_sweep(const Options& options) {
+	struct Variant {
+		SweepVariant plan;
+		Options options;
+		std::string output;
+		RenderStats stats;
+		double seconds = 0;
+		std::string error;
+	};
+	Options base = options;
+	base.sweep.clear();
+	// the whole sweep's metrics are already being exported
+	base.metrics_port = 0;
+	base.metrics_file.clear();
+	std::vector<SweepVariant> plan = read_sweep(options.sweep);
+	std::vector<Variant> variants(plan.size());
+	for (size_t v = 0; v < plan.size(); ++v) {
+		Variant& variant = variants[v];
+		variant.plan = plan[v];
+		std::vector<std::string> arguments = plan[v].arguments;
+		arguments.insert(arguments.begin(), "rayfloat");
+		std::vector<char*> argv;
+		for (std::string& argument : arguments)
+			argv.push_back(argument.data());
+		try {
+			variant.options = parse_options(static_cast<int>(argv.size()), argv.data(), base);
+			require_plain_render(variant.options, "Sweep variants");
+		} catch (const std::exception& e) {
+			throw std::runtime_error(options.sweep + ", variant " + std::to_string(v + 1) + " (" + plan[v].label + "): " + e.what());
+		}
+		bool own_output = std::any_of(plan[v].arguments.begin(), plan[v].arguments.end(), [](const std::string& a) { return a.rfind("--output=", 0) == 0; });
+		variant.output = own_output ? variant.options.output : numbered_output(base.output, v + 1);
+	}
+
+	std::vector<size_t> order(variants.size());
+	std::iota(order.begin(), order.end(), 0);
+	std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+		const Options& x = variants[a].options;
+		const Options& y = variants[b].options;
+		const std::string gx = geometry_identity(x), gy = geometry_identity(y);
+		return gx != gy ? gx < gy : scene_identity(x) < scene_identity(y);
+	});
+
+	std::cout << "Sweeping " << variants.size() << " variants of " << options.sweep
+			  << (options.sweep_concurrent ? ", one per thread" : ", one after the other") << std::endl;
+	if (options.sweep_concurrent)
+		omp_set_max_active_levels(1);
+
+	// what is built right now
+	std::string built_geometry, built_scene;
+	HittableList world;
+	std::shared_ptr<Hittable> accel;
+	std::vector<int> build_order;
+	// every primitive's material before any edit, by Sphere::id
+	std::vector<std::shared_ptr<Material>> base_materials;
+	std::unique_ptr<LightSet> lights;
+	int geometry_builds = 0, material_updates = 0, failures = 0;
+	double build_seconds = 0, update_seconds = 0;
+	auto seconds_since = [](std::chrono::steady_clock::time_point start) {
+		return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	};
+	const auto sweep_start = std::chrono::steady_clock::now();
+
+	for (size_t group = 0; group < order.size();) {
+		const Options& o = variants[order[group]].options;
+		size_t group_end = group + 1;
+		while (group_end < order.size() && scene_identity(variants[order[group_end]].options) == scene_identity(o))
+			++group_end;
+
+		if (geometry_identity(o) != built_geometry) {
+			const auto start = std::chrono::steady_clock::now();
+			Options unedited = o;
+			unedited.recolor.clear();
+			CompileStats compiled;
+			build_order.clear();
+			world = build_world(unedited, compiled, &build_order);
+			base_materials.assign(world.objects.size(), nullptr);
+			for (const auto& object : world.objects)
+				if (auto sphere = std::dynamic_pointer_cast<Sphere>(object))
+					base_materials[sphere->id] = sphere->material;
+			const std::string accel_name = resolve_accel(o.accel, world);
+			const auto build_start = std::chrono::steady_clock::now();
+			accel = build_accel(world, accel_name, o.lazy_levels);
+			if (LiveMetrics* metrics = live_metrics())
+				metrics->set_accel(describe_accel(*accel, accel_name, world.objects.size(), seconds_since(build_start)));
+			built_geometry = geometry_identity(o);
+			built_scene = scene_identity(unedited);
+			lights.reset();
+			++geometry_builds;
+			build_seconds += seconds_since(start);
+		}
+		if (scene_identity(o) != built_scene) {
+			const auto start = std::chrono::steady_clock::now();
+			std::vector<std::shared_ptr<Material>> by_id = base_materials;
+			try {
+				for (const std::string& text : o.recolor) {
+					RecolorEdit edit = parse_recolor(text);
+					if (edit.index < 0 || edit.index >= static_cast<int>(build_order.size()))
+						throw std::runtime_error("--recolor: the scene has no primitive " + std::to_string(edit.index) + ".");
+					const int id = build_order[edit.index];
+					by_id[id] = recolored_material(base_materials[id], edit);
+				}
+			} catch (const std::exception& e) {
+				// the edits cannot be made: none of the group's variants render
+				for (size_t k = group; k < group_end; ++k) {
+					std::cout << "Variant " << order[k] + 1 << "/" << variants.size() << " (" << variants[order[k]].plan.label << "): failed: " << e.what() << "\n";
+					++failures;
+				}
+				group = group_end;
+				continue;
+			}
+			world.refresh_materials(by_id);
+			accel->refresh_materials(by_id);
+			built_scene = scene_identity(o);
+			lights.reset();
+			++material_updates;
+			update_seconds += seconds_since(start);
+		}
+		if (!lights)
+			lights = std::make_unique<LightSet>(world, o.occluder_cache);
+
+		const bool concurrent = options.sweep_concurrent && group_end - group > 1;
+		#pragma omp parallel for schedule(dynamic, 1) if (concurrent)
+		for (size_t k = group; k < group_end; ++k) {
+			Variant& variant = variants[order[k]];
+			const Options& vo = variant.options;
+			try {
+				// the occluder cache is kept per thread, and every concurrent render is thread 0 of its own team
+				std::unique_ptr<LightSet> own_lights;
+				const LightSet* direct = (vo.direct_lighting && !lights->empty()) ? lights.get() : nullptr;
+				if (direct && concurrent) {
+					own_lights = std::make_unique<LightSet>(world, vo.occluder_cache);
+					direct = own_lights.get();
+				}
+				const double aspect_ratio = 16.0 / 9.0;
+				const int width = vo.image_width;
+				const int height = static_cast<int>(width / aspect_ratio);
+				const Camera camera = build_camera(aspect_ratio, vo);
+				const Crop crop = render_window(vo.crop, width, height);
+				std::vector<Color> framebuffer(static_cast<size_t>(width) * height);
+				const auto start = std::chrono::steady_clock::now();
+				variant.stats = render_image(framebuffer, width, height, vo.samples_per_pixel, camera, *accel, vo.max_depth, direct, vo.interleave, crop);
+				variant.seconds = seconds_since(start);
+				write_image(variant.output, framebuffer, width, height, vo.samples_per_pixel);
+			} catch (const std::exception& e) {
+				variant.error = e.what();
+			}
+
+			#pragma omp critical(sweep_report)
+			{
+				std::cout << "Variant " << order[k] + 1 << "/" << variants.size() << " (" << variant.plan.label << "): ";
+				if (variant.error.empty())
+					std::cout << variant.output << " in " << variant.seconds << " s, " << variant.stats.rays_traced / std::max(1e-9, variant.seconds) / 1e6 << " Mrays/s\n";
+				else
+					std::cout << "failed: " << variant.error << "\n";
+				if (variant.error.empty() && !vo.reference.empty())
+					compare_to_reference(variant.output, vo.reference);
+				std::cout.flush();
+			}
+		}
+		for (size_t k = group; k < group_end; ++k)
+			failures += !variants[order[k]].error.empty();
+		group = group_end;
+	}
+
+	std::cout << "Sweep done in " << seconds_since(sweep_start) << " s: " << variants.size() - failures << " of " << variants.size()
+			  << " variants rendered, geometry built " << geometry_builds << " times (" << build_seconds << " s), materials updated "
+			  << material_updates << " times (" << update_seconds << " s)\n";
+	return failures > 0 ? 1 : 0;
+}
+
+int run(const Options& options) {
 	const double aspect_ratio = 16.0 / 9.0;
-	const int image_width = 1600;
+	const int image_width = options.image_width;
 	const int image_height = static_cast<int>(image_width / aspect_ratio);
-	const int samples_per_pixel = 500;
-	const int max_depth = 10;
+	const int samples_per_pixel = options.samples_per_pixel;
+	const int max_depth = options.max_depth;
+
+	IsaLevel detected_isa = detect_isa();
+	IsaLevel isa = select_kernels(options.isa == "auto" ? detected_isa : parse_isa(options.isa));
+
+	// exported for as long as the run lasts, the daemon's and the sweep's included
+	std::unique_ptr<MetricsExporter> metrics;
+	if (options.metrics_port > 0 || !options.metrics_file.empty()) {
+		metrics = std::make_unique<MetricsExporter>(options.metrics_file, options.metrics_port, options.metrics_interval);
+		if (options.metrics_port > 0)
+			std::cout << "Metrics on http://127.0.0.1:" << options.metrics_port << "/metrics" << std::endl;
+	}
+
+	if (!options.daemon.empty())
+		return run_daemon(options, daemon_renderer());
+	if (!options.sweep.empty())
+		return run_sweep(options);
+	if (options.query_rays > 0)
+		return run_query_benchmark(options.scene == "grid" ? build_grid_scene(options.grid_size) : build_scene(), options.query_rays);
 
 	std::cout << "Rendering a " << image_width << "x" << image_height << " image with "
 			  << samples_per_pixel << " samples per pixel and max depth " << max_depth << ".\n";
 	std::cout << "Building Scene...\n";
+	// package and dram energy per phase, for the summary (nothing without RAPL)
+	EnergyMeter energy(options.powercap_root);
+
+	CompileStats compiled;
+	HittableList world = build_world(options, compiled);
+	if (options.compile_scene) {
+		std::cout << "Scene compiled in " << compiled.seconds << " seconds: " << compiled.materials_before << " -> "
+				  << compiled.materials_after << " materials (" << compiled.bytes_saved << " bytes saved), "
+				  << compiled.switches_before << " -> " << compiled.switches_after << " material switches in list order, "
+				  << compiled.run_materials_before << " -> " << compiled.run_materials_after << " materials per "
+				  << SceneCompiler::kGroupSpan << " primitives\n";
+	}
+	energy.mark("scene");
+	const std::string accel_name = resolve_accel(options.accel, world);
+
+	// refuse before building anything big if the render will not fit the budget
+	const std::array<long long, kMemoryCategories> memory_estimate = estimate_memory(options, world, accel_name, image_width, image_height);
+	const long long memory_estimate_total = std::accumulate(memory_estimate.begin(), memory_estimate.end(), 0LL);
+	std::cout << "Memory estimate: " << format_bytes(memory_estimate_total) << " (" << describe_memory(memory_estimate) << ")\n";
+	const long long memory_budget = static_cast<long long>(options.memory_budget_mb) << 20;
+	if (memory_budget > 0 && memory_estimate_total > memory_budget)
+		throw std::runtime_error("The render needs about " + format_bytes(memory_estimate_total) + ", more than the --memory-budget of "
+								 + format_bytes(memory_budget) + " (" + describe_memory(memory_estimate) + ").");
+	MemoryLedger& memory = memory_ledger();
+	memory.add(MemoryCategory::Primitives, primitive_bytes(world));
+	memory.add(MemoryCategory::Materials, material_bytes(world));
+
+	Camera camera = build_camera(aspect_ratio, options);
+	std::vector<Color> framebuffer(image_width * image_height);
+	memory.add(MemoryCategory::Framebuffers, static_cast<long long>(framebuffer.capacity() * sizeof(Color)));
+
+	const Crop crop = render_window(options.crop, image_width, image_height);
+	
+	// --importance: the same total number of samples over the window, spent where the mask is
+	// bright
+	std::vector<int> pixel_samples;
+	int max_pixel_samples = samples_per_pixel;
+	if (!options.importance.empty()) {
+		int mask_width = 0, mask_height = 0;
+		std::vector<int> mask = read_image(options.importance, mask_width, mask_height);
+		std::vector<double> importance(mask.size() / 3);
+		for (size_t p = 0; p < importance.size(); ++p)
+			importance[p] = (mask[3 * p] + mask[3 * p + 1] + mask[3 * p + 2]) / (3.0 * 255.0);
+		pixel_samples = allocate_samples(importance, mask_width, mask_height, image_width, image_height, crop, samples_per_pixel, options.importance_min_spp);
+		memory.add(MemoryCategory::Framebuffers, static_cast<long long>(pixel_samples.capacity() * sizeof(int)));
+		int fewest = max_pixel_samples = pixel_samples[crop.y0 * image_width + crop.x0];
+		for (int y = crop.y0; y < crop.y1; ++y) {
+			auto row = pixel_samples.begin() + y * image_width;
+			auto range = std::minmax_element(row + crop.x0, row + crop.x1);
+			fewest = std::min(fewest, *range.first);
+			max_pixel_samples = std::max(max_pixel_samples, *range.second);
+		}
+		std::cout << "Importance mask " << options.importance << " (" << mask_width << "x" << mask_height << "): "
+				  << fewest << " to " << max_pixel_samples << " samples per pixel\n";
+	}
+	memory.add(MemoryCategory::Scratch, static_cast<long long>(omp_get_max_threads()) * 2 * max_pixel_samples * sizeof(double));
+
+	// --cache-dir: tiles an earlier render of the same inputs finished are loaded instead of
+	// traced. with --footprints, so are the tiles of the last render with these settings that a
+	// material edit did not touch. with all of them there, nothing is built or rendered
+	std::unique_ptr<RenderCache> cache;
+	std::vector<SceneEntry> scene_entries;
+	uint64_t settings = 0, cache_key = 0;
+	std::vector<Crop> missing_tiles, reused_tiles;
+	std::vector<TileFootprint> reused_footprints;
+	FootprintSet footprints;
+	if (!options.cache_dir.empty()) {
+		cache = std::make_unique<RenderCache>(options.cache_dir, static_cast<long long>(options.cache_size_mb) << 20);
+		scene_entries = describe_scene(world);
+		settings = settings_key(camera, image_width, image_height, samples_per_pixel, max_depth, options.direct_lighting, pixel_samples);
+		cache_key = RenderCache::scene_key(settings, scene_entries);
+		std::vector<Crop> tiles = RenderCache::tiles(crop, image_width, image_height);
+		for (const Crop& tile : tiles)
+			if (!cache->load(cache_key, tile, framebuffer, image_width))
+				missing_tiles.push_back(tile);
+		char key_text[20];
+		std::snprintf(key_text, sizeof(key_text), "%016llx", static_cast<unsigned long long>(cache_key));
+		std::cout << "Cache " << key_text << ": " << tiles.size() - missing_tiles.size() << " of " << tiles.size() << " tiles found in " << options.cache_dir << "\n";
+
+		std::vector<SceneEntry> previous;
+		if (options.footprints && !missing_tiles.empty() && cache->read_scene(settings, previous)) {
+			const uint64_t previous_key = RenderCache::scene_key(settings, previous);
+			SceneEdit edit = RenderCache::compare(previous, scene_entries);
+			if (previous_key != cache_key && edit.materials_only) {
+				std::vector<Crop> affected;
+				for (const Crop& tile : missing_tiles) {
+					TileFootprint footprint;
+					if (cache->load_unaffected(previous_key, tile, edit, framebuffer, image_width, footprint)) {
+						reused_tiles.push_back(tile);
+						reused_footprints.push_back(footprint);
+					} else {
+						affected.push_back(tile);
+					}
+				}
+				missing_tiles.swap(affected);
+				std::cout << "Edit: " << edit.changed.size() << " primitives changed material since the last render with these settings, "
+						  << reused_tiles.size() << " tiles unaffected, " << missing_tiles.size() << " to render\n";
+			} else if (previous_key != cache_key) {
+				std::cout << "Edit: geometry or lights changed since the last render with these settings, every tile is rendered\n";
+			}
+		}
+		if (options.footprints) {
+			for (const SceneEntry& entry : scene_entries)
+				footprints.primitive_keys.push_back(entry.object);
+			footprints.tiles.resize(missing_tiles.size());
+		}
+	}
+	// what the cache keeps of this render: the tiles traced now and the ones taken over from
+	// before the edit (under the new key), and the scene, for the next edit
+	auto update_cache = [&]() {
+		for (size_t t = 0; t < missing_tiles.size(); ++t)
+			cache->store(cache_key, missing_tiles[t], framebuffer, image_width, options.footprints ? &footprints.tiles[t] : nullptr);
+		for (size_t t = 0; t < reused_tiles.size(); ++t)
+			cache->store(cache_key, reused_tiles[t], framebuffer, image_width, &reused_footprints[t]);
+		if (options.footprints)
+			cache->write_scene(settings, scene_entries);
+		cache->evict();
+	};
+	if (cache && missing_tiles.empty()) {
+		update_cache();
+		clear_outside_crop(framebuffer, image_width, image_height, crop);
+		write_image_atomic(options.output, framebuffer, image_width, image_height, samples_per_pixel);
+		if (!options.reference.empty())
+			compare_to_reference(options.output, options.reference);
+		std::cout << "Nothing to render, " << options.output << " written from the cache\n";
+		return 0;
+	}
 
-	HittableList world = build_scene();
 	std::cout << "Building BVH...\n";
 	auto start_bvh = std::chrono::high_resolution_clock::now();
-	BVHNode bvh_tree(world);
+	std::shared_ptr<Hittable> accel = build_accel(world, accel_name, options.lazy_levels);
 	auto end_bvh = std::chrono::high_resolution_clock::now();
 	std::chrono::duration<double> bvh_duration = end_bvh - start_bvh;
 	std::cout << "BVH built in " << bvh_duration.count() << " seconds" << std::endl;
+	const long long bvh_bytes = static_cast<long long>(accel->memory_bytes());
+	memory.add(MemoryCategory::Bvh, bvh_bytes);
+	if (LiveMetrics* live = live_metrics())
+		live->set_accel(describe_accel(*accel, accel_name, world.objects.size(), bvh_duration.count()));
+	energy.mark("bvh");
 
-	// HittableList world = build_scene();
-	Camera camera = build_camera(aspect_ratio);
-	std::vector<Color> framebuffer(image_width * image_height);
-	
-	render_image(
+	// direct light sampling needs emitters; without any it would only cost time
+	LightSet lights(world, options.occluder_cache);
+	const LightSet* direct = (options.direct_lighting && !lights.empty()) ? &lights : nullptr;
+
+	std::unique_ptr<BidirectionalIntegrator> bidirectional;
+	if (options.integrator == "bdpt") {
+		bidirectional = std::make_unique<BidirectionalIntegrator>(world, camera, image_width, image_height, max_depth);
+		memory.add(MemoryCategory::Framebuffers, static_cast<long long>(bidirectional->splat_bytes()));
+		memory.add(MemoryCategory::Scratch, static_cast<long long>(bidirectional->scratch_bytes()));
+	}
+
+	std::unique_ptr<MetropolisIntegrator> metropolis;
+	if (options.integrator == "mlt") {
+		MetropolisSettings settings;
+		settings.chains = options.mlt_chains;
+		settings.bootstrap = options.mlt_bootstrap;
+		settings.sigma = options.mlt_sigma;
+		settings.large_step_probability = options.mlt_large_step;
+		metropolis = std::make_unique<MetropolisIntegrator>(camera, image_width, image_height, max_depth, crop, settings);
+		memory.add(MemoryCategory::Framebuffers, static_cast<long long>(metropolis->splat_bytes()));
+		memory.add(MemoryCategory::Scratch, static_cast<long long>(metropolis->scratch_bytes()));
+	}
+
+	std::unique_ptr<RouletteCache> roulette;
+	if (options.roulette) {
+		roulette = std::make_unique<RouletteCache>(world);
+		// the per thread tables are allocated on first use, charge them now
+		memory.add(MemoryCategory::Scratch, static_cast<long long>(RouletteCache::table_bytes(omp_get_max_threads())));
+	}
+
+	std::unique_ptr<RenderGovernor> governor;
+	if (options.max_temperature > 0 || options.max_power > 0 || !options.governor_log.empty()) {
+		GovernorSettings settings;
+		settings.thermal_root = options.thermal_root;
+		settings.powercap_root = options.powercap_root;
+		settings.max_temperature = options.max_temperature;
+		settings.max_power = options.max_power;
+		settings.interval = options.governor_interval;
+		settings.log = options.governor_log;
+		governor = std::make_unique<RenderGovernor>(settings, omp_get_max_threads());
+	}
+
+	// the plain renderer reports its rows; the other modes run loops of their own
+	std::unique_ptr<ProgressReporter> progress;
+	const bool plain = !bidirectional && !metropolis && !roulette && options.upscale == 1 && !options.progressive;
+	if (options.progress_interval > 0 && plain)
+		progress = std::make_unique<ProgressReporter>(cache ? std::accumulate(missing_tiles.begin(), missing_tiles.end(), 0LL, [](long long rows, const Crop& tile) { return rows + tile.y1 - tile.y0; })
+															 : crop.y1 - crop.y0, options.progress_interval, options.status_file);
+
+	RenderHooks hooks;
+	hooks.pixel_samples = pixel_samples.empty() ? nullptr : &pixel_samples;
+	hooks.governor = governor.get();
+	hooks.progress = progress.get();
+	hooks.tiles = cache ? &missing_tiles : nullptr;
+	hooks.footprints = options.footprints ? &footprints : nullptr;
+
+	energy.mark("setup");
+	auto start_render = std::chrono::high_resolution_clock::now();
+	if (governor)
+		governor->start();
+	if (progress)
+		progress->start();
+	RenderStats stats = bidirectional
+		? render_bidirectional(framebuffer, image_width, image_height, samples_per_pixel, *bidirectional, *accel, crop)
+		: metropolis
+		? render_metropolis(framebuffer, samples_per_pixel, *metropolis, *accel, direct, crop)
+		: roulette
+		? render_roulette(
 			framebuffer,
 			image_width, image_height,
 			samples_per_pixel,
-			camera, bvh_tree, max_depth
-	);
+			camera, *accel, max_depth, direct, crop, *roulette
+		)
+		: (options.upscale > 1)
+		? render_upscaled(
+			framebuffer,
+			image_width, image_height,
+			samples_per_pixel,
+			camera, *accel, max_depth, direct, options.interleave, options.upscale, governor.get()
+		)
+		: options.progressive
+		? render_progressive(
+			framebuffer,
+			image_width, image_height,
+			samples_per_pixel,
+			camera, *accel, max_depth, direct, crop, options.output
+		)
+		: render_image(
+			framebuffer,
+			image_width, image_height,
+			samples_per_pixel,
+			camera, *accel, max_depth, direct, options.interleave, crop, hooks
+		);
+	if (progress)
+		progress->stop();
+	if (governor)
+		governor->stop();
+	long long rays_traced = stats.rays_traced;
+	auto end_render = std::chrono::high_resolution_clock::now();
+	energy.mark("render");
+	std::chrono::duration<double> render_duration = end_render - start_render;
+
+	if (cache) {
+		update_cache();
+		// the tiles were traced whole, the image only shows the crop
+		clear_outside_crop(framebuffer, image_width, image_height, crop);
+	}
 	
-	write_image(
-		"output/image.ppm",
+	write_image_atomic(
+		options.output,
 		framebuffer,
 		image_width, image_height,
 		samples_per_pixel
 	);
+
+	if (!options.reference.empty())
+		compare_to_reference(options.output, options.reference);
+	energy.mark("output");
+
+	// lazy subtrees built during the render
+	memory.add(MemoryCategory::Bvh, static_cast<long long>(accel->memory_bytes()) - bvh_bytes);
+
+	if (auto bvh = std::dynamic_pointer_cast<BVHNode>(accel); bvh && options.lazy_levels >= 0) {
+		size_t built = 0, total = 0;
+		bvh->count_lazy(built, total);
+		std::cout << "Lazy BVH: " << built << " of " << total << " deferred subtrees were built\n";
+	}
+
+	if (direct) {
+		DirectLightStats light_stats = lights.stats();
+		std::cout << "Direct lighting: " << lights.size() << " lights, " << light_stats.shadow_rays << " shadow rays, "
+				  << light_stats.traversals << " full walks (" << light_stats.traversal_visits << " node visits)\n";
+		if (lights.caching())
+			std::cout << "  occluder cache: " << light_stats.hit_rate() * 100 << "% hit rate ("
+					  << light_stats.cache_hits << " of " << light_stats.cache_hits + light_stats.cache_misses
+					  << "), ~" << static_cast<long long>(light_stats.saved_visits()) << " node visits saved\n";
+	}
+
+	if (bidirectional) {
+		BidirectionalStats bdpt_stats = bidirectional->stats();
+		std::cout << "Bidirectional: " << bdpt_stats.light_paths << " light paths, " << bdpt_stats.connections
+				  << " connections, " << bdpt_stats.splats << " light tracing splats\n";
+	}
+
+	if (metropolis) {
+		MetropolisStats mlt_stats = metropolis->stats();
+		std::cout << "Metropolis: " << metropolis->config().chains << " chains, " << mlt_stats.mutations << " mutations ("
+				  << mlt_stats.large_steps << " large), " << mlt_stats.acceptance() * 100 << "% accepted, normalization "
+				  << mlt_stats.normalization << "\n";
+	}
+
+	if (governor) {
+		const GovernorSummary& summary = governor->summary();
+		std::cout << "Governor: " << summary.readings << " readings";
+		if (!std::isnan(summary.peak_temperature))
+			std::cout << ", peak " << summary.peak_temperature << " C";
+		if (!std::isnan(summary.mean_power))
+			std::cout << ", mean " << summary.mean_power << " W";
+		std::cout << ", down to " << summary.fewest_workers << " of " << omp_get_max_threads()
+				  << " workers, longest pause " << summary.longest_pause_ms << " ms\n";
+	}
+
+	if (cache) {
+		const CacheStats& cache_stats = cache->stats();
+		std::cout << "Cache: " << cache_stats.hits << " tiles reused, ";
+		if (options.footprints)
+			std::cout << cache_stats.reused << " kept and " << cache_stats.invalidated << " invalidated by the edit, ";
+		std::cout << cache_stats.stored << " stored, " << cache_stats.evicted
+				  << " evicted, " << format_bytes(cache_stats.bytes) << " of " << options.cache_size_mb << " MiB in use\n";
+	}
+
+	if (roulette) {
+		RouletteStats roulette_stats = roulette->total_stats();
+		std::cout << "Roulette: " << roulette->cell_count() << " cells learned, " << roulette_stats.vertices << " vertices, "
+				  << roulette_stats.terminated << " terminated, " << roulette_stats.split << " split\n";
+	}
+
+	std::cout << "Summary:\n"
+			  << "  scene:       " << world.objects.size() << " primitives, " << accel_name << " accel\n"
+			  << "  kernels:     " << isa_name(isa) << " (cpu supports " << isa_name(detected_isa) << ")\n"
+			  << "  threads:     " << omp_get_max_threads() << "\n"
+			  << "  traversal:   " << (options.interleave > 0 ? "interleaved, group of " + std::to_string(options.interleave) : std::string("one ray at a time")) << (options.progressive ? ", progressive" : "")
+			  << (options.upscale > 1 ? ", paths at 1/" + std::to_string(options.upscale) + " resolution" : std::string()) << "\n"
+			  << "  first pixel: " << bvh_duration.count() + stats.first_pixel_seconds << " seconds after BVH build started\n"
+			  << "  render time: " << render_duration.count() << " seconds\n"
+			  << "  rays:        " << rays_traced << " (" << rays_traced / render_duration.count() / 1e6 << " Mrays/s)\n";
+	std::array<long long, kMemoryCategories> memory_peaks{};
+	for (int c = 0; c < kMemoryCategories; ++c)
+		memory_peaks[c] = memory.peak(static_cast<MemoryCategory>(c));
+	std::cout << "  memory:      peak " << format_bytes(memory.peak_total()) << " tracked, estimate was "
+			  << format_bytes(memory_estimate_total) << "\n"
+			  << "               peaks: " << describe_memory(memory_peaks) << "\n";
+	if (long long rss = process_peak_bytes(); rss >= 0)
+		std::cout << "               process peak resident: " << format_bytes(rss) << "\n";
+	if (energy.available()) {
+		std::cout << "  energy:     ";
+		for (const auto& phase : energy.phases()) {
+			std::cout << " " << phase.name << " " << phase.package_joules << " J";
+			if (energy.has_dram())
+				std::cout << " (+" << phase.dram_joules << " J dram)";
+			std::cout << (&phase == &energy.phases().back() ? "\n" : ",");
+		}
+		const EnergyMeter::Phase* render = energy.find("render");
+		double joules = render->package_joules + render->dram_joules;
+		std::cout << "  efficiency:  " << (joules > 0 ? rays_traced / joules / 1e6 : 0.0) << " Mrays/J over the render ("
+				  << joules / render->seconds << " W)\n";
+	} else {
+		std::cout << "  energy:      no RAPL domains under " << options.powercap_root << "\n";
+	}
 	
 	return 0;
-}
\ No newline at end of file
+}
+
+int main(int argc, char** argv) {
+	try {
+		return run(parse_options(argc, argv));
+	} catch (const std::exception& e) {
+		std::cerr << "rayfloat: " << e.what() << std::endl;
+		return 1;
+	}
+}
@@ -0,0 +1,42 @@
+# drops two jobs into a fresh spool under WORK, the less important one first in name order,
+# and runs the daemon until it has been idle for a moment. the more important job has to finish
+# first, both have to leave name.job.done, a name.status that says they are done with every
+# tile, and an image within MAX_RMSE of REFERENCE
+include(${CMAKE_CURRENT_LIST_DIR}/image_rmse.cmake)
+
+file(REMOVE_RECURSE ${WORK})
+file(MAKE_DIRECTORY ${WORK})
+file(WRITE ${WORK}/a_low.job "# rendered second\npriority=1\nwidth=96\nspp=64\n")
+file(WRITE ${WORK}/b_high.job "# rendered first\npriority=5\nwidth=96\nspp=64\n")
+
+execute_process(
+    COMMAND ${RAYFLOAT} --daemon=${WORK} --idle-exit=0.5
+    RESULT_VARIABLE result
+    OUTPUT_VARIABLE output
+    ERROR_VARIABLE errors
+)
+if(NOT result EQUAL 0)
+    message(FATAL_ERROR "rayfloat --daemon failed (${result}):\n${output}${errors}")
+endif()
+
+string(FIND "${output}" "Job b_high done" high)
+string(FIND "${output}" "Job a_low done" low)
+if(high EQUAL -1 OR low EQUAL -1 OR NOT high LESS low)
+    message(FATAL_ERROR "the priority 5 job did not finish before the priority 1 job:\n${output}${errors}")
+endif()
+
+foreach(job a_low b_high)
+    if(NOT EXISTS ${WORK}/${job}.job.done OR EXISTS ${WORK}/${job}.job)
+        message(FATAL_ERROR "${job}.job was not renamed to ${job}.job.done")
+    endif()
+    file(READ ${WORK}/${job}.status status)
+    if(NOT status MATCHES "state=done\n" OR NOT status MATCHES "tiles_done=([0-9]+)\ntiles_total=([0-9]+)\n"
+       OR NOT CMAKE_MATCH_1 EQUAL CMAKE_MATCH_2 OR CMAKE_MATCH_1 EQUAL 0)
+        message(FATAL_ERROR "${job}.status does not say the job is done with every tile:\n${status}")
+    endif()
+    image_rmse(${WORK}/${job}.ppm ${REFERENCE} rmse)
+    message(STATUS "${job}.ppm: rmse ${rmse} against ${REFERENCE} (at most ${MAX_RMSE})")
+    if(rmse GREATER MAX_RMSE)
+        message(FATAL_ERROR "${job}.ppm has rmse ${rmse} against ${REFERENCE}, more than ${MAX_RMSE}")
+    endif()
+endforeach()
@@ -0,0 +1,37 @@
+# image_rmse(a b variable): the rmse between two ascii ppm (P3) images over their 8 bit channel
+# values, the measure --reference prints. cmake math is integer only, so the mean square is
+# taken in ten thousandths and its root (Newton's method) comes out in hundredths
+function(image_rmse a b variable)
+    foreach(image a b)
+        file(READ ${${image}} text)
+        string(REGEX MATCHALL "[0-9]+" ${image}_values "${text}")
+        list(POP_FRONT ${image}_values magic ${image}_width ${image}_height maximum)
+    endforeach()
+    if(NOT a_width EQUAL b_width OR NOT a_height EQUAL b_height)
+        message(FATAL_ERROR "${a} is ${a_width}x${a_height}, ${b} is ${b_width}x${b_height}")
+    endif()
+
+    set(squared 0)
+    foreach(x y IN ZIP_LISTS a_values b_values)
+        math(EXPR squared "${squared} + (${x} - ${y}) * (${x} - ${y})")
+    endforeach()
+    list(LENGTH a_values count)
+    math(EXPR mean "${squared} * 10000 / ${count}")
+
+    set(root ${mean})
+    set(next 0)
+    if(mean GREATER 0)
+        math(EXPR next "(${root} + ${mean} / ${root}) / 2")
+    endif()
+    while(next LESS root)
+        set(root ${next})
+        math(EXPR next "(${root} + ${mean} / ${root}) / 2")
+    endwhile()
+
+    math(EXPR whole "${root} / 100")
+    math(EXPR hundredths "${root} % 100")
+    if(hundredths LESS 10)
+        set(hundredths 0${hundredths})
+    endif()
+    set(${variable} ${whole}.${hundredths} PARENT_SCOPE)
+endfunction()
@@ -0,0 +1,60 @@
+# renders ARGS with --metrics-file=METRICS and checks the file is valid Prometheus text
+# exposition: every family a # HELP then a # TYPE line, its samples right after them, under its
+# name, with labels and a number. the ray counter has to have counted something, and every
+# worker needs a busy ratio between 0 and 1
+file(REMOVE ${METRICS})
+separate_arguments(arguments UNIX_COMMAND "${ARGS}")
+execute_process(
+    COMMAND ${RAYFLOAT} ${arguments} --metrics-file=${METRICS}
+    RESULT_VARIABLE result
+    OUTPUT_VARIABLE output
+    ERROR_VARIABLE errors
+)
+if(NOT result EQUAL 0)
+    message(FATAL_ERROR "rayfloat ${ARGS} failed (${result}):\n${output}${errors}")
+endif()
+
+file(STRINGS ${METRICS} lines)
+set(family)
+set(expect_type OFF)
+set(families 0)
+foreach(line IN LISTS lines)
+    if(expect_type)
+        if(NOT line MATCHES "^# TYPE ${family} (counter|gauge)$")
+            message(FATAL_ERROR "${METRICS}: # HELP ${family} is not followed by its # TYPE: '${line}'")
+        endif()
+        if(CMAKE_MATCH_1 STREQUAL "counter" AND NOT family MATCHES "_total$")
+            message(FATAL_ERROR "${METRICS}: the counter ${family} does not end in _total")
+        endif()
+        set(expect_type OFF)
+    elseif(line MATCHES "^# HELP (rayfloat_[a-z_]+) [^ ]")
+        set(family ${CMAKE_MATCH_1})
+        set(expect_type ON)
+        math(EXPR families "${families} + 1")
+    elseif(line MATCHES "^([a-z_]+)({[a-z_]+=\"[^\"]*\"(,[a-z_]+=\"[^\"]*\")*})? ([-+]?[0-9.]+([eE][-+]?[0-9]+)?|NaN|[-+]Inf)$")
+        if(NOT CMAKE_MATCH_1 STREQUAL family)
+            message(FATAL_ERROR "${METRICS}: the sample '${line}' is not under its own # HELP and # TYPE")
+        endif()
+    else()
+        message(FATAL_ERROR "${METRICS}: not a valid exposition line: '${line}'")
+    endif()
+endforeach()
+if(expect_type OR families EQUAL 0)
+    message(FATAL_ERROR "${METRICS} ends without a metric family:\n${lines}")
+endif()
+
+file(READ ${METRICS} text)
+if(NOT text MATCHES "\nrayfloat_rays_total ([0-9]+)\n" OR CMAKE_MATCH_1 EQUAL 0)
+    message(FATAL_ERROR "${METRICS} counted no rays:\n${text}")
+endif()
+string(REGEX MATCHALL "rayfloat_thread_busy_ratio{thread=\"[0-9]+\"} [^\n]+" ratios "${text}")
+if(NOT ratios)
+    message(FATAL_ERROR "${METRICS} has no rayfloat_thread_busy_ratio{thread=...}:\n${text}")
+endif()
+foreach(ratio IN LISTS ratios)
+    string(REGEX REPLACE ".* " "" value "${ratio}")
+    if(value LESS 0 OR value GREATER 1)
+        message(FATAL_ERROR "${METRICS}: ${ratio} is not a ratio")
+    endif()
+endforeach()
+message(STATUS "${families} metric families, ${ratios}")
@@ -0,0 +1,265 @@
+// checks the batch queries (ray_query.h, proximity_query.h) against brute force over the
+// scene's spheres, on a fixed random scene. prints what it checked and exits 1 at the first
+// mismatch
+#include "vec3.h"
+#include "sphere.h"
+#include "hittable_list.h"
+#include "material.h"
+#include "ray_query.h"
+#include "proximity_query.h"
+
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include <cmath>
+#include <stdexcept>
+#include <algorithm>
+#include <numeric>
+
+namespace {
+
+constexpr int kSpheres = 3000;
+constexpr int kRays = 20000;
+constexpr int kPoints = 2000;
+constexpr int kNearest = 5;
+
+struct Scene {
+	HittableList world;
+	std::vector<const Sphere*> spheres;
+};
+
+// spheres of mixed sizes in a 4 x 2 x 4 box, some overlapping
+Scene build_scene() {
+	Scene scene;
+	auto material = std::make_shared<Lambertian>(Color(0.5, 0.5, 0.5));
+	for (int i = 0; i < kSpheres; ++i) {
+		Vec3 center(random_double(-2.0, 2.0), random_double(-1.0, 1.0), random_double(-4.0, 0.0));
+		auto sphere = std::make_shared<Sphere>(center, random_double(0.01, 0.08), material);
+		sphere->id = i;
+		scene.spheres.push_back(sphere.get());
+		scene.world.add(sphere);
+	}
+	return scene;
+}
+
+void check(bool condition, const std::string& what) {
+	if (!condition)
+		throw std::runtime_error(what);
+}
+
+bool same_distance(double a, double b) {
+	return std::abs(a - b) <= 1e-9 * std::max(1.0, std::abs(b));
+}
+
+// rays from all over the box in every direction. half of them are segments (t_max 0.5) so
+// the occlusion query sees both answers
+struct Rays {
+	std::vector<double> ox, oy, oz, dx, dy, dz, t_min, t_max;
+	RayBatch batch;
+
+	Rays() {
+		for (int i = 0; i < kRays; ++i) {
+			ox.push_back(random_double(-2.5, 2.5));
+			oy.push_back(random_double(-1.5, 1.5));
+			oz.push_back(random_double(-4.5, 0.5));
+			Vec3 d = random_unit_vector();
+			dx.push_back(d.x);
+			dy.push_back(d.y);
+			dz.push_back(d.z);
+			t_min.push_back(0.001);
+			t_max.push_back(i % 2 ? 0.5 : INFINITY);
+		}
+		batch.count = kRays;
+		batch.origin_x = ox.data(); batch.origin_y = oy.data(); batch.origin_z = oz.data();
+		batch.direction_x = dx.data(); batch.direction_y = dy.data(); batch.direction_z = dz.data();
+		batch.t_min = t_min.data();
+		batch.t_max = t_max.data();
+	}
+
+	Ray ray(int i) const { return Ray(Vec3(ox[i], oy[i], oz[i]), Vec3(dx[i], dy[i], dz[i])); }
+};
+
+// RayQuery::intersect (sorted or not) and RayQuery::occluded against Sphere::hit on every sphere
+void check_ray_query(const Scene& scene, const Rays& rays, bool sort) {
+	RayQueryOptions options;
+	options.sort = sort;
+	RayQuery query(scene.world, options);
+
+	std::vector<double> t(kRays), nx(kRays), ny(kRays), nz(kRays);
+	std::vector<int32_t> primitive(kRays);
+	HitBatch hits;
+	hits.t = t.data();
+	hits.primitive = primitive.data();
+	hits.normal_x = nx.data(); hits.normal_y = ny.data(); hits.normal_z = nz.data();
+	query.intersect(rays.batch, hits);
+	std::vector<uint8_t> occluded(kRays);
+	query.occluded(rays.batch, occluded.data());
+
+	int hit_count = 0;
+	for (int i = 0; i < kRays; ++i) {
+		Ray ray = rays.ray(i);
+		int closest = -1;
+		double closest_t = rays.t_max[i];
+		for (int s = 0; s < kSpheres; ++s) {
+			HitRecord record;
+			if (scene.spheres[s]->hit(ray, rays.t_min[i], closest_t, record)) {
+				closest = s;
+				closest_t = record.t;
+			}
+		}
+		std::ostringstream where;
+		where << "ray " << i << (sort ? " (sorted)" : "") << ": ";
+		check(primitive[i] == closest, where.str() + "intersect says primitive " + std::to_string(primitive[i]) + ", brute force " + std::to_string(closest));
+		check(occluded[i] == (closest >= 0), where.str() + "occluded disagrees with brute force");
+		if (closest < 0) {
+			check(std::isinf(t[i]), where.str() + "a miss has a finite t");
+			continue;
+		}
+		check(same_distance(t[i], closest_t), where.str() + "t " + std::to_string(t[i]) + ", brute force " + std::to_string(closest_t));
+		const Sphere& sphere = *scene.spheres[closest];
+		Vec3 normal = (ray.at(closest_t) - sphere.center) / sphere.radius;
+		check(same_distance(nx[i], normal.x) && same_distance(ny[i], normal.y) && same_distance(nz[i], normal.z),
+			  where.str() + "the normal is not the outward one");
+		++hit_count;
+	}
+	std::cout << "RayQuery" << (sort ? " (sorted)" : "") << ": " << hit_count << " of " << kRays
+			  << " rays hit, every hit and occlusion as brute force\n";
+}
+
+// unsigned distance from p to the sphere's surface, what the proximity queries measure
+double surface_distance(const Sphere& sphere, const Vec3& p) {
+	return std::abs((p - sphere.center).length() - sphere.radius);
+}
+
+// the ids of the spheres keep() accepts, in order
+template <class KeepFn>
+std::vector<int32_t> brute_force_overlaps(const Scene& scene, KeepFn keep) {
+	std::vector<int32_t> ids;
+	for (int s = 0; s < kSpheres; ++s)
+		if (keep(*scene.spheres[s]))
+			ids.push_back(s);
+	return ids;
+}
+
+void check_overlaps(const OverlapResult& result, size_t i, std::vector<int32_t> expected, const std::string& what) {
+	std::vector<int32_t> found(result.primitives.begin() + result.offsets[i], result.primitives.begin() + result.offsets[i + 1]);
+	std::sort(found.begin(), found.end());
+	check(found == expected, what + " " + std::to_string(i) + ": " + std::to_string(found.size()) + " overlaps, brute force "
+		  + std::to_string(expected.size()));
+}
+
+// ProximityQuery's nearest (with and without a search radius), k nearest and overlap queries
+// against a scan of every sphere
+void check_proximity_query(const Scene& scene) {
+	ProximityQuery query(scene.world);
+
+	std::vector<double> x, y, z, radius, max_distance;
+	for (int i = 0; i < kPoints; ++i) {
+		x.push_back(random_double(-2.5, 2.5));
+		y.push_back(random_double(-1.5, 1.5));
+		z.push_back(random_double(-4.5, 0.5));
+		radius.push_back(random_double(0.0, 0.3));
+		max_distance.push_back(i % 2 ? 0.05 : INFINITY);
+	}
+	PointBatch points;
+	points.count = kPoints;
+	points.x = x.data(); points.y = y.data(); points.z = z.data();
+
+	std::vector<int32_t> nearest_primitive(kPoints), bounded_primitive(kPoints), k_primitive(kPoints * kNearest);
+	std::vector<double> nearest_distance(kPoints), bounded_distance(kPoints), k_distance(kPoints * kNearest);
+	std::vector<double> px(kPoints), py(kPoints), pz(kPoints);
+	NearestBatch nearest;
+	nearest.primitive = nearest_primitive.data();
+	nearest.distance = nearest_distance.data();
+	nearest.point_x = px.data(); nearest.point_y = py.data(); nearest.point_z = pz.data();
+	query.nearest(points, nearest);
+	query.k_nearest(points, kNearest, k_primitive.data(), k_distance.data());
+
+	PointBatch bounded_points = points;
+	bounded_points.max_distance = max_distance.data();
+	NearestBatch bounded;
+	bounded.primitive = bounded_primitive.data();
+	bounded.distance = bounded_distance.data();
+	query.nearest(bounded_points, bounded);
+
+	// boxes and spheres of the query radius around the same points
+	std::vector<double> min_x, min_y, min_z, max_x, max_y, max_z;
+	for (int i = 0; i < kPoints; ++i) {
+		min_x.push_back(x[i] - radius[i]); min_y.push_back(y[i] - radius[i]); min_z.push_back(z[i] - radius[i]);
+		max_x.push_back(x[i] + radius[i]); max_y.push_back(y[i] + radius[i]); max_z.push_back(z[i] + radius[i]);
+	}
+	BoxBatch boxes;
+	boxes.count = kPoints;
+	boxes.min_x = min_x.data(); boxes.min_y = min_y.data(); boxes.min_z = min_z.data();
+	boxes.max_x = max_x.data(); boxes.max_y = max_y.data(); boxes.max_z = max_z.data();
+	OverlapResult box_overlaps;
+	query.overlap_boxes(boxes, box_overlaps);
+	SphereBatch spheres;
+	spheres.count = kPoints;
+	spheres.center_x = x.data(); spheres.center_y = y.data(); spheres.center_z = z.data();
+	spheres.radius = radius.data();
+	OverlapResult sphere_overlaps;
+	query.overlap_spheres(spheres, sphere_overlaps);
+
+	size_t overlap_count = 0;
+	for (int i = 0; i < kPoints; ++i) {
+		Vec3 p(x[i], y[i], z[i]);
+		std::vector<int> order(kSpheres);
+		std::iota(order.begin(), order.end(), 0);
+		std::vector<double> distance(kSpheres);
+		for (int s = 0; s < kSpheres; ++s)
+			distance[s] = surface_distance(*scene.spheres[s], p);
+		std::partial_sort(order.begin(), order.begin() + kNearest, order.end(), [&](int a, int b) { return distance[a] < distance[b]; });
+		const std::string where = "point " + std::to_string(i) + ": ";
+
+		const int closest = order[0];
+		check(nearest_primitive[i] == closest, where + "nearest says " + std::to_string(nearest_primitive[i]) + ", brute force " + std::to_string(closest));
+		check(same_distance(nearest_distance[i], distance[closest]), where + "the nearest distance differs from brute force");
+		const Sphere& sphere = *scene.spheres[closest];
+		Vec3 surface = sphere.center + sphere.radius * (p - sphere.center) / (p - sphere.center).length();
+		check(same_distance(px[i], surface.x) && same_distance(py[i], surface.y) && same_distance(pz[i], surface.z),
+			  where + "the nearest point is not on the nearest surface");
+
+		const bool in_range = distance[closest] <= max_distance[i];
+		check(bounded_primitive[i] == (in_range ? closest : -1), where + "nearest within " + std::to_string(max_distance[i]) + " differs from brute force");
+
+		for (int k = 0; k < kNearest; ++k) {
+			check(k_primitive[i * kNearest + k] == order[k] && same_distance(k_distance[i * kNearest + k], distance[order[k]]),
+				  where + "nearest " + std::to_string(k + 1) + " of " + std::to_string(kNearest) + " differs from brute force");
+		}
+
+		const double r = radius[i];
+		check_overlaps(sphere_overlaps, i, brute_force_overlaps(scene, [&](const Sphere& s) {
+			return (s.center - p).length_squared() <= (s.radius + r) * (s.radius + r);
+		}), "overlap_spheres");
+		check_overlaps(box_overlaps, i, brute_force_overlaps(scene, [&](const Sphere& s) {
+			const double c[3] = { s.center.x, s.center.y, s.center.z };
+			const double q[3] = { p.x, p.y, p.z };
+			double d2 = 0;
+			for (int a = 0; a < 3; ++a) {
+				double gap = std::max(std::max(q[a] - r - c[a], c[a] - q[a] - r), 0.0);
+				d2 += gap * gap;
+			}
+			return d2 <= s.radius * s.radius;
+		}), "overlap_boxes");
+		overlap_count += sphere_overlaps.offsets[i + 1] - sphere_overlaps.offsets[i];
+	}
+	std::cout << "ProximityQuery: nearest, " << kNearest << " nearest and box and sphere overlaps of " << kPoints
+			  << " points (" << overlap_count << " sphere overlaps) as brute force\n";
+}
+
+}
+
+int main() {
+	try {
+		Scene scene = build_scene();
+		Rays rays;
+		check_ray_query(scene, rays, false);
+		check_ray_query(scene, rays, true);
+		check_proximity_query(scene);
+	} catch (const std::exception& e) {
+		std::cerr << "query_check: " << e.what() << "\n";
+		return 1;
+	}
+	return 0;
+}
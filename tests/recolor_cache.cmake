@@ -0,0 +1,38 @@
+# a material edit through the tile cache (--footprints) has to render the tiles the edited
+# primitive covers again: the edited image must be far closer to a fresh render of the edit
+# than the image from before the edit is. ARGS are the render's options, EDIT the --recolor
+include(${CMAKE_CURRENT_LIST_DIR}/image_rmse.cmake)
+
+file(REMOVE_RECURSE ${WORK})
+file(MAKE_DIRECTORY ${WORK})
+separate_arguments(arguments UNIX_COMMAND "${ARGS}")
+
+function(render name)
+    execute_process(
+        COMMAND ${RAYFLOAT} ${arguments} ${ARGN} --output=${WORK}/${name}.ppm
+        RESULT_VARIABLE result
+        OUTPUT_VARIABLE output
+        ERROR_VARIABLE errors
+    )
+    if(NOT result EQUAL 0)
+        message(FATAL_ERROR "rayfloat ${ARGS} ${ARGN} failed (${result}):\n${output}${errors}")
+    endif()
+    set(output "${output}" PARENT_SCOPE)
+endfunction()
+
+render(fresh --recolor=${EDIT})
+render(before --cache-dir=${WORK}/cache --footprints=on)
+image_rmse(${WORK}/before.ppm ${WORK}/fresh.ppm before_rmse)
+render(edited --cache-dir=${WORK}/cache --footprints=on --recolor=${EDIT})
+image_rmse(${WORK}/edited.ppm ${WORK}/fresh.ppm edited_rmse)
+
+if(NOT output MATCHES "Edit: 1 primitives changed material[^\n]*, ([0-9]+) to render")
+    message(FATAL_ERROR "the edit was not recognised as a material edit:\n${output}")
+endif()
+if(CMAKE_MATCH_1 EQUAL 0)
+    message(FATAL_ERROR "no tile was rendered again after the edit:\n${output}")
+endif()
+message(STATUS "${CMAKE_MATCH_1} tiles rendered again, rmse ${edited_rmse} after the edit, ${before_rmse} before it")
+if(NOT edited_rmse LESS before_rmse)
+    message(FATAL_ERROR "the edited image (rmse ${edited_rmse}) is no closer to a fresh render of the edit than the one before it (${before_rmse})")
+endif()
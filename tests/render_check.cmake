@@ -0,0 +1,61 @@
+# renders ARGS into OUTPUT and fails unless the run succeeds and the image is within MAX_RMSE
+# of REFERENCE. EXPECT (a regex) must match the run's output, stdout then stderr, and
+# STATUS_FILE must end up saying state=done. with REPEAT the render runs twice and the checks
+# apply to the second run; CLEAN is a directory removed first. IMAGES, if given, are the
+# files compared instead of OUTPUT (a sweep numbers its variants' images after it). with
+# FAILS the run has to fail instead, and only EXPECT is checked
+include(${CMAKE_CURRENT_LIST_DIR}/image_rmse.cmake)
+
+separate_arguments(arguments UNIX_COMMAND "${ARGS}")
+if(DEFINED STATUS_FILE)
+    file(REMOVE ${STATUS_FILE})
+endif()
+if(DEFINED CLEAN)
+    file(REMOVE_RECURSE ${CLEAN})
+endif()
+set(runs 1)
+if(REPEAT)
+    set(runs 2)
+endif()
+foreach(run RANGE 1 ${runs})
+    execute_process(
+        COMMAND ${RAYFLOAT} ${arguments} --output=${OUTPUT}
+        RESULT_VARIABLE result
+        OUTPUT_VARIABLE output
+        ERROR_VARIABLE errors
+    )
+    if(FAILS AND result EQUAL 0)
+        message(FATAL_ERROR "rayfloat ${ARGS} succeeded, it should have failed:\n${output}${errors}")
+    elseif(NOT FAILS AND NOT result EQUAL 0)
+        message(FATAL_ERROR "rayfloat ${ARGS} failed (${result}):\n${output}${errors}")
+    endif()
+endforeach()
+string(APPEND output "${errors}")
+
+if(FAILS)
+    if(DEFINED EXPECT AND NOT output MATCHES "${EXPECT}")
+        message(FATAL_ERROR "rayfloat ${ARGS}: output does not match '${EXPECT}':\n${output}")
+    endif()
+    return()
+endif()
+
+if(NOT DEFINED IMAGES)
+    set(IMAGES ${OUTPUT})
+endif()
+foreach(image ${IMAGES})
+    image_rmse(${image} ${REFERENCE} rmse)
+    message(STATUS "${image}: rmse ${rmse} against ${REFERENCE} (at most ${MAX_RMSE})")
+    if(rmse GREATER MAX_RMSE)
+        message(FATAL_ERROR "rayfloat ${ARGS}: ${image} has rmse ${rmse} against ${REFERENCE}, more than ${MAX_RMSE}")
+    endif()
+endforeach()
+
+if(DEFINED EXPECT AND NOT output MATCHES "${EXPECT}")
+    message(FATAL_ERROR "rayfloat ${ARGS}: output does not match '${EXPECT}':\n${output}")
+endif()
+if(DEFINED STATUS_FILE)
+    file(READ ${STATUS_FILE} status)
+    if(NOT status MATCHES "state=done")
+        message(FATAL_ERROR "${STATUS_FILE} does not say state=done:\n${status}")
+    endif()
+endif()
@@ -0,0 +1,108 @@
+// checks sensors.h against a stand-in powercap tree laid out as sysfs lays it out: two
+// packages with core and dram subdomains (listed both at the top and inside their package) and
+// a psys domain, whose energy already includes the packages'. prints what it checked and exits
+// 1 at the first mismatch
+#include "sensors.h"
+
+#include <iostream>
+#include <fstream>
+#include <filesystem>
+#include <string>
+#include <cmath>
+#include <stdexcept>
+
+namespace {
+
+namespace fs = std::filesystem;
+
+void check(bool condition, const std::string& what) {
+	if (!condition)
+		throw std::runtime_error(what);
+}
+
+void write(const fs::path& file, const std::string& text) {
+	std::ofstream out(file);
+	out << text << "\n";
+	if (!out)
+		throw std::runtime_error("Cannot write " + file.string() + ".");
+}
+
+// a domain directory with its name, counter and wrap range (microjoules)
+void add_domain(const fs::path& path, const std::string& name, long long energy, long long range) {
+	fs::create_directories(path);
+	write(path / "name", name);
+	write(path / "energy_uj", std::to_string(energy));
+	write(path / "max_energy_range_uj", std::to_string(range));
+}
+
+void set_energy(const fs::path& path, long long energy) {
+	write(path / "energy_uj", std::to_string(energy));
+}
+
+bool same_joules(double a, double b) {
+	return std::abs(a - b) < 1e-6;
+}
+
+void check_rapl(const fs::path& root) {
+	const long long range = 262143328850;
+	const fs::path package0 = root / "intel-rapl:0", package1 = root / "intel-rapl:2", psys = root / "intel-rapl:1";
+	add_domain(package0, "package-0", 1000000, range);
+	add_domain(package0 / "intel-rapl:0:0", "core", 0, range);
+	add_domain(package0 / "intel-rapl:0:1", "dram", 0, range);
+	add_domain(root / "intel-rapl:0:0", "core", 0, range);
+	add_domain(root / "intel-rapl:0:1", "dram", 0, range);
+	// the second package's counter is about to wrap
+	add_domain(package1, "package-1", range - 10000000, range);
+	add_domain(psys, "psys", 5000000, range);
+	// not a RAPL domain
+	add_domain(root / "dtpm", "dtpm", 0, range);
+
+	RaplDomains rapl(root.string());
+	check(!rapl.empty() && rapl.has_dram(), "the stand-in domains were not found");
+	check(same_joules(rapl.package_joules(), 0) && same_joules(rapl.dram_joules(), 0), "energy before the first update");
+
+	// package 0 +50 J, package 1 +20 J across its wrap, core +30 J, dram +5 J and psys +80 J
+	set_energy(package0, 51000000);
+	set_energy(package1, 10000000);
+	set_energy(package0 / "intel-rapl:0:0", 30000000);
+	set_energy(package0 / "intel-rapl:0:1", 5000000);
+	set_energy(psys, 85000000);
+	rapl.update();
+	check(same_joules(rapl.package_joules(), 70), "package energy " + std::to_string(rapl.package_joules()) + " J, expected 70 J (psys counted?)");
+	check(same_joules(rapl.dram_joules(), 5), "dram energy " + std::to_string(rapl.dram_joules()) + " J, expected 5 J");
+	std::cout << "RaplDomains: " << rapl.package_joules() << " J over two packages (one wrapped) without psys, "
+			  << rapl.dram_joules() << " J dram\n";
+}
+
+void check_thermal(const fs::path& root) {
+	for (int zone = 0; zone < 3; ++zone)
+		fs::create_directories(root / ("thermal_zone" + std::to_string(zone)));
+	write(root / "thermal_zone0" / "temp", "45000");
+	write(root / "thermal_zone1" / "temp", "92500");
+	// thermal_zone2 has no temp file and is skipped
+	fs::create_directories(root / "cooling_device0");
+	write(root / "cooling_device0" / "temp", "99000");
+
+	ThermalZones zones(root.string());
+	check(zones.size() == 2, std::to_string(zones.size()) + " thermal zones, expected 2");
+	check(zones.hottest() == 92.5, "hottest zone " + std::to_string(zones.hottest()) + " C, expected 92.5 C");
+	std::cout << "ThermalZones: hottest of " << zones.size() << " zones is " << zones.hottest() << " C\n";
+}
+
+}
+
+int main() {
+	const fs::path root = fs::temp_directory_path() / "rayfloat_sensors_check";
+	int status = 0;
+	try {
+		fs::remove_all(root);
+		check_rapl(root / "powercap");
+		check_thermal(root / "thermal");
+	} catch (const std::exception& e) {
+		std::cerr << "sensors_check: " << e.what() << "\n";
+		status = 1;
+	}
+	std::error_code error;
+	fs::remove_all(root, error);
+	return status;
+}